@@ -0,0 +1,137 @@
+/*
+ * capture_dat [-L milliseconds] [-v verbosity] tape-device image-file
+ *
+ * Copy the raw frames from an audio-capable DDS drive to an image file
+ * (like dd bs=5822) timing every read.
+ *
+ * If we don't read fast enough the drive stops and repositions (shoe-shining)
+ * which wears the tape and shows up as a slow read.  Reads slower than the
+ * stall threshold (default 100ms) are reported with the frame number and
+ * whether we were blocked writing the image beforehand, and a histogram of
+ * read latencies is printed at the end.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <time.h>
+#include <getopt.h>
+
+#define FRAME_SIZE 5822
+#define N_LATENCY_BUCKETS 32
+
+char *myname;
+int verbosity = 1;
+
+//__attribute__ ((format (printf, 2, 3)))
+int
+dp(int level, char *format, ...) {
+	va_list ap;
+	if (level > verbosity)
+		return 0;
+	va_start(ap, format);
+	return vfprintf(stderr, format, ap);
+}
+
+void
+usage(void) {
+	fprintf(stderr, "Usage: %s [-L milliseconds] [-v verbosity-level] tape-device image-file\n", myname);
+    exit(1);
+}
+
+double
+elapsed_seconds(struct timespec *start, struct timespec *end) {
+	return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec)/1e9;
+}
+
+int
+main(int argc, char *argv[]) {
+	unsigned char buffer[FRAME_SIZE];
+	int histogram[N_LATENCY_BUCKETS];
+	double stall_threshold_seconds = 0.1, max_read_seconds = 0, write_seconds = 0;
+	struct timespec start, end, last_read_end;
+	int in_fd, out_fd, n, i, c, frame, n_stalls = 0;
+
+	myname = strrchr(argv[0], '/');
+	if (myname == NULL)
+		myname = argv[0];
+	else
+		myname++;
+	while ((c = getopt(argc, argv, "L:v:")) != -1) {
+		switch (c) {
+		case 'L':
+			stall_threshold_seconds = atof(optarg)/1000;
+			break;
+		case 'v':
+			verbosity = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind != 2)
+		usage();
+	if ((in_fd = open(argv[optind], O_RDONLY)) < 0) {
+		fprintf(stderr, "Can not open '%s' ", argv[optind]);
+		perror("");
+		exit(1);
+	}
+	if ((out_fd = open(argv[optind+1], O_CREAT|O_WRONLY|O_TRUNC, 0644)) < 0) {
+		fprintf(stderr, "Can not create '%s' ", argv[optind+1]);
+		perror("");
+		exit(1);
+	}
+	memset(histogram, 0, sizeof histogram);
+	for (frame = 0; ; frame++) {
+		double seconds, gap;
+		int bucket;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		n = read(in_fd, buffer, FRAME_SIZE);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if (n < 0) {
+			fprintf(stderr, "Read of frame %d failed ", frame);
+			perror("");
+			exit(1);
+		}
+		if (n == 0)
+			break;
+		seconds = elapsed_seconds(&start, &end);
+		gap = frame ? elapsed_seconds(&last_read_end, &start) : 0;
+		for (bucket = 0; bucket < N_LATENCY_BUCKETS - 1 && (1 << bucket) <= seconds*1e6; bucket++)
+			;
+		histogram[bucket]++;
+		if (seconds > max_read_seconds)
+			max_read_seconds = seconds;
+		if (seconds >= stall_threshold_seconds || gap >= stall_threshold_seconds) {
+			n_stalls++;
+			if (write_seconds >= gap/2)
+				dp(1, "Frame %d read stalled %.1fms after %.1fms away from drive - blocked on write took %.1fms\n", frame, seconds*1000, gap*1000, write_seconds*1000);
+			else
+				dp(1, "Frame %d read stalled %.1fms after %.1fms away from drive\n", frame, seconds*1000, gap*1000);
+		}
+		last_read_end = end;
+		if (n != FRAME_SIZE)
+			dp(0, "Frame %d partial record of %d bytes\n", frame, n);
+		if (write(out_fd, buffer, n) != n) {
+			fprintf(stderr, "Write failed ");
+			perror("");
+			exit(1);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		write_seconds = elapsed_seconds(&end, &start);
+	}
+	close(out_fd);
+	dp(1, "%s: %d frames read, %d stalls longer than %.1fms, slowest read %.1fms\n", myname, frame, n_stalls, stall_threshold_seconds*1000, max_read_seconds*1000);
+	for (i = 0; i < N_LATENCY_BUCKETS; i++) {
+		if (!histogram[i])
+			continue;
+		if (i == N_LATENCY_BUCKETS - 1)
+			dp(1, "Read latency >= %dus: %d\n", 1 << (i - 1), histogram[i]);
+		else
+			dp(1, "Read latency < %dus: %d\n", 1 << i, histogram[i]);
+	}
+	return 0;
+}
@@ -0,0 +1,858 @@
+/*
+ * dat_archive [-a] [-n frames_per_chunk] [-j threads] [-L level] image-file archive-file
+ * dat_archive -d [-c] [-S first_frame] [-r n_frames] [-j threads] [archive-file [image-file]]
+ * dat_archive -l archive-file
+ *
+ * Store a DAT tape image in a seekable archive.
+ *
+ * The image is split into chunks of frames_per_chunk frames (default 1024,
+ * about 30 seconds) which are compressed independently with xz, so any frame
+ * can be reached by decompressing a single chunk and chunks can be
+ * compressed or decompressed in parallel (-j).
+ *
+ * Each chunk carries its frame range and a summary of its subcode
+ * (first & last date, first & last program number, count of non-audio
+ * and interpolated frames) and a copy of the chunk headers is
+ * kept in an index at the end of the archive.
+ *
+ * -a compresses chunks with an audio-aware codec rather than plain xz.
+ * Each 16-bit PCM stereo frame is split into its audio samples, which are
+ * coded losslessly with a fixed linear predictor chosen per channel per frame
+ * and Rice-coded residuals, prediction continuing across frames while the
+ * sampling rate doesn't change.  The 62-byte subcode/main-id tails are stored
+ * column-wise, delta-coded against the previous frame and compressed with
+ * xz together with anything that isn't PCM audio (LP and 4-channel frames,
+ * non-audio frames and the unused bytes of 44.1kHz and 32kHz frames).
+ * The original frames are reconstructed exactly.
+ *
+ * -d decompresses the archive (from first_frame if -S is given) to
+ * image-file or to stdout.  read_dat and triple_merge recognise archives and
+ * use dat_archive -d to read them, read_dat passing -S through
+ * so seeking costs at most one chunk.
+ *
+ * -l lists the chunk index.
+ *
+ * Archive layout (all integers little-endian):
+ *
+ *	header	"DATARCH1", frames_per_chunk (4 bytes), reserved (4 bytes)
+ *	chunk	header (64 bytes) followed by compressed_size bytes of compressed frames
+ *	...
+ *	index	"INDX", number of chunks (4 bytes), per chunk: offset of chunk (8 bytes) + copy of chunk header
+ *	trailer	offset of index (8 bytes), "DATARCH1"
+ *
+ * chunk header:
+ *	0	"CHNK"
+ *	4	codec (4 bytes) 1 == xz, 2 == audio-aware
+ *	8	first frame (8 bytes)
+ *	16	number of frames (4 bytes)
+ *	20	compressed size (4 bytes)
+ *	24	first date subcode pack (8 bytes, zero if none)
+ *	32	last date subcode pack (8 bytes, zero if none)
+ *	40	first program number (2 bytes, hex pno)
+ *	42	last program number (2 bytes, hex pno)
+ *	44	number of non-audio frames (4 bytes)
+ *	48	number of frames with interpolate flags (4 bytes)
+ *	52	reserved (12 bytes)
+ *
+ * audio-aware chunk data:
+ *	xz size (4 bytes)
+ *	xz compressed: tails column-wise & delta-coded (62*number of frames bytes)
+ *	               followed by the bytes of each frame not coded as audio
+ *	bit stream: for each PCM frame, for each channel: predictor order (3 bits),
+ *	            then for each of 4 partitions a Rice parameter (5 bits)
+ *	            followed by the Rice-coded zig-zagged residuals
+ *
+ * Compile with -llzma -lpthread
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <lzma.h>
+
+#define FRAME_SIZE 5822
+#define DATA_SIZE 5760
+#define PACKS_OFFSET 5760
+#define N_PACKS 7
+#define PACK_SIZE 8
+#define SUBID_OFFSET (PACKS_OFFSET + (N_PACKS*PACK_SIZE))
+
+#define ARCHIVE_MAGIC "DATARCH1"
+#define ARCHIVE_HEADER_SIZE 16
+#define CHUNK_HEADER_SIZE 64
+#define INDEX_ENTRY_SIZE (8 + CHUNK_HEADER_SIZE)
+#define TRAILER_SIZE 16
+#define CODEC_XZ 1
+#define CODEC_AUDIO 2
+
+#define TAIL_SIZE (FRAME_SIZE - DATA_SIZE)
+#define MAINID_OFFSET (SUBID_OFFSET + 4)
+#define MAX_PREDICTOR_ORDER 4
+#define N_PARTITIONS 4
+#define MAX_RICE_PARAMETER 31
+
+#define MAX_THREADS 64
+
+typedef struct chunk {
+	int64_t offset;                 // of chunk header in archive
+	int codec;
+	int64_t first_frame;
+	int n_frames;
+	uint32_t compressed_size;
+	unsigned char first_date[PACK_SIZE];
+	unsigned char last_date[PACK_SIZE];
+	int first_pno;
+	int last_pno;
+	int n_nonaudio;
+	int n_interpolated;
+	unsigned char *frames;          // n_frames*FRAME_SIZE bytes
+	unsigned char *data;            // compressed_size bytes
+} chunk_t;
+
+typedef struct bit_stream {
+	unsigned char *buffer;
+	size_t size;                    // bytes allocated or available
+	size_t n;                       // bytes written or read
+	uint64_t bits;
+	int n_bits;
+} bit_stream_t;
+
+char *myname;
+int verbosity = 0;
+int compression_level = 6;
+int codec = CODEC_XZ;
+
+void
+die(char *format, ...) {
+	va_list ap;
+	fprintf(stderr, "%s: ", myname);
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+//__attribute__ ((format (printf, 2, 3)))
+int
+dp(int level, char *format, ...) {
+	va_list ap;
+	if (level > verbosity)
+		return 0;
+	va_start(ap, format);
+	return vfprintf(stderr, format, ap);
+}
+
+void
+usage(void) {
+	fprintf(stderr, "Usage: %s [-a] [-n frames_per_chunk] [-j threads] [-L level] image-file archive-file\n", myname);
+	fprintf(stderr, "       %s -d [-c] [-S first_frame] [-r n_frames] [-j threads] [archive-file [image-file]]\n", myname);
+	fprintf(stderr, "       %s -l archive-file\n", myname);
+    exit(1);
+}
+
+void
+put32(unsigned char *b, uint32_t i) {
+	b[0] = i & 0xff;
+	b[1] = (i >> 8) & 0xff;
+	b[2] = (i >> 16) & 0xff;
+	b[3] = (i >> 24) & 0xff;
+}
+
+void
+put64(unsigned char *b, uint64_t i) {
+	put32(b, i & 0xffffffff);
+	put32(b + 4, i >> 32);
+}
+
+uint32_t
+get32(unsigned char *b) {
+	return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+uint64_t
+get64(unsigned char *b) {
+	return get32(b) | ((uint64_t)get32(b + 4) << 32);
+}
+
+/*
+ * read a whole frame - reads from a pipe may return part of a frame
+ */
+int
+read_frame(int fd, unsigned char *buffer) {
+	int n, m;
+
+	n = read(fd, buffer, FRAME_SIZE);
+	while (n > 0 && n < FRAME_SIZE && (m = read(fd, buffer + n, FRAME_SIZE - n)) > 0)
+		n += m;
+	return n;
+}
+
+void
+write_all(int fd, unsigned char *buffer, size_t n) {
+	ssize_t m;
+
+	for (; n > 0; n -= m, buffer += m)
+		if ((m = write(fd, buffer, n)) <= 0)
+			die("write failed");
+}
+
+void
+pread_all(int fd, unsigned char *buffer, size_t n, off_t offset) {
+	if (pread(fd, buffer, n, offset) != n)
+		die("read of archive failed");
+}
+
+/*
+ * record frame range & subcode summary of a chunk
+ */
+void
+summarise_chunk(chunk_t *c) {
+	int i, j, k, n_audio = 0;
+
+	memset(c->first_date, 0, PACK_SIZE);
+	memset(c->last_date, 0, PACK_SIZE);
+	c->first_pno = c->last_pno = 0;
+	c->n_nonaudio = c->n_interpolated = 0;
+	for (i = 0; i < c->n_frames; i++) {
+		unsigned char *frame = c->frames + i*FRAME_SIZE;
+		unsigned char *subid = frame + SUBID_OFFSET;
+		int hex_pno = (((subid[1] >> 4) & 0xf) << 8) | subid[2];
+		if (subid[0] & 0xf) {
+			c->n_nonaudio++;
+			continue;
+		}
+		if (subid[3] & (0x40|0x20))
+			c->n_interpolated++;
+		if (n_audio++ == 0)
+			c->first_pno = hex_pno;
+		c->last_pno = hex_pno;
+		for (j = 0; j < N_PACKS; j++) {
+			unsigned char *pack = frame + PACKS_OFFSET + j*PACK_SIZE;
+			int parity = 0;
+			if (((pack[0] >> 4) & 0xf) != 5)
+				continue;
+			for (k = 0; k < 7; k++)
+				parity ^= pack[k];
+			if (parity != pack[7])
+				continue;
+			if (!c->first_date[0])
+				memcpy(c->first_date, pack, PACK_SIZE);
+			memcpy(c->last_date, pack, PACK_SIZE);
+		}
+	}
+}
+
+void
+encode_chunk_header(chunk_t *c, unsigned char *h) {
+	memset(h, 0, CHUNK_HEADER_SIZE);
+	memcpy(h, "CHNK", 4);
+	put32(h + 4, c->codec);
+	put64(h + 8, c->first_frame);
+	put32(h + 16, c->n_frames);
+	put32(h + 20, c->compressed_size);
+	memcpy(h + 24, c->first_date, PACK_SIZE);
+	memcpy(h + 32, c->last_date, PACK_SIZE);
+	h[40] = c->first_pno & 0xff;
+	h[41] = c->first_pno >> 8;
+	h[42] = c->last_pno & 0xff;
+	h[43] = c->last_pno >> 8;
+	put32(h + 44, c->n_nonaudio);
+	put32(h + 48, c->n_interpolated);
+}
+
+void
+decode_chunk_header(unsigned char *h, chunk_t *c) {
+	if (memcmp(h, "CHNK", 4) != 0)
+		die("corrupt archive - bad chunk header");
+	c->codec = get32(h + 4);
+	c->first_frame = get64(h + 8);
+	c->n_frames = get32(h + 16);
+	c->compressed_size = get32(h + 20);
+	memcpy(c->first_date, h + 24, PACK_SIZE);
+	memcpy(c->last_date, h + 32, PACK_SIZE);
+	c->first_pno = h[40] | (h[41] << 8);
+	c->last_pno = h[42] | (h[43] << 8);
+	c->n_nonaudio = get32(h + 44);
+	c->n_interpolated = get32(h + 48);
+}
+
+/*
+ * xz compress in_size bytes to out (which must have room for lzma_stream_buffer_bound(in_size) bytes)
+ */
+size_t
+xz_compress(unsigned char *in, size_t in_size, unsigned char *out) {
+	size_t out_pos = 0;
+
+	if (lzma_easy_buffer_encode(compression_level, LZMA_CHECK_CRC32, NULL, in, in_size, out, &out_pos, lzma_stream_buffer_bound(in_size)) != LZMA_OK)
+		die("xz compression failed");
+	return out_pos;
+}
+
+int
+xz_decompress(unsigned char *in, size_t in_size, unsigned char *out, size_t out_size) {
+	size_t in_pos = 0, out_pos = 0;
+	uint64_t memlimit = UINT64_MAX;
+
+	return lzma_stream_buffer_decode(&memlimit, 0, NULL, in, &in_pos, in_size, out, &out_pos, out_size) == LZMA_OK && out_pos == out_size;
+}
+
+void
+put_bits(bit_stream_t *b, uint32_t value, int n) {
+	b->bits = (b->bits << n) | (value & ((1ULL << n) - 1));
+	b->n_bits += n;
+	while (b->n_bits >= 8) {
+		if (b->n == b->size && (b->buffer = realloc(b->buffer, b->size = 2*b->size + 4096)) == NULL)
+			die("out of memory");
+		b->n_bits -= 8;
+		b->buffer[b->n++] = b->bits >> b->n_bits;
+	}
+}
+
+void
+put_rice(bit_stream_t *b, uint32_t value, int k) {
+	uint32_t q = value >> k;
+	for (; q >= 24; q -= 24)
+		put_bits(b, 0, 24);
+	put_bits(b, 1, q + 1);
+	if (k)
+		put_bits(b, value, k);
+}
+
+uint32_t
+get_bits(bit_stream_t *b, int n) {
+	while (b->n_bits < n) {
+		if (b->n == b->size)
+			die("corrupt audio chunk - bit stream truncated");
+		b->bits = (b->bits << 8) | b->buffer[b->n++];
+		b->n_bits += 8;
+	}
+	b->n_bits -= n;
+	return (b->bits >> b->n_bits) & ((1ULL << n) - 1);
+}
+
+uint32_t
+get_rice(bit_stream_t *b, int k) {
+	uint32_t q = 0;
+	while (get_bits(b, 1) == 0)
+		q++;
+	return (q << k) | (k ? get_bits(b, k) : 0);
+}
+
+static inline uint32_t
+zigzag(int32_t i) {
+	return ((uint32_t)i << 1) ^ (uint32_t)(i >> 31);
+}
+
+static inline int32_t
+unzigzag(uint32_t u) {
+	return (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+}
+
+/*
+ * fixed polynomial predictors as used by FLAC,
+ * s points to the sample being predicted, previous samples are s[-1], s[-2] ...
+ */
+static inline int32_t
+predict(int32_t *s, int order) {
+	switch (order) {
+	case 0:
+		return 0;
+	case 1:
+		return s[-1];
+	case 2:
+		return 2*s[-1] - s[-2];
+	case 3:
+		return 3*s[-1] - 3*s[-2] + s[-3];
+	default:
+		return 4*s[-1] - 6*s[-2] + 4*s[-3] - s[-4];
+	}
+}
+
+/*
+ * number of bytes of 16-bit PCM stereo audio in the frame or 0 if it should be stored raw
+ */
+int
+frame_audio_bytes(unsigned char *tail) {
+	unsigned char *subid = tail + (SUBID_OFFSET - DATA_SIZE);
+	unsigned char *mainid = tail + (MAINID_OFFSET - DATA_SIZE);
+
+	if ((subid[0] & 0xf) || (mainid[0] & 0x3) != 0 || ((mainid[1] >> 6) & 0x3) != 0)
+		return 0;
+	switch ((mainid[0] >> 2) & 0x3) {
+	case 0:
+		return 5760;
+	case 1:
+		return 5292;
+	case 2:
+		return 3840;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * code one channel of a frame, history holds the previous MAX_PREDICTOR_ORDER samples
+ * and samples follow it
+ */
+void
+encode_channel(bit_stream_t *b, int32_t *samples, int n) {
+	uint64_t cost[MAX_PREDICTOR_ORDER + 1];
+	int order, best_order = 0, p, i;
+
+	for (order = 0; order <= MAX_PREDICTOR_ORDER; order++) {
+		cost[order] = 0;
+		for (i = 0; i < n; i++)
+			cost[order] += zigzag(samples[i] - predict(samples + i, order));
+		if (cost[order] < cost[best_order])
+			best_order = order;
+	}
+	put_bits(b, best_order, 3);
+	for (p = 0; p < N_PARTITIONS; p++) {
+		int start = p*n/N_PARTITIONS, end = (p + 1)*n/N_PARTITIONS, k;
+		uint64_t sum = 0;
+		for (i = start; i < end; i++)
+			sum += zigzag(samples[i] - predict(samples + i, best_order));
+		for (k = 0; k < MAX_RICE_PARAMETER - 1 && ((uint64_t)(end - start) << (k + 1)) < sum; k++)
+			;
+		put_bits(b, k, 5);
+		for (i = start; i < end; i++)
+			put_rice(b, zigzag(samples[i] - predict(samples + i, best_order)), k);
+	}
+}
+
+void
+decode_channel(bit_stream_t *b, int32_t *samples, int n) {
+	int order = get_bits(b, 3), p, i;
+
+	if (order > MAX_PREDICTOR_ORDER)
+		die("corrupt audio chunk - bad predictor order");
+	for (p = 0; p < N_PARTITIONS; p++) {
+		int start = p*n/N_PARTITIONS, end = (p + 1)*n/N_PARTITIONS, k = get_bits(b, 5);
+		for (i = start; i < end; i++)
+			samples[i] = predict(samples + i, order) + unzigzag(get_rice(b, k));
+	}
+}
+
+/*
+ * the raw bytes of a frame - everything not coded as audio
+ */
+int
+raw_frame_bytes(unsigned char *frame, int audio_bytes, unsigned char **raw) {
+	*raw = frame + audio_bytes;
+	return DATA_SIZE - audio_bytes;
+}
+
+void
+encode_audio_chunk(chunk_t *c) {
+	int32_t history[2][MAX_PREDICTOR_ORDER + DATA_SIZE/4];
+	size_t xz_size = (size_t)c->n_frames*FRAME_SIZE, raw_n = (size_t)c->n_frames*TAIL_SIZE, compressed;
+	unsigned char *xz_input, *previous_tail = NULL;
+	bit_stream_t b = {NULL, 0, 0, 0, 0};
+	int i, j, ch, previous_audio_bytes = 0;
+
+	if ((xz_input = malloc(xz_size)) == NULL)
+		die("out of memory");
+	memset(history, 0, sizeof history);
+	for (i = 0; i < c->n_frames; i++) {
+		unsigned char *frame = c->frames + i*FRAME_SIZE, *tail = frame + DATA_SIZE, *raw;
+		int audio_bytes = frame_audio_bytes(tail), n = audio_bytes/4, m;
+
+		for (j = 0; j < TAIL_SIZE; j++)
+			xz_input[j*c->n_frames + i] = tail[j] - (previous_tail ? previous_tail[j] : 0);
+		previous_tail = tail;
+		m = raw_frame_bytes(frame, audio_bytes, &raw);
+		memcpy(xz_input + raw_n, raw, m);
+		raw_n += m;
+		if (!audio_bytes)
+			continue;
+		for (ch = 0; ch < 2; ch++) {
+			int32_t *h = history[ch];
+			/* prediction continues from the previous frame if the sampling rate is unchanged */
+			if (audio_bytes == previous_audio_bytes)
+				memmove(h, h + previous_audio_bytes/4, MAX_PREDICTOR_ORDER*sizeof *h);
+			else
+				memset(h, 0, MAX_PREDICTOR_ORDER*sizeof *h);
+			for (j = 0; j < n; j++)
+				h[MAX_PREDICTOR_ORDER + j] = (int16_t)(frame[4*j + 2*ch] | (frame[4*j + 2*ch + 1] << 8));
+			encode_channel(&b, h + MAX_PREDICTOR_ORDER, n);
+		}
+		previous_audio_bytes = audio_bytes;
+	}
+	put_bits(&b, 0, 7);
+	if ((c->data = malloc(4 + lzma_stream_buffer_bound(raw_n) + b.n)) == NULL)
+		die("out of memory");
+	compressed = xz_compress(xz_input, raw_n, c->data + 4);
+	put32(c->data, compressed);
+	memcpy(c->data + 4 + compressed, b.buffer, b.n);
+	c->compressed_size = 4 + compressed + b.n;
+	free(xz_input);
+	free(b.buffer);
+}
+
+void
+decode_audio_chunk(chunk_t *c) {
+	int32_t history[2][MAX_PREDICTOR_ORDER + DATA_SIZE/4];
+	size_t xz_compressed = get32(c->data), raw_n, xz_size;
+	unsigned char *xz_output, *previous_tail = NULL;
+	bit_stream_t b;
+	int i, j, ch, previous_audio_bytes = 0;
+
+	if (xz_compressed + 4 > c->compressed_size)
+		die("corrupt audio chunk at frame %lld", (long long)c->first_frame);
+	b.buffer = c->data + 4 + xz_compressed;
+	b.size = c->compressed_size - 4 - xz_compressed;
+	b.n = 0;
+	b.bits = 0;
+	b.n_bits = 0;
+	/*
+	 * the size of the raw data isn't stored, the tails tell us
+	 * so decompress into a buffer big enough for the worst case
+	 */
+	xz_size = (size_t)c->n_frames*FRAME_SIZE;
+	if ((xz_output = malloc(xz_size)) == NULL)
+		die("out of memory");
+	{
+		lzma_stream strm = LZMA_STREAM_INIT;
+		if (lzma_stream_decoder(&strm, UINT64_MAX, 0) != LZMA_OK)
+			die("can not initialise xz decoder");
+		strm.next_in = c->data + 4;
+		strm.avail_in = xz_compressed;
+		strm.next_out = xz_output;
+		strm.avail_out = xz_size;
+		if (lzma_code(&strm, LZMA_FINISH) != LZMA_STREAM_END)
+			die("corrupt audio chunk at frame %lld", (long long)c->first_frame);
+		xz_size = strm.total_out;
+		lzma_end(&strm);
+	}
+	raw_n = (size_t)c->n_frames*TAIL_SIZE;
+	if (xz_size < raw_n)
+		die("corrupt audio chunk at frame %lld", (long long)c->first_frame);
+	memset(history, 0, sizeof history);
+	for (i = 0; i < c->n_frames; i++) {
+		unsigned char *frame = c->frames + i*FRAME_SIZE, *tail = frame + DATA_SIZE, *raw;
+		int audio_bytes, n, m;
+
+		for (j = 0; j < TAIL_SIZE; j++)
+			tail[j] = xz_output[j*c->n_frames + i] + (previous_tail ? previous_tail[j] : 0);
+		previous_tail = tail;
+		audio_bytes = frame_audio_bytes(tail);
+		n = audio_bytes/4;
+		m = raw_frame_bytes(frame, audio_bytes, &raw);
+		if (raw_n + m > xz_size)
+			die("corrupt audio chunk at frame %lld", (long long)c->first_frame);
+		memcpy(raw, xz_output + raw_n, m);
+		raw_n += m;
+		if (!audio_bytes)
+			continue;
+		for (ch = 0; ch < 2; ch++) {
+			int32_t *h = history[ch];
+			if (audio_bytes == previous_audio_bytes)
+				memmove(h, h + previous_audio_bytes/4, MAX_PREDICTOR_ORDER*sizeof *h);
+			else
+				memset(h, 0, MAX_PREDICTOR_ORDER*sizeof *h);
+			decode_channel(&b, h + MAX_PREDICTOR_ORDER, n);
+			for (j = 0; j < n; j++) {
+				frame[4*j + 2*ch] = h[MAX_PREDICTOR_ORDER + j] & 0xff;
+				frame[4*j + 2*ch + 1] = (h[MAX_PREDICTOR_ORDER + j] >> 8) & 0xff;
+			}
+		}
+		previous_audio_bytes = audio_bytes;
+	}
+	free(xz_output);
+}
+
+void *
+compress_chunk(void *arg) {
+	chunk_t *c = arg;
+	size_t in_size = (size_t)c->n_frames*FRAME_SIZE;
+
+	summarise_chunk(c);
+	c->codec = codec;
+	if (codec == CODEC_AUDIO) {
+		encode_audio_chunk(c);
+		return NULL;
+	}
+	if ((c->data = malloc(lzma_stream_buffer_bound(in_size))) == NULL)
+		die("out of memory");
+	c->compressed_size = xz_compress(c->frames, in_size, c->data);
+	return NULL;
+}
+
+void *
+decompress_chunk(void *arg) {
+	chunk_t *c = arg;
+	size_t out_size = (size_t)c->n_frames*FRAME_SIZE;
+
+	if ((c->frames = malloc(out_size)) == NULL)
+		die("out of memory");
+	switch (c->codec) {
+	case CODEC_XZ:
+		if (!xz_decompress(c->data, c->compressed_size, c->frames, out_size))
+			die("corrupt chunk at frame %lld", (long long)c->first_frame);
+		break;
+	case CODEC_AUDIO:
+		decode_audio_chunk(c);
+		break;
+	default:
+		die("chunk at frame %lld uses unknown codec %d", (long long)c->first_frame, c->codec);
+	}
+	return NULL;
+}
+
+/*
+ * run function on each of n chunks in parallel
+ */
+void
+for_each_chunk(void *(*function)(void *), chunk_t *chunks, int n) {
+	pthread_t threads[MAX_THREADS];
+	int i;
+
+	if (n == 1) {
+		function(&chunks[0]);
+		return;
+	}
+	for (i = 0; i < n; i++)
+		if (pthread_create(&threads[i], NULL, function, &chunks[i]) != 0)
+			die("can not create thread");
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+}
+
+void
+create_archive(char *image_filename, char *archive_filename, int frames_per_chunk, int n_threads) {
+	chunk_t chunks[MAX_THREADS];
+	unsigned char header[ARCHIVE_HEADER_SIZE], *index = NULL;
+	int64_t frame = 0, offset;
+	int in_fd, out_fd, i, n, n_chunks = 0, eof = 0;
+
+	if (strcmp(image_filename, "-") == 0)
+		in_fd = 0;
+	else if ((in_fd = open(image_filename, O_RDONLY)) < 0)
+		die("Can not open '%s'", image_filename);
+	if ((out_fd = open(archive_filename, O_CREAT|O_WRONLY|O_TRUNC, 0644)) < 0)
+		die("Can not create '%s'", archive_filename);
+	memset(header, 0, sizeof header);
+	memcpy(header, ARCHIVE_MAGIC, 8);
+	put32(header + 8, frames_per_chunk);
+	write_all(out_fd, header, sizeof header);
+	offset = sizeof header;
+	while (!eof) {
+		for (n = 0; n < n_threads && !eof; n++) {
+			chunk_t *c = &chunks[n];
+			if ((c->frames = malloc((size_t)frames_per_chunk*FRAME_SIZE)) == NULL)
+				die("out of memory");
+			c->first_frame = frame;
+			for (c->n_frames = 0; c->n_frames < frames_per_chunk; c->n_frames++) {
+				int r = read_frame(in_fd, c->frames + c->n_frames*FRAME_SIZE);
+				if (r == FRAME_SIZE)
+					continue;
+				if (r < 0)
+					die("read of '%s' failed", image_filename);
+				if (r > 0)
+					dp(0, "%s: ignoring partial frame at end of image\n", myname);
+				eof = 1;
+				break;
+			}
+			frame += c->n_frames;
+			if (c->n_frames == 0) {
+				free(c->frames);
+				break;
+			}
+		}
+		for_each_chunk(compress_chunk, chunks, n);
+		if ((index = realloc(index, (n_chunks + n)*INDEX_ENTRY_SIZE)) == NULL)
+			die("out of memory");
+		for (i = 0; i < n; i++) {
+			unsigned char *entry = index + n_chunks*INDEX_ENTRY_SIZE;
+			chunks[i].offset = offset;
+			put64(entry, offset);
+			encode_chunk_header(&chunks[i], entry + 8);
+			write_all(out_fd, entry + 8, CHUNK_HEADER_SIZE);
+			write_all(out_fd, chunks[i].data, chunks[i].compressed_size);
+			dp(1, "Chunk %d frames %lld-%lld %u bytes\n", n_chunks, (long long)chunks[i].first_frame, (long long)chunks[i].first_frame + chunks[i].n_frames - 1, chunks[i].compressed_size);
+			offset += CHUNK_HEADER_SIZE + chunks[i].compressed_size;
+			n_chunks++;
+			free(chunks[i].frames);
+			free(chunks[i].data);
+		}
+	}
+	{
+		unsigned char index_header[8], trailer[TRAILER_SIZE];
+		memcpy(index_header, "INDX", 4);
+		put32(index_header + 4, n_chunks);
+		write_all(out_fd, index_header, sizeof index_header);
+		write_all(out_fd, index, (size_t)n_chunks*INDEX_ENTRY_SIZE);
+		put64(trailer, offset);
+		memcpy(trailer + 8, ARCHIVE_MAGIC, 8);
+		write_all(out_fd, trailer, sizeof trailer);
+	}
+	if (close(out_fd) < 0)
+		die("write of '%s' failed", archive_filename);
+	dp(1, "%lld frames in %d chunks\n", (long long)frame, n_chunks);
+	free(index);
+}
+
+/*
+ * read the chunk index from the end of an archive
+ */
+chunk_t *
+read_index(int fd, int *n_chunks) {
+	unsigned char header[ARCHIVE_HEADER_SIZE], trailer[TRAILER_SIZE], index_header[8], *index;
+	chunk_t *chunks;
+	off_t end, index_offset;
+	int i;
+
+	pread_all(fd, header, sizeof header, 0);
+	if (memcmp(header, ARCHIVE_MAGIC, 8) != 0)
+		die("not a DAT archive");
+	if ((end = lseek(fd, 0, SEEK_END)) < (off_t)(sizeof header + sizeof trailer))
+		die("truncated archive");
+	pread_all(fd, trailer, sizeof trailer, end - sizeof trailer);
+	if (memcmp(trailer + 8, ARCHIVE_MAGIC, 8) != 0)
+		die("truncated archive - no index");
+	index_offset = get64(trailer);
+	pread_all(fd, index_header, sizeof index_header, index_offset);
+	if (memcmp(index_header, "INDX", 4) != 0)
+		die("corrupt archive index");
+	*n_chunks = get32(index_header + 4);
+	if ((index = malloc((size_t)*n_chunks*INDEX_ENTRY_SIZE + 1)) == NULL || (chunks = calloc(*n_chunks + 1, sizeof *chunks)) == NULL)
+		die("out of memory");
+	pread_all(fd, index, (size_t)*n_chunks*INDEX_ENTRY_SIZE, index_offset + sizeof index_header);
+	for (i = 0; i < *n_chunks; i++) {
+		chunks[i].offset = get64(index + i*INDEX_ENTRY_SIZE);
+		decode_chunk_header(index + i*INDEX_ENTRY_SIZE + 8, &chunks[i]);
+	}
+	free(index);
+	return chunks;
+}
+
+void
+extract_archive(int in_fd, int out_fd, int64_t first_frame, int64_t n_frames, int n_threads) {
+	chunk_t *chunks;
+	int64_t last_frame = first_frame + n_frames;
+	int n_chunks, c, i, n;
+
+	chunks = read_index(in_fd, &n_chunks);
+	for (c = 0; c < n_chunks && chunks[c].first_frame + chunks[c].n_frames <= first_frame; c++)
+		;
+	while (c < n_chunks && chunks[c].first_frame < last_frame) {
+		for (n = 0; n < n_threads && c + n < n_chunks && chunks[c + n].first_frame < last_frame; n++) {
+			chunk_t *ch = &chunks[c + n];
+			if ((ch->data = malloc(ch->compressed_size)) == NULL)
+				die("out of memory");
+			pread_all(in_fd, ch->data, ch->compressed_size, ch->offset + CHUNK_HEADER_SIZE);
+		}
+		for_each_chunk(decompress_chunk, &chunks[c], n);
+		for (i = 0; i < n; i++, c++) {
+			chunk_t *ch = &chunks[c];
+			int64_t start = first_frame > ch->first_frame ? first_frame - ch->first_frame : 0;
+			int64_t end = last_frame < ch->first_frame + ch->n_frames ? last_frame - ch->first_frame : ch->n_frames;
+			write_all(out_fd, ch->frames + start*FRAME_SIZE, (end - start)*FRAME_SIZE);
+			free(ch->data);
+			free(ch->frames);
+		}
+	}
+	free(chunks);
+}
+
+void
+print_date_pack(unsigned char *pack) {
+	if (!pack[0]) {
+		printf(" --                 ");
+		return;
+	}
+	printf(" %02x%02x-%02x-%02x %02d:%02x:%02x", pack[1] < 0x50 ? 0x20 : 0x19, pack[1], pack[2], pack[3], ((pack[4] >> 4)*10 + (pack[4] & 0xf)) - 1, pack[5], pack[6]);
+}
+
+void
+list_archive(int fd) {
+	chunk_t *chunks;
+	int n_chunks, i;
+
+	chunks = read_index(fd, &n_chunks);
+	printf("Chunk  Frames                 pno       First date           Last date            Non-audio Interpolated Bytes\n");
+	for (i = 0; i < n_chunks; i++) {
+		chunk_t *c = &chunks[i];
+		printf("%5d  %9lld-%-9lld %03x-%03x ", i, (long long)c->first_frame, (long long)c->first_frame + c->n_frames - 1, c->first_pno, c->last_pno);
+		print_date_pack(c->first_date);
+		print_date_pack(c->last_date);
+		printf(" %9d %12d %u\n", c->n_nonaudio, c->n_interpolated, c->compressed_size);
+	}
+	free(chunks);
+}
+
+int
+main(int argc, char *argv[]) {
+	int c, decompress = 0, list = 0, n_threads = 1, frames_per_chunk = 1024;
+	int64_t first_frame = 0, n_frames = INT64_MAX/2;
+
+	myname = strrchr(argv[0], '/');
+	if (myname == NULL)
+		myname = argv[0];
+	else
+		myname++;
+	while ((c = getopt(argc, argv, "acdj:lL:n:r:S:v:")) != -1) {
+		switch (c) {
+		case 'a':
+			codec = CODEC_AUDIO;
+			break;
+		case 'c':
+			break;
+		case 'd':
+			decompress = 1;
+			break;
+		case 'j':
+			n_threads = atoi(optarg);
+			if (n_threads < 1 || n_threads > MAX_THREADS)
+				usage();
+			break;
+		case 'l':
+			list = 1;
+			break;
+		case 'L':
+			compression_level = atoi(optarg);
+			break;
+		case 'n':
+			frames_per_chunk = atoi(optarg);
+			if (frames_per_chunk < 1)
+				usage();
+			break;
+		case 'r':
+			n_frames = atoll(optarg);
+			break;
+		case 'S':
+			first_frame = atoll(optarg);
+			break;
+		case 'v':
+			verbosity = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (list || decompress) {
+		int in_fd = 0, out_fd = 1;
+		if (argc - optind > 2)
+			usage();
+		if (optind < argc && (in_fd = open(argv[optind], O_RDONLY)) < 0)
+			die("Can not open '%s'", argv[optind]);
+		if (list)
+			list_archive(in_fd);
+		else {
+			if (optind + 1 < argc && (out_fd = open(argv[optind + 1], O_CREAT|O_WRONLY|O_TRUNC, 0644)) < 0)
+				die("Can not create '%s'", argv[optind + 1]);
+			extract_archive(in_fd, out_fd, first_frame, n_frames, n_threads);
+			if (close(out_fd) < 0)
+				die("write failed");
+		}
+		return 0;
+	}
+	if (argc - optind != 2)
+		usage();
+	create_archive(argv[optind], argv[optind + 1], frames_per_chunk, n_threads);
+	return 0;
+}
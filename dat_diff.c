@@ -0,0 +1,437 @@
+/*
+ * dat_diff [-j threads] [-o max_offset] [-v verbosity] image1 image2
+ *
+ * Compare two captures of the same DAT tape frame by frame, e.g. to
+ * decide whether a third capture is needed before running triple_merge.
+ *
+ * Every frame of both images is hashed (threads share the hashing of
+ * uncompressed images, compressed images are read by one thread each)
+ * and the hashes compared.  If one capture started a few frames
+ * before the other the frames are offset - the offset (up to max_offset,
+ * default 100 frames) at which most frames match is found first.
+ *
+ * Lead-in frames (program number 0x0BB) at the start of each image are
+ * skipped as triple_merge skips them, so frame numbers count from the
+ * first frame after image1's lead-in and match triple_merge's.  Output:
+ *
+ *	frames 360000 359998                    frames in each image
+ *	offset -2                               frame n of image1 is frame n-2 of image2
+ *	differ 1500 1502 0:00:45.000 0:45:00.12 2001-02-03 08:46:45
+ *	...
+ *	summary 12 ranges 40 frames differ
+ *
+ * Each range of differing frames gives its first & last frame, its position
+ * in the image and, if its first frame has them, the absolute time and
+ * date from its subcode.  Frames of image1 with no counterpart in image2
+ * are listed as "missing".  The output can be given to triple_merge -d to merge only the
+ * differing frames.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define FRAME_SIZE 5822
+#define DATA_SIZE 5760
+#define PACK_SIZE 8
+#define N_PACKS 7
+#define BLOCK_FRAMES 256            /* frames hashed at once */
+#define MAX_THREADS 64
+#define OFFSET_SAMPLES 4096         /* frames compared for each possible offset */
+
+char *myname;
+int verbosity = 1;
+
+/*
+ * what is kept of each frame
+ */
+typedef struct frame_summary {
+	uint64_t hash;
+	int32_t absolute_time;      /* hundredths of hours, minutes, seconds & frame or -1 */
+	int64_t date;               /* YYYYMMDDhhmmss or -1 */
+	int lead_in;                /* program number 0x0BB */
+} frame_summary_t;
+
+typedef struct image {
+	char *filename;
+	int fd;
+	int seekable;
+	int64_t n_frames;
+	int64_t next_block;         /* for threads sharing a seekable image */
+	frame_summary_t *frames;
+	int64_t frames_size;
+} image_t;
+
+static image_t images[2];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * magic numbers of compressed tape images and the programs which decompress them
+ */
+static struct {
+	int length;
+	char *magic;
+	char *program;
+} decompressors[] = {
+	{4, "\x28\xb5\x2f\xfd", "zstd"},
+	{6, "\xfd\x37\x7a\x58\x5a\x00", "xz"},
+	{2, "\x1f\x8b", "gzip"},
+	{3, "BZh", "bzip2"},
+	{8, "DATARCH1", "dat_archive"},
+	{0, NULL, NULL}
+};
+
+//__attribute__ ((format (printf, 2, 3)))
+int
+dp(int level, char *format, ...) {
+	va_list ap;
+	if (level > verbosity)
+		return 0;
+	va_start(ap, format);
+	return vfprintf(stderr, format, ap);
+}
+
+//__attribute__ ((noreturn))
+void
+die(char *format, ...) {
+	va_list ap;
+	fprintf(stderr, "%s: ", myname);
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+void
+usage(void) {
+	fprintf(stderr, "Usage: %s [-j threads] [-o max_offset] [-v verbosity-level] image1 image2\n", myname);
+	exit(1);
+}
+
+/*
+ * open a tape image, compressed images are decompressed
+ * by a child process writing into a pipe
+ */
+void
+open_image(image_t *image) {
+	unsigned char magic[8];
+	struct stat s;
+	int fd, i, pipe_fds[2];
+	pid_t pid;
+
+	if ((fd = open(image->filename, O_RDONLY)) < 0)
+		die("Can not open %s", image->filename);
+	image->fd = fd;
+	if (fstat(fd, &s) < 0 || !S_ISREG(s.st_mode) || pread(fd, magic, sizeof magic, 0) != sizeof magic)
+		return;
+	for (i = 0; decompressors[i].program; i++)
+		if (memcmp(magic, decompressors[i].magic, decompressors[i].length) == 0)
+			break;
+	if (!decompressors[i].program) {
+		image->seekable = 1;
+		image->n_frames = s.st_size/FRAME_SIZE;
+		return;
+	}
+	dp(1, "Decompressing %s with %s\n", image->filename, decompressors[i].program);
+	if (pipe(pipe_fds) < 0 || (pid = fork()) < 0)
+		die("Can not run %s", decompressors[i].program);
+	if (pid == 0) {
+		dup2(fd, 0);
+		dup2(pipe_fds[1], 1);
+		close(pipe_fds[0]);
+		close(pipe_fds[1]);
+		close(fd);
+		execlp(decompressors[i].program, decompressors[i].program, "-dc", (char *)NULL);
+		die("Can not run %s", decompressors[i].program);
+	}
+	close(pipe_fds[1]);
+	close(fd);
+	image->fd = pipe_fds[0];
+}
+
+static inline uint64_t
+load64(const unsigned char *p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof v);
+	return v;
+}
+
+static inline uint64_t
+round64(uint64_t lane, uint64_t v) {
+	lane += v*0xc2b2ae3d27d4eb4fULL;
+	lane = (lane << 31) | (lane >> 33);
+	return lane*0x9e3779b185ebca87ULL;
+}
+
+/*
+ * 64-bit hash of a frame - four independent lanes (as xxHash64)
+ * so the multiplies of each 32 bytes can run in parallel
+ */
+uint64_t
+hash_frame(const unsigned char *frame) {
+	uint64_t a = 0x60ea27eeadc0b5d6ULL, b = 0xc2b2ae3d27d4eb4fULL, c = 0, d = 0x61c8864e7a143579ULL;
+	uint64_t h;
+	int i;
+
+	for (i = 0; i + 32 <= FRAME_SIZE; i += 32) {
+		a = round64(a, load64(frame + i));
+		b = round64(b, load64(frame + i + 8));
+		c = round64(c, load64(frame + i + 16));
+		d = round64(d, load64(frame + i + 24));
+	}
+	h = ((a << 1) | (a >> 63)) + ((b << 7) | (b >> 57)) + ((c << 12) | (c >> 52)) + ((d << 18) | (d >> 46));
+	for (; i < FRAME_SIZE; i++)
+		h = (h ^ frame[i])*0x100000001b3ULL;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static int
+unBCD(int i) {
+	return ((i >> 4) & 0xf)*10 + (i & 0xf);
+}
+
+void
+summarise_frame(const unsigned char *frame, frame_summary_t *f) {
+	int i, j;
+
+	f->hash = hash_frame(frame);
+	f->lead_in = (frame[DATA_SIZE + 7*8 + 1] & 0xf0) == 0 && frame[DATA_SIZE + 7*8 + 2] == 0xbb;
+	f->absolute_time = -1;
+	f->date = -1;
+	for (i = 0; i < N_PACKS; i++) {
+		const unsigned char *pack = frame + DATA_SIZE + i*PACK_SIZE;
+		int id = (pack[0] >> 4) & 0xf, parity = 0;
+		for (j = 0; j < 7; j++)
+			parity ^= pack[j];
+		if (parity != pack[7])
+			continue;
+		if (id == 2)
+			f->absolute_time = ((unBCD(pack[3])*100 + unBCD(pack[4]))*100 + unBCD(pack[5]))*100 + unBCD(pack[6]);
+		else if (id == 5) {
+			int year = unBCD(pack[1]);
+			/* hour as read_dat */
+			f->date = ((((int64_t)(year < 50 ? 2000 + year : 1900 + year)*100 + unBCD(pack[2]))*100 + unBCD(pack[3]))*100 +
+				unBCD(pack[4]) - 1)*10000 + unBCD(pack[5])*100 + unBCD(pack[6]);
+		}
+	}
+}
+
+/*
+ * read a whole frame - reads from a pipe may return part of a frame
+ */
+int
+read_frame(int fd, unsigned char *buffer) {
+	int n, m;
+
+	n = read(fd, buffer, FRAME_SIZE);
+	while (n > 0 && n < FRAME_SIZE && (m = read(fd, buffer + n, FRAME_SIZE - n)) > 0)
+		n += m;
+	return n;
+}
+
+/*
+ * hash a seekable image a block at a time into the thread's buffer b -
+ * several threads may share an image
+ */
+void
+hash_blocks(image_t *image, unsigned char *b) {
+	int64_t block, first, n, i;
+
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		block = image->next_block++;
+		pthread_mutex_unlock(&lock);
+		first = block*BLOCK_FRAMES;
+		if (first >= image->n_frames)
+			return;
+		n = image->n_frames - first < BLOCK_FRAMES ? image->n_frames - first : BLOCK_FRAMES;
+		if (pread(image->fd, b, n*FRAME_SIZE, first*FRAME_SIZE) != n*FRAME_SIZE)
+			die("read of %s failed", image->filename);
+		for (i = 0; i < n; i++)
+			summarise_frame(b + i*FRAME_SIZE, &image->frames[first + i]);
+	}
+}
+
+void *
+hash_thread(void *arg) {
+	unsigned char *buffer;
+	int i;
+
+	if ((buffer = malloc(BLOCK_FRAMES*FRAME_SIZE)) == NULL)
+		die("out of memory");
+	for (i = 0; i < 2; i++)
+		if (images[i].seekable)
+			hash_blocks(&images[i], buffer);
+	free(buffer);
+	return NULL;
+}
+
+/*
+ * hash an image which must be read in order
+ */
+void *
+hash_stream_thread(void *arg) {
+	image_t *image = arg;
+	unsigned char buffer[FRAME_SIZE];
+	int n;
+
+	while ((n = read_frame(image->fd, buffer)) == FRAME_SIZE) {
+		if (image->n_frames == image->frames_size) {
+			image->frames_size = 2*image->frames_size + 65536;
+			if ((image->frames = realloc(image->frames, image->frames_size*sizeof *image->frames)) == NULL)
+				die("out of memory");
+		}
+		summarise_frame(buffer, &image->frames[image->n_frames++]);
+	}
+	if (n < 0)
+		die("read of %s failed", image->filename);
+	if (n > 0)
+		dp(1, "%s: ignoring partial frame at end\n", image->filename);
+	return NULL;
+}
+
+/*
+ * offset at which most sampled frames have the same hash
+ */
+int
+find_offset(int max_offset) {
+	int64_t n = images[0].n_frames, step = n/OFFSET_SAMPLES + 1, i, j;
+	int offset, best_offset = 0, best = -1;
+
+	for (offset = 0; offset <= 2*max_offset; offset++) {
+		int o = offset & 1 ? -(offset + 1)/2 : offset/2;    /* 0, -1, 1, -2, 2 ... */
+		int matches = 0;
+		for (i = 0; i < n; i += step) {
+			j = i + o;
+			if (j >= 0 && j < images[1].n_frames && images[0].frames[i].hash == images[1].frames[j].hash)
+				matches++;
+		}
+		if (matches > best) {
+			best = matches;
+			best_offset = o;
+		}
+	}
+	return best_offset;
+}
+
+void
+print_range(char *what, int64_t first, int64_t last, frame_summary_t *f) {
+	double seconds = first*0.03;
+	int hours = seconds/3600, minutes;
+
+	seconds -= hours*3600;
+	minutes = seconds/60;
+	seconds -= minutes*60;
+	printf("%s %lld %lld %d:%02d:%06.3f", what, (long long)first, (long long)last, hours, minutes, seconds);
+	if (f && f->absolute_time >= 0)
+		printf(" %d:%02d:%02d.%02d", f->absolute_time/1000000, f->absolute_time/10000 % 100, f->absolute_time/100 % 100, f->absolute_time % 100);
+	if (f && f->date >= 0)
+		printf(" %04lld-%02lld-%02lld %02lld:%02lld:%02lld", (long long)(f->date/10000000000LL), (long long)(f->date/100000000 % 100),
+			(long long)(f->date/1000000 % 100), (long long)(f->date/10000 % 100), (long long)(f->date/100 % 100), (long long)(f->date % 100));
+	printf("\n");
+}
+
+int
+main(int argc, char *argv[]) {
+	pthread_t threads[MAX_THREADS + 2];
+	int c, i, n_threads = 4, max_offset = 100, offset, n_ranges = 0;
+	int64_t n, j, first = -1, n_differ = 0;
+
+	myname = strrchr(argv[0], '/');
+	if (myname == NULL)
+		myname = argv[0];
+	else
+		myname++;
+	while ((c = getopt(argc, argv, "j:o:v:")) != -1) {
+		switch (c) {
+		case 'j':
+			n_threads = atoi(optarg);
+			if (n_threads < 1 || n_threads > MAX_THREADS)
+				usage();
+			break;
+		case 'o':
+			max_offset = atoi(optarg);
+			if (max_offset < 0)
+				usage();
+			break;
+		case 'v':
+			verbosity = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind != 2)
+		usage();
+	for (i = 0; i < 2; i++) {
+		images[i].filename = argv[optind + i];
+		open_image(&images[i]);
+		if (images[i].seekable && (images[i].frames = malloc((images[i].n_frames + 1)*sizeof *images[i].frames)) == NULL)
+			die("out of memory");
+	}
+	for (i = 0; i < 2; i++)
+		if (!images[i].seekable && pthread_create(&threads[MAX_THREADS + i], NULL, hash_stream_thread, &images[i]) != 0)
+			die("can not create thread");
+	if (images[0].seekable || images[1].seekable)
+		for (i = 0; i < n_threads; i++)
+			if (pthread_create(&threads[i], NULL, hash_thread, NULL) != 0)
+				die("can not create thread");
+	if (images[0].seekable || images[1].seekable)
+		for (i = 0; i < n_threads; i++)
+			pthread_join(threads[i], NULL);
+	for (i = 0; i < 2; i++)
+		if (!images[i].seekable)
+			pthread_join(threads[MAX_THREADS + i], NULL);
+
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < images[i].n_frames && images[i].frames[j].lead_in; j++)
+			;
+		if (j)
+			dp(1, "%s: skipping %lld lead-in frames\n", images[i].filename, (long long)j);
+		images[i].frames += j;
+		images[i].n_frames -= j;
+	}
+	printf("frames %lld %lld\n", (long long)images[0].n_frames, (long long)images[1].n_frames);
+	offset = find_offset(max_offset);
+	printf("offset %d\n", offset);
+	n = images[0].n_frames;
+	for (j = 0; j <= n; j++) {
+		int differ = j < n && (j + offset < 0 || j + offset >= images[1].n_frames || images[0].frames[j].hash != images[1].frames[j + offset].hash);
+		if (differ && first < 0)
+			first = j;
+		if (!differ && first >= 0) {
+			/* frames without a counterpart are missing rather than different */
+			int64_t last = j - 1;
+			if (first + offset < 0 && last + offset >= 0) {
+				print_range("missing", first, -offset - 1, &images[0].frames[first]);
+				first = -offset;
+			}
+			if (last + offset >= images[1].n_frames && first + offset < images[1].n_frames) {
+				print_range("differ", first, images[1].n_frames - offset - 1, &images[0].frames[first]);
+				n_ranges++;
+				n_differ += images[1].n_frames - offset - first;
+				first = images[1].n_frames - offset;
+			}
+			if (first + offset < 0 || first + offset >= images[1].n_frames)
+				print_range("missing", first, last, &images[0].frames[first]);
+			else {
+				print_range("differ", first, last, &images[0].frames[first]);
+				n_ranges++;
+				n_differ += last - first + 1;
+			}
+			first = -1;
+		}
+	}
+	printf("summary %d ranges %lld frames differ\n", n_ranges, (long long)n_differ);
+	return 0;
+}
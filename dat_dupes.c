@@ -0,0 +1,310 @@
+/*
+ * dat_dupes [-b bit_error_rate] [-m seconds] [-v verbosity] fingerprint-file ...
+ *
+ * Find recordings present on more than one tape (or twice on one tape)
+ * from the ".fingerprint" files written by read_dat -f.  If no files are
+ * given their names are read from stdin, e.g.
+ *
+ *	find /archive -name '*.fingerprint' | dat_dupes
+ *
+ * Every value of every fingerprint is put in one array sorted by value.
+ * Each pair of places in different tracks (or far apart in one track)
+ * sharing a value votes for the time offset between the tracks, values
+ * shared by very many places (e.g. silence) are ignored.  Pairs of tracks
+ * with enough votes for an offset are compared value by value in blocks of
+ * about 10 seconds and the longest run of blocks with fewer than
+ * bit_error_rate (default 0.25) of their bits different is reported
+ * if it is at least seconds (default 10) long:
+ *
+ *	track1.fingerprint 12.36 track2.fingerprint 0.00 95.20 0.087
+ *
+ * giving the start of the matching audio in each track, its length
+ * and its bit error rate.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+
+#define MAX_FILENAME 4096
+#define MAX_SHARED 64               /* ignore values in more places than this */
+#define MIN_VOTES 8
+#define BLOCK 256                   /* values compared together */
+
+char *myname;
+int verbosity = 1;
+
+typedef struct fingerprint {
+	char *filename;
+	int milliseconds;           /* per value */
+	int n_values;
+	uint32_t *values;
+} fingerprint_t;
+
+typedef struct place {
+	uint32_t value;
+	int track;
+	int position;
+} place_t;
+
+typedef struct candidate {
+	int track1, track2;
+	int offset;                 /* position in track2 - position in track1 */
+	int votes;
+} candidate_t;
+
+static fingerprint_t *tracks;
+static int n_tracks, tracks_size;
+static candidate_t *candidates;     /* hash table */
+static int candidates_size, n_candidates;
+
+//__attribute__ ((format (printf, 2, 3)))
+int
+dp(int level, char *format, ...) {
+	va_list ap;
+	if (level > verbosity)
+		return 0;
+	va_start(ap, format);
+	return vfprintf(stderr, format, ap);
+}
+
+//__attribute__ ((noreturn))
+void
+die(char *format, ...) {
+	va_list ap;
+	fprintf(stderr, "%s: ", myname);
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+void
+usage(void) {
+	fprintf(stderr, "Usage: %s [-b bit_error_rate] [-m seconds] [-v verbosity-level] [fingerprint-file ...]\n", myname);
+	exit(1);
+}
+
+uint32_t
+get_int(unsigned char *b) {
+	return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+void
+read_fingerprint(char *filename) {
+	unsigned char h[20], *b;
+	fingerprint_t *t;
+	FILE *fp;
+	int i;
+
+	if ((fp = fopen(filename, "r")) == NULL)
+		die("Can not open %s", filename);
+	if (fread(h, 1, sizeof h, fp) != sizeof h || memcmp(h, "DATFPRNT", 8) != 0 || get_int(h + 8) != 1)
+		die("%s is not a fingerprint file", filename);
+	if (n_tracks == tracks_size) {
+		tracks_size = 2*tracks_size + 1024;
+		if ((tracks = realloc(tracks, tracks_size*sizeof *tracks)) == NULL)
+			die("out of memory");
+	}
+	t = &tracks[n_tracks++];
+	t->filename = strdup(filename);
+	t->milliseconds = get_int(h + 12);
+	t->n_values = get_int(h + 16);
+	if ((t->values = malloc(t->n_values*sizeof *t->values + 1)) == NULL || (b = malloc(4*t->n_values + 1)) == NULL)
+		die("out of memory");
+	if (fread(b, 4, t->n_values, fp) != t->n_values)
+		die("%s is truncated", filename);
+	for (i = 0; i < t->n_values; i++)
+		t->values[i] = get_int(b + 4*i);
+	free(b);
+	fclose(fp);
+	dp(3, "%s: %d values\n", filename, t->n_values);
+}
+
+int
+compare_places(const void *a, const void *b) {
+	const place_t *p = a, *q = b;
+
+	if (p->value != q->value)
+		return p->value < q->value ? -1 : 1;
+	if (p->track != q->track)
+		return p->track - q->track;
+	return p->position - q->position;
+}
+
+int
+compare_votes(const void *a, const void *b) {
+	return ((const candidate_t *)b)->votes - ((const candidate_t *)a)->votes;
+}
+
+void
+vote(int track1, int track2, int offset) {
+	unsigned h;
+	candidate_t *c;
+
+	if (2*(n_candidates + 1) > candidates_size) {
+		candidate_t *old = candidates;
+		int i, old_size = candidates_size;
+		candidates_size = candidates_size ? 2*candidates_size : 1 << 16;
+		if ((candidates = calloc(candidates_size, sizeof *candidates)) == NULL)
+			die("out of memory");
+		n_candidates = 0;
+		for (i = 0; i < old_size; i++)
+			if (old[i].votes) {
+				h = (old[i].track1*2654435761u ^ old[i].track2*40503u ^ old[i].offset*2246822519u) & (candidates_size - 1);
+				while (candidates[h].votes)
+					h = (h + 1) & (candidates_size - 1);
+				candidates[h] = old[i];
+				n_candidates++;
+			}
+		free(old);
+	}
+	h = (track1*2654435761u ^ track2*40503u ^ offset*2246822519u) & (candidates_size - 1);
+	for (;; h = (h + 1) & (candidates_size - 1)) {
+		c = &candidates[h];
+		if (!c->votes) {
+			c->track1 = track1;
+			c->track2 = track2;
+			c->offset = offset;
+			n_candidates++;
+			break;
+		}
+		if (c->track1 == track1 && c->track2 == track2 && c->offset == offset)
+			break;
+	}
+	c->votes++;
+}
+
+/*
+ * longest run of blocks matching with a bit error rate below max_ber
+ * returns its length in values, its start & bit error rate through pointers
+ */
+int
+compare_tracks(candidate_t *c, double max_ber, int *start, double *ber) {
+	fingerprint_t *t1 = &tracks[c->track1], *t2 = &tracks[c->track2];
+	int first = c->offset < 0 ? -c->offset : 0;                       /* in track1 */
+	int last = t1->n_values < t2->n_values - c->offset ? t1->n_values : t2->n_values - c->offset;
+	int i, run_start = first, run_errors = 0, best = 0, best_errors = 0;
+
+	*start = first;
+	for (i = first; i < last; i += BLOCK) {
+		int end = i + BLOCK < last ? i + BLOCK : last, errors = 0, j;
+		for (j = i; j < end; j++)
+			errors += __builtin_popcount(t1->values[j] ^ t2->values[j + c->offset]);
+		if (errors > max_ber*32*(end - i)) {
+			run_start = end;
+			run_errors = 0;
+			continue;
+		}
+		run_errors += errors;
+		if (end - run_start > best) {
+			best = end - run_start;
+			best_errors = run_errors;
+			*start = run_start;
+		}
+	}
+	*ber = best ? best_errors/(32.0*best) : 1;
+	return best;
+}
+
+int
+main(int argc, char *argv[]) {
+	char filename[MAX_FILENAME];
+	double max_ber = 0.25, min_seconds = 10;
+	place_t *places;
+	int c, i, j, k, n_places = 0, n_reported = 0;
+	candidate_t *reported = NULL;
+
+	myname = strrchr(argv[0], '/');
+	if (myname == NULL)
+		myname = argv[0];
+	else
+		myname++;
+	while ((c = getopt(argc, argv, "b:m:v:")) != -1) {
+		switch (c) {
+		case 'b':
+			max_ber = atof(optarg);
+			break;
+		case 'm':
+			min_seconds = atof(optarg);
+			break;
+		case 'v':
+			verbosity = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind < argc) {
+		for (i = optind; i < argc; i++)
+			read_fingerprint(argv[i]);
+	} else {
+		while (fgets(filename, sizeof filename, stdin)) {
+			filename[strcspn(filename, "\n")] = '\0';
+			if (filename[0])
+				read_fingerprint(filename);
+		}
+	}
+
+	for (i = 0; i < n_tracks; i++)
+		n_places += tracks[i].n_values;
+	if ((places = malloc(n_places*sizeof *places + 1)) == NULL)
+		die("out of memory");
+	for (i = 0, k = 0; i < n_tracks; i++)
+		for (j = 0; j < tracks[i].n_values; j++, k++) {
+			places[k].value = tracks[i].values[j];
+			places[k].track = i;
+			places[k].position = j;
+		}
+	qsort(places, n_places, sizeof *places, compare_places);
+	dp(2, "%d values in %d tracks\n", n_places, n_tracks);
+
+	for (i = 0; i < n_places; i = j) {
+		for (j = i + 1; j < n_places && places[j].value == places[i].value; j++)
+			;
+		if (j - i > MAX_SHARED)
+			continue;
+		for (k = i; k < j; k++) {
+			int l;
+			for (l = k + 1; l < j; l++) {
+				/* places are sorted so track of k <= track of l */
+				int offset = places[l].position - places[k].position;
+				if (places[k].track == places[l].track && offset < 2*BLOCK)
+					continue;
+				vote(places[k].track, places[l].track, offset);
+			}
+		}
+	}
+	free(places);
+
+	/* best supported offsets first so duplicates at nearby offsets are skipped */
+	for (i = 0, k = 0; i < candidates_size; i++)
+		if (candidates[i].votes >= MIN_VOTES)
+			candidates[k++] = candidates[i];
+	qsort(candidates, k, sizeof *candidates, compare_votes);
+	dp(2, "%d candidate pairs\n", k);
+	if ((reported = malloc((k + 1)*sizeof *reported)) == NULL)
+		die("out of memory");
+	for (i = 0; i < k; i++) {
+		candidate_t *d = &candidates[i];
+		fingerprint_t *t1 = &tracks[d->track1], *t2 = &tracks[d->track2];
+		double seconds = t1->milliseconds/1000.0, ber;
+		int start, length;
+
+		for (j = 0; j < n_reported; j++)
+			if (reported[j].track1 == d->track1 && reported[j].track2 == d->track2 && abs(reported[j].offset - d->offset) <= 2)
+				break;
+		if (j < n_reported)
+			continue;
+		length = compare_tracks(d, max_ber, &start, &ber);
+		dp(3, "%s %s offset %d votes %d matched %d values\n", t1->filename, t2->filename, d->offset, d->votes, length);
+		if (length*seconds < min_seconds)
+			continue;
+		reported[n_reported++] = *d;
+		printf("%s %.2f %s %.2f %.2f %.3f\n", t1->filename, start*seconds, t2->filename, (start + d->offset)*seconds, length*seconds, ber);
+	}
+	return 0;
+}
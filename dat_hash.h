@@ -0,0 +1,437 @@
+/*
+
+dat_hash - BLAKE3 hashes of tape images and the files extracted from them
+
+read_dat -b and triple_merge -b hash their input images and output files as
+they are written and record the hashes in a manifest in the format
+of b3sum, which dat_verify (or b3sum --check) uses to re-check an archive.
+
+BLAKE3 splits its input into 1024-byte chunks which are the leaves of a
+binary tree, so separate pieces of the input can be hashed at once.
+Data given to dat_hash_update is copied into 1MiB buffers - each full
+buffer is a complete subtree of 1024 chunks which is hashed by a pool of
+threads while the caller goes on reading or writing.  The subtrees'
+chaining values are combined, and the last partial buffer hashed, by
+dat_hash_final.  Only unkeyed 32-byte hashes are implemented.
+
+	dat_hash_t *h = dat_hash_new();
+	while ((n = read(fd, buffer, sizeof buffer)) > 0)
+		dat_hash_update(h, buffer, n);
+	dat_hash_final(h, hex);
+
+A file whose start is re-written when it is finished (e.g. a WAV header
+giving its length) can still be hashed as it is written: a hasher from
+dat_hash_new_rewritable keeps its first 1MiB buffer until dat_hash_final,
+and dat_hash_rewrite changes bytes in it.
+
+dat_hash_final frees the hasher.  Hashers may be used from several threads
+at once (but one hasher by only one thread).  Programs must be linked
+with -lpthread.
+
+*/
+
+#ifndef DAT_HASH_H
+#define DAT_HASH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#define DAT_HASH_LENGTH 32
+#define DAT_HASH_CHUNK 1024
+#define DAT_HASH_SUBTREE_CHUNKS 1024    /* per buffer hashed by a thread */
+#define DAT_HASH_SUBTREE (DAT_HASH_CHUNK*DAT_HASH_SUBTREE_CHUNKS)
+#define DAT_HASH_SLOTS 4                /* buffers per hasher */
+#define DAT_HASH_MAX_THREADS 64
+
+enum {DAT_HASH_CHUNK_START = 1, DAT_HASH_CHUNK_END = 2, DAT_HASH_PARENT = 4, DAT_HASH_ROOT = 8};
+enum {DAT_HASH_FREE, DAT_HASH_QUEUED, DAT_HASH_HASHING, DAT_HASH_DONE};
+
+typedef struct dat_hash_slot {
+	unsigned char *data;
+	uint64_t subtree;               /* index in the input */
+	int state;
+	uint32_t cv[8];
+	struct dat_hash_slot *next;     /* in the queue */
+} dat_hash_slot_t;
+
+typedef struct dat_hash {
+	dat_hash_slot_t slots[DAT_HASH_SLOTS];
+	dat_hash_slot_t *filling;
+	size_t n;                       /* bytes in filling */
+	uint64_t n_subtrees;            /* given to threads */
+	uint32_t (*cvs)[8];             /* of each subtree, in order */
+	uint64_t cvs_size;
+	int rewritable;
+	unsigned char *first;           /* first subtree of a rewritable hasher, hashed by dat_hash_final */
+} dat_hash_t;
+
+/* number of threads hashing, 0 == one per processor */
+static int dat_hash_threads = 0;
+
+static pthread_mutex_t dat_hash_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dat_hash_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t dat_hash_done = PTHREAD_COND_INITIALIZER;
+static dat_hash_slot_t *dat_hash_queue_head, *dat_hash_queue_tail;
+static int dat_hash_threads_running = 0;
+
+static const uint32_t dat_hash_iv[8] = {
+	0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+static const unsigned char dat_hash_permutation[16] = {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8};
+
+static inline uint32_t
+dat_hash_rotr(uint32_t w, int c) {
+	return (w >> c) | (w << (32 - c));
+}
+
+static inline void
+dat_hash_g(uint32_t *s, int a, int b, int c, int d, uint32_t x, uint32_t y) {
+	s[a] = s[a] + s[b] + x;
+	s[d] = dat_hash_rotr(s[d] ^ s[a], 16);
+	s[c] = s[c] + s[d];
+	s[b] = dat_hash_rotr(s[b] ^ s[c], 12);
+	s[a] = s[a] + s[b] + y;
+	s[d] = dat_hash_rotr(s[d] ^ s[a], 8);
+	s[c] = s[c] + s[d];
+	s[b] = dat_hash_rotr(s[b] ^ s[c], 7);
+}
+
+/*
+ * BLAKE3 compression function, the new chaining value replaces cv
+ */
+static void
+dat_hash_compress(uint32_t cv[8], const unsigned char block[64], uint64_t counter, uint32_t block_len, uint32_t flags) {
+	uint32_t s[16], m[16], t[16];
+	int i, r;
+
+	for (i = 0; i < 16; i++)
+		m[i] = block[4*i] | (block[4*i+1] << 8) | (block[4*i+2] << 16) | ((uint32_t)block[4*i+3] << 24);
+	memcpy(s, cv, 8*sizeof *s);
+	memcpy(s + 8, dat_hash_iv, 4*sizeof *s);
+	s[12] = (uint32_t)counter;
+	s[13] = (uint32_t)(counter >> 32);
+	s[14] = block_len;
+	s[15] = flags;
+	for (r = 0; r < 7; r++) {
+		dat_hash_g(s, 0, 4, 8, 12, m[0], m[1]);
+		dat_hash_g(s, 1, 5, 9, 13, m[2], m[3]);
+		dat_hash_g(s, 2, 6, 10, 14, m[4], m[5]);
+		dat_hash_g(s, 3, 7, 11, 15, m[6], m[7]);
+		dat_hash_g(s, 0, 5, 10, 15, m[8], m[9]);
+		dat_hash_g(s, 1, 6, 11, 12, m[10], m[11]);
+		dat_hash_g(s, 2, 7, 8, 13, m[12], m[13]);
+		dat_hash_g(s, 3, 4, 9, 14, m[14], m[15]);
+		for (i = 0; i < 16; i++)
+			t[i] = m[dat_hash_permutation[i]];
+		memcpy(m, t, sizeof m);
+	}
+	for (i = 0; i < 8; i++)
+		cv[i] = s[i] ^ s[i + 8];
+}
+
+/*
+ * chaining value of a chunk of up to 1024 bytes
+ */
+static void
+dat_hash_chunk(const unsigned char *data, size_t n, uint64_t chunk, uint32_t root, uint32_t cv[8]) {
+	unsigned char block[64];
+	size_t i = 0;
+
+	memcpy(cv, dat_hash_iv, sizeof dat_hash_iv);
+	do {
+		size_t m = n - i < 64 ? n - i : 64;
+		uint32_t flags = (i == 0 ? DAT_HASH_CHUNK_START : 0) | (i + m == n ? DAT_HASH_CHUNK_END | root : 0);
+		memset(block, 0, sizeof block);
+		memcpy(block, data + i, m);
+		dat_hash_compress(cv, block, chunk, m, flags);
+		i += m;
+	} while (i < n);
+}
+
+static void
+dat_hash_parent(const uint32_t left[8], const uint32_t right[8], uint32_t root, uint32_t cv[8]) {
+	unsigned char block[64];
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		uint32_t w = i < 8 ? left[i] : right[i - 8];
+		block[4*i] = w;
+		block[4*i+1] = w >> 8;
+		block[4*i+2] = w >> 16;
+		block[4*i+3] = w >> 24;
+	}
+	memcpy(cv, dat_hash_iv, sizeof dat_hash_iv);
+	dat_hash_compress(cv, block, 0, 64, DAT_HASH_PARENT | root);
+}
+
+/*
+ * chaining value of the complete (non-root) subtree of 1024 chunks in a buffer
+ */
+static void
+dat_hash_subtree(const unsigned char *data, uint64_t subtree, uint32_t cv[8]) {
+	uint32_t cvs[DAT_HASH_SUBTREE_CHUNKS][8];
+	int i, n;
+
+	for (i = 0; i < DAT_HASH_SUBTREE_CHUNKS; i++)
+		dat_hash_chunk(data + i*DAT_HASH_CHUNK, DAT_HASH_CHUNK, subtree*DAT_HASH_SUBTREE_CHUNKS + i, 0, cvs[i]);
+	for (n = DAT_HASH_SUBTREE_CHUNKS; n > 1; n /= 2)
+		for (i = 0; i < n/2; i++)
+			dat_hash_parent(cvs[2*i], cvs[2*i+1], 0, cvs[i]);
+	memcpy(cv, cvs[0], sizeof cvs[0]);
+}
+
+static void *
+dat_hash_thread(void *arg) {
+	dat_hash_slot_t *s;
+
+	for (;;) {
+		pthread_mutex_lock(&dat_hash_mutex);
+		while (!dat_hash_queue_head)
+			pthread_cond_wait(&dat_hash_queued, &dat_hash_mutex);
+		s = dat_hash_queue_head;
+		if (!(dat_hash_queue_head = s->next))
+			dat_hash_queue_tail = NULL;
+		s->state = DAT_HASH_HASHING;
+		pthread_mutex_unlock(&dat_hash_mutex);
+		dat_hash_subtree(s->data, s->subtree, s->cv);
+		pthread_mutex_lock(&dat_hash_mutex);
+		s->state = DAT_HASH_DONE;
+		pthread_cond_broadcast(&dat_hash_done);
+		pthread_mutex_unlock(&dat_hash_mutex);
+	}
+	return NULL;
+}
+
+/*
+ * move the chaining values of hashed buffers into cvs, called with the mutex held
+ */
+static void
+dat_hash_collect(dat_hash_t *h) {
+	int i;
+
+	for (i = 0; i < DAT_HASH_SLOTS; i++) {
+		dat_hash_slot_t *s = &h->slots[i];
+		if (s->state != DAT_HASH_DONE)
+			continue;
+		if (s->subtree >= h->cvs_size) {
+			h->cvs_size = 2*s->subtree + 1024;
+			if ((h->cvs = realloc(h->cvs, h->cvs_size*sizeof *h->cvs)) == NULL) {
+				fprintf(stderr, "dat_hash: out of memory\n");
+				exit(1);
+			}
+		}
+		memcpy(h->cvs[s->subtree], s->cv, sizeof s->cv);
+		s->state = DAT_HASH_FREE;
+	}
+}
+
+/*
+ * give the full buffer to the threads and wait for a free one
+ */
+static void
+dat_hash_submit(dat_hash_t *h) {
+	dat_hash_slot_t *s = h->filling;
+	int i;
+
+	if (h->rewritable && h->n_subtrees == 0) {
+		h->first = s->data;
+		if ((s->data = malloc(DAT_HASH_SUBTREE)) == NULL) {
+			fprintf(stderr, "dat_hash: out of memory\n");
+			exit(1);
+		}
+		h->n_subtrees = 1;
+		h->n = 0;
+		return;
+	}
+	pthread_mutex_lock(&dat_hash_mutex);
+	if (!dat_hash_threads_running) {
+		pthread_t thread;
+		int n = dat_hash_threads > 0 ? dat_hash_threads : sysconf(_SC_NPROCESSORS_ONLN);
+		if (n < 1)
+			n = 1;
+		if (n > DAT_HASH_MAX_THREADS)
+			n = DAT_HASH_MAX_THREADS;
+		for (i = 0; i < n; i++)
+			if (pthread_create(&thread, NULL, dat_hash_thread, NULL) != 0 || pthread_detach(thread) != 0) {
+				fprintf(stderr, "dat_hash: can not create thread\n");
+				exit(1);
+			}
+		dat_hash_threads_running = n;
+	}
+	s->subtree = h->n_subtrees++;
+	s->state = DAT_HASH_QUEUED;
+	s->next = NULL;
+	if (dat_hash_queue_tail)
+		dat_hash_queue_tail->next = s;
+	else
+		dat_hash_queue_head = s;
+	dat_hash_queue_tail = s;
+	pthread_cond_signal(&dat_hash_queued);
+	for (h->filling = NULL; !h->filling; ) {
+		dat_hash_collect(h);
+		for (i = 0; i < DAT_HASH_SLOTS; i++)
+			if (h->slots[i].state == DAT_HASH_FREE) {
+				h->filling = &h->slots[i];
+				break;
+			}
+		if (!h->filling)
+			pthread_cond_wait(&dat_hash_done, &dat_hash_mutex);
+	}
+	pthread_mutex_unlock(&dat_hash_mutex);
+	h->n = 0;
+}
+
+static dat_hash_t *
+dat_hash_new(void) {
+	dat_hash_t *h;
+	int i;
+
+	if ((h = calloc(1, sizeof *h)) == NULL) {
+		fprintf(stderr, "dat_hash: out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < DAT_HASH_SLOTS; i++)
+		if ((h->slots[i].data = malloc(DAT_HASH_SUBTREE)) == NULL) {
+			fprintf(stderr, "dat_hash: out of memory\n");
+			exit(1);
+		}
+	h->filling = &h->slots[0];
+	return h;
+}
+
+/*
+ * a hasher whose first DAT_HASH_SUBTREE bytes can be changed by dat_hash_rewrite
+ */
+__attribute__ ((unused))
+static dat_hash_t *
+dat_hash_new_rewritable(void) {
+	dat_hash_t *h = dat_hash_new();
+
+	h->rewritable = 1;
+	return h;
+}
+
+/*
+ * replace n bytes already given to a rewritable hasher at offset in its input
+ */
+__attribute__ ((unused))
+static void
+dat_hash_rewrite(dat_hash_t *h, size_t offset, const void *data, size_t n) {
+	unsigned char *first = h->first ? h->first : h->filling->data;
+
+	if (!h->rewritable || offset + n > (h->first ? DAT_HASH_SUBTREE : h->n)) {
+		fprintf(stderr, "dat_hash: internal error rewrite outside first subtree\n");
+		exit(1);
+	}
+	memcpy(first + offset, data, n);
+}
+
+static void
+dat_hash_update(dat_hash_t *h, const void *data, size_t n) {
+	const unsigned char *d = data;
+
+	while (n > 0) {
+		size_t m;
+		/* a full buffer is only hashed when more data follows - it might be the root */
+		if (h->n == DAT_HASH_SUBTREE)
+			dat_hash_submit(h);
+		m = DAT_HASH_SUBTREE - h->n < n ? DAT_HASH_SUBTREE - h->n : n;
+		memcpy(h->filling->data + h->n, d, m);
+		h->n += m;
+		d += m;
+		n -= m;
+	}
+}
+
+/*
+ * finish the hash, put it in hex (2*DAT_HASH_LENGTH + 1 bytes) & free the hasher
+ */
+static void
+dat_hash_final(dat_hash_t *h, char *hex) {
+	uint32_t stack[64][8], cv[8];
+	uint64_t i, total, first_chunk = h->n_subtrees*DAT_HASH_SUBTREE_CHUNKS;
+	size_t n_chunks = h->n ? (h->n + DAT_HASH_CHUNK - 1)/DAT_HASH_CHUNK : 1, j;
+	int depth = 0, k;
+
+	pthread_mutex_lock(&dat_hash_mutex);
+	for (;;) {
+		dat_hash_collect(h);
+		for (k = 0; k < DAT_HASH_SLOTS; k++)
+			if (h->slots[k].state == DAT_HASH_QUEUED || h->slots[k].state == DAT_HASH_HASHING)
+				break;
+		if (k == DAT_HASH_SLOTS)
+			break;
+		pthread_cond_wait(&dat_hash_done, &dat_hash_mutex);
+	}
+	pthread_mutex_unlock(&dat_hash_mutex);
+	if (h->first) {
+		if (h->cvs_size == 0) {
+			h->cvs_size = 1;
+			if ((h->cvs = malloc(sizeof *h->cvs)) == NULL) {
+				fprintf(stderr, "dat_hash: out of memory\n");
+				exit(1);
+			}
+		}
+		dat_hash_subtree(h->first, 0, h->cvs[0]);
+		free(h->first);
+	}
+
+	/* merge equal sized subtrees as they are pushed, the root is merged last */
+	for (i = 0; i < h->n_subtrees; i++) {
+		memcpy(cv, h->cvs[i], sizeof cv);
+		for (total = i + 1; !(total & 1); total >>= 1)
+			dat_hash_parent(stack[--depth], cv, 0, cv);
+		memcpy(stack[depth++], cv, sizeof cv);
+	}
+	for (j = 0; j + 1 < n_chunks; j++) {
+		dat_hash_chunk(h->filling->data + j*DAT_HASH_CHUNK, DAT_HASH_CHUNK, first_chunk + j, 0, cv);
+		for (total = first_chunk + j + 1; !(total & 1); total >>= 1)
+			dat_hash_parent(stack[--depth], cv, 0, cv);
+		memcpy(stack[depth++], cv, sizeof cv);
+	}
+	dat_hash_chunk(h->filling->data + j*DAT_HASH_CHUNK, h->n - j*DAT_HASH_CHUNK, first_chunk + j, depth ? 0 : DAT_HASH_ROOT, cv);
+	while (depth > 0) {
+		depth--;
+		dat_hash_parent(stack[depth], cv, depth ? 0 : DAT_HASH_ROOT, cv);
+	}
+
+	for (k = 0; k < DAT_HASH_LENGTH; k++)
+		sprintf(hex + 2*k, "%02x", (cv[k/4] >> (8*(k % 4))) & 0xff);
+	for (k = 0; k < DAT_HASH_SLOTS; k++)
+		free(h->slots[k].data);
+	free(h->cvs);
+	free(h);
+}
+
+/*
+ * hash a file, returns -1 if it can not be read
+ */
+__attribute__ ((unused))
+static int
+dat_hash_file(const char *filename, char *hex) {
+	static __thread unsigned char *buffer;
+	dat_hash_t *h;
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY)) < 0)
+		return -1;
+	if (!buffer && (buffer = malloc(DAT_HASH_SUBTREE)) == NULL) {
+		fprintf(stderr, "dat_hash: out of memory\n");
+		exit(1);
+	}
+	h = dat_hash_new();
+	while ((n = read(fd, buffer, DAT_HASH_SUBTREE)) > 0)
+		dat_hash_update(h, buffer, n);
+	close(fd);
+	dat_hash_final(h, hex);
+	return n < 0 ? -1 : 0;
+}
+
+#endif
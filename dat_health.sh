@@ -0,0 +1,57 @@
+#!/bin/sh
+# Usage dat_health.sh health-map ...
+# e.g. dat_health.sh tapes/*/tape.health
+# rank tapes by the health maps written by read_dat -H and triple_merge -H
+# without re-reading the images, worst first
+# prints for each map: score (percentage of frames without errors),
+# score of its worst bin, first frame of its worst bin, frames & the map
+# read_dat & triple_merge count errors differently so their maps are
+# ranked separately, each under a heading naming the type
+
+if test $# = 0
+then
+	echo "Usage: $0 health-map ..." 1>&2
+	exit 1
+fi
+
+for map in "$@"
+do
+	awk '
+	$1 == "type" {
+		type = $2
+	}
+	$1 == "summary" {
+		for (i = 2; i < NF; i++)
+			if ($i == "score")
+				score = $(i + 1)
+		frames = $2
+	}
+	$1 == "bin" && $3 > 0 {
+		bin_score = 100 * ($3 - $NF) / $3
+		if (worst == "" || bin_score < worst) {
+			worst = bin_score
+			worst_frame = $2
+		}
+	}
+	END {
+		if (score == "" || type == "") {
+			print FILENAME ": not a health map" > "/dev/stderr"
+			exit 1
+		}
+		if (worst == "") {
+			worst = 100
+			worst_frame = 0
+		}
+		printf "%s %8.3f %8.3f %9d %9d %s\n", type, score, worst, worst_frame, frames, FILENAME
+	}' "$map"
+done |
+sort -k1,1 -k2,2n -k3,3n |
+awk '
+$1 != type {
+	type = $1
+	print "# " type " health maps"
+}
+{
+	sub(/^[^ ]* /, "")
+	print
+}'
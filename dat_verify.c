@@ -0,0 +1,121 @@
+/*
+ * dat_verify [-j threads] [-v verbosity] manifest ...
+ *
+ * Check the files listed in manifests written by read_dat -b or
+ * triple_merge -b (or by b3sum) still have the BLAKE3 hashes recorded.
+ * Each line of a manifest is a hash, two spaces and a file name - relative
+ * names are relative to the current directory, as for b3sum --check.
+ *
+ *	2001-02-03-08-46-40.wav: OK
+ *	2001-02-03-10-10-00.wav: FAILED
+ *
+ * Files are read one at a time in large sequential reads while
+ * threads (default one per processor) hash separate 1MiB pieces of each file,
+ * so an archive is checked about as fast as the disk can be read.
+ * The exit status is 1 if any file is missing or differs.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdarg.h>
+#include "dat_hash.h"
+
+#define MAX_FILENAME 4096
+
+char *myname;
+int verbosity = 1;
+
+//__attribute__ ((format (printf, 2, 3)))
+int
+dp(int level, char *format, ...) {
+	va_list ap;
+	if (level > verbosity)
+		return 0;
+	va_start(ap, format);
+	return vfprintf(stderr, format, ap);
+}
+
+//__attribute__ ((noreturn))
+void
+die(char *format, ...) {
+	va_list ap;
+	fprintf(stderr, "%s: ", myname);
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+void
+usage(void) {
+	fprintf(stderr, "Usage: %s [-j threads] [-v verbosity-level] manifest ...\n", myname);
+	exit(1);
+}
+
+/*
+ * check the files listed in a manifest, returns the number which failed
+ */
+int
+verify_manifest(char *manifest) {
+	char line[2*DAT_HASH_LENGTH + MAX_FILENAME + 4], hash[2*DAT_HASH_LENGTH + 1];
+	int n_failed = 0, n_files = 0;
+	FILE *fp;
+
+	if ((fp = fopen(manifest, "r")) == NULL)
+		die("Can not open %s", manifest);
+	while (fgets(line, sizeof line, fp)) {
+		char *filename = line + 2*DAT_HASH_LENGTH + 2;
+		line[strcspn(line, "\n")] = '\0';
+		if (strlen(line) < 2*DAT_HASH_LENGTH + 3 || strncmp(line + 2*DAT_HASH_LENGTH, "  ", 2) != 0) {
+			dp(1, "%s: ignoring line '%s'\n", manifest, line);
+			continue;
+		}
+		n_files++;
+		if (dat_hash_file(filename, hash) < 0) {
+			printf("%s: FAILED open or read\n", filename);
+			n_failed++;
+		} else if (strncmp(hash, line, 2*DAT_HASH_LENGTH) != 0) {
+			printf("%s: FAILED\n", filename);
+			n_failed++;
+		} else if (verbosity >= 1)
+			printf("%s: OK\n", filename);
+		fflush(stdout);
+	}
+	fclose(fp);
+	dp(2, "%s: %d files, %d failed\n", manifest, n_files, n_failed);
+	return n_failed;
+}
+
+int
+main(int argc, char *argv[]) {
+	int c, i, n_failed = 0;
+
+	myname = strrchr(argv[0], '/');
+	if (myname == NULL)
+		myname = argv[0];
+	else
+		myname++;
+	while ((c = getopt(argc, argv, "j:v:")) != -1) {
+		switch (c) {
+		case 'j':
+			dat_hash_threads = atoi(optarg);
+			if (dat_hash_threads < 1)
+				usage();
+			break;
+		case 'v':
+			verbosity = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind == argc)
+		usage();
+	for (i = optind; i < argc; i++)
+		n_failed += verify_manifest(argv[i]);
+	if (n_failed)
+		dp(0, "%s: WARNING: %d files did NOT match\n", myname, n_failed);
+	return n_failed != 0;
+}
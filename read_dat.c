@@ -28,8 +28,136 @@ OPTIONS
 	Maximum number of consecutive non-audio frames before track closed
 	Default is 0.
 	
+-b  --hash
+	Write BLAKE3 hashes of the input image and of every file written to
+	filename-prefixtape.b3sum in the format of b3sum, so the archive
+	can be re-checked with dat_verify (or b3sum --check).  The image and
+	tracks are hashed as they are read and written, by threads working
+	on separate 1MiB pieces (see dat_hash.h), so audio isn't copied
+	inside the kernel and tracks are decoded in order (-T has no effect).
+	A track's first 1MiB is hashed when it is finished because its header
+	is re-written then; other files are hashed when they are finished.
+	Compressed images are hashed as stored.
+	Images read from a tape drive or with -S are not hashed.  If several
+	images are given each image's hashes are written to a file named
+	after it, as for -H.  Can not be used with -x.
+
+-B seconds[:level]  --split_on_silence seconds[:level]
+	Also start a new track after silence lasting at least this many
+	seconds, for tapes recorded without start IDs or dates.  A frame is
+	silent if its RMS level is below level dBFS (default -60) and
+	no sample is more than 20dB above that.  The split is made in the middle
+	of the silence.  Silent frames are held in memory until the silence
+	ends - in silences longer than 60 seconds (or twice the given seconds)
+	the split is made that long before the end.  Can not be used with -x.
+
+-c  --classify_frames
+	Also list frames whose audio looks damaged although the tape drive
+	didn't flag it in ".invalid_frames": frames whose audio is all 0xFF bytes,
+	all zero frames following audio (dropouts), & frames with a channel stuck
+	at one non-zero value for 64 samples or at full scale for 8 samples.
+
+-C mode  --split_channels mode
+	Write each 4-channel track as two stereo WAV files (mode pairs)
+	or one mono WAV file per channel (mode mono) instead of one
+	4-channel WAV file.  The files are named with .ch1-2.wav, .ch3-4.wav
+	or .ch1.wav ... .ch4.wav in place of .wav.  Can not be used with -x.
+
 -d  --ignore_date_time
 	Don't start a new track if the date/time jumps.
+
+-E  --de_emphasis
+	Remove 50/15us pre-emphasis from the audio of tracks recorded with it
+	as the audio is written.  The track's ".details" file records that
+	this was done.
+
+-e filename  --metrics_file filename
+	In batch and watch mode, keep filename up to date with the number of
+	jobs queued, running, finished & failed and the status of each job.
+	If filename can't be written a warning is given and jobs continue.
+
+-F format  --output_format format
+	Sample format of the WAV files: s16 (16-bit integer), s24 (24-bit integer)
+	or f32 (32-bit float).  s24 and f32 files have a WAVE_FORMAT_EXTENSIBLE
+	header.  The conversion is done as the audio is written.  Default is s16.
+
+-f  --fingerprint
+	Write an audio fingerprint of each track to a ".fingerprint" file so
+	dat_dupes can find recordings present on more than one tape.
+	Every 40ms of audio gives a 32-bit value whose bits are the signs of
+	changes in energy differences between 33 bands from 300hz to 2000hz,
+	so it survives noise, level changes & a different sampling frequency.
+	The file is "DATFPRNT", version (4 bytes), milliseconds per value
+	(4 bytes), number of values (4 bytes) followed by the values, all
+	little-endian.  Can not be used with -x.
+
+-g library[:argument]  --stage library[:argument]
+	Load a processing stage from the shared library and send it the
+	audio of every track, see read_dat_stage.h.  The stage runs on its
+	own thread.  May be given more than once.
+
+-G library[:argument]  --inline_stage library[:argument]
+	As -g but the stage runs in read_dat's main thread.
+
+-H  --health_map
+	Write a map of the tape's condition to filename-prefixtape.health for
+	finding tapes which should be recaptured (see dat_health.sh).  If
+	several images are given each map is named after its image
+	(without suffix) instead of tape, e.g. filename-prefixa.health.
+	For each bin of 1000 frames (30 seconds) it gives the
+	number of frames read, frames with interpolate flags set, subcode packs
+	with parity errors, non-audio frames, frames found damaged by -c and
+	frames with any of these errors other than non-audio.  Its
+	summary line gives the totals, the percentage of frames without errors
+	(the score) & the worst bin's percentage.  Its type line distinguishes
+	it from triple_merge's maps, whose columns differ.  Can not be used with -x.
+
+-I streams  --max_io_streams streams
+	In batch mode, run at most this many jobs at once reading from the
+	same disk.  Default is 1.
+
+-j jobs  --jobs jobs
+	Batch mode - process the input files in parallel, at most jobs at once.
+	The files for each input are created in a directory named after
+	the input with any suffix removed.  If -I allows more than one job
+	to read a disk, an uncompressed image longer than 100000 frames
+	(about 50 minutes) is split into jobs each extracting 100000 frames
+	as -x does, followed by a job joining their fragments as -z does -
+	unless options which can not be used with -x are given.
+
+-i  --conceal
+	Conceal errors in frames of 16-bit linear audio which have interpolate
+	flags set (or are found by -c) by replacing their audio with a
+	line from the last samples of the previous frame to the first samples
+	of the next frame (or holding the last sample if it also has errors).
+	Concealed frames are listed in ".invalid_frames" as "invalid, concealed".
+	Can not be used with -x.
+
+-J filename  --job_list filename
+	Batch mode - read input files from filename as well as the command line.
+	Each line contains an input file optionally followed by the
+	directory its output should be created in.
+
+-k seconds  --spectrogram seconds
+	Write a spectrogram of each track to a ".pgm" (greyscale image) file for
+	a quick look at hum, dropouts & bandwidth.  Each column is the average
+	spectrum of this many seconds of audio (all channels mixed), each row one
+	of 256 frequency bands with 0hz at the bottom.  Levels from -120dB (black)
+	to 0dB (white) relative to a full scale sine.  The spectrogram is
+	computed on its own thread.  Can not be used with -x.
+
+-l  --meter
+	Measure each track's loudness (EBU R128 integrated loudness), true peak,
+	DC offset & number of clipped samples as it is written and add them to
+	its ".details" file.  The measurement runs on its own thread.
+	Loudness and peaks of a silent track are given as -inf.
+	Can not be used with -x.
+
+-L milliseconds  --stall_threshold milliseconds
+	Reads of the input taking longer than this are counted as stalls and
+	reported with the frame number and what read_dat was doing (e.g. blocked
+	on write, close_track) before the read.  A histogram of read latencies
+	is printed at the end of the input.  Default is 100 milliseconds.
 	
 -m seconds  --minimum_track_length seconds
 	Tracks less than this length will be ignored.  The value is a double.
@@ -38,6 +166,7 @@ OPTIONS
 -M seconds  --maximum_track_length seconds
 	Do not create tracks longer than this number of seconds.  The value is a double.
 	A new track will be started if this limit is reached. Default is 360000.0 seconds.
+	Can not be used with -x.
 
 -n  --ignore_program_number
 	Don't start a new track if the program number changes.
@@ -46,12 +175,53 @@ OPTIONS
 	Create WAV files named filename-prefix0.wav, filename-prefix1.wav ...
 	Default is ""
 	
+-P command  --pipe command
+	Also send the audio of each track to command's standard input as it is
+	written.  The command is run by /bin/sh once per track with environment
+	variables TRACK (the track's filename without .wav), RATE, CHANNELS,
+	BITS and FORMAT (s16, s24 or f32) describing the audio which is
+	little-endian and interleaved, e.g.
+
+	-P 'flac -s -f --force-raw-format --endian=little --sign=signed \
+		--channels=$CHANNELS --bps=$BITS --sample-rate=$RATE -o $TRACK.flac -'
+
+	May be given more than once.  Each command is fed by its own thread
+	from a queue - the slowest command sets the pace of extraction.
+	TRACK is the name the track is created with, it changes if
+	the first frames of the track have no date.  If the track is then
+	discarded (e.g. it is shorter than -m) the command's process group
+	is sent SIGTERM before its input is closed, so a command which
+	creates a file should remove it, e.g.
+
+	-P 'trap "rm -f $TRACK.flac; exit 1" TERM; flac ... -o $TRACK.flac -'
+
+	Can not be used with -x.
+
 -q	--quiet
 	Turn off warnings.
 	
+-t seconds  --settle_seconds seconds
+	In watch mode, an image is considered complete when its size hasn't
+	changed for this long, or as soon as a file of the same name with
+	".done" appended appears.  Default is 60 seconds.
+
 -r seconds  --read_n_seconds seconds
 	Read at most this number of seconds of audio.
-	Default is 360000.0 seconds.
+	Default is 360000.0 seconds.  Can not be used with -x.
+
+-T threads  --decode_threads threads
+	Decode and write the audio of each track using this many threads.
+	Every frame of a track produces a fixed number of bytes of output
+	so frames are decoded in parallel in batches and written
+	to their place in the WAV file.  Most useful for 12-bit non-linear (LP)
+	tracks.  Default is 1 (decode in the main thread).
+
+-R frequency  --resample frequency
+	Resample the audio of tracks to this sampling frequency as it is
+	written, e.g. -R 44100 to produce CD-rate files from 48khz & 32khz tapes.
+	A windowed-sinc polyphase filter is used.  The ".details" file gives the
+	tape's sampling frequency and records the resampling.  Can not be used
+	with -x.
 
 -s frames	--skip_n_frames
 	Skip n frames on segment change.
@@ -68,6 +238,59 @@ OPTIONS
 -V	--version
 	Print the program version number
 
+-w  --peaks
+	Write a waveform overview of each track to a ".peaks" file for
+	drawing waveforms without reading the WAV file.  It holds the minimum
+	& maximum of each channel over blocks of 256, 1024, 4096, 16384 &
+	65536 samples.  All values are little-endian:
+
+		8 bytes		"DATPEAKS"
+		4 bytes		version (1)
+		4 bytes		sampling frequency
+		4 bytes		channels
+		4 bytes		levels
+		8 bytes		samples (per channel) in the track
+		for each level:
+			4 bytes		samples per block
+			4 bytes		blocks
+		for each level, for each block, for each channel:
+			2 bytes		minimum (signed 16-bit)
+			2 bytes		maximum (signed 16-bit)
+
+	The last block of each level may be partial.  Can not be used with -x.
+
+-x first:last  --shard first:last
+	Process only frames first..last-1 of the image (counting from the start
+	of the image file) so a long image can be split across several processes.
+	Frames before first are read for --shard_overlap frames to find any
+	track in progress at first.  Instead of WAV files the audio is written to
+	fragment files described in filename-prefixshardfirst.manifest
+	which are joined by -z.
+
+-X frames  --shard_overlap frames
+	Number of frames read before the start of a shard.  Default is 1000.
+
+-z  --stitch
+	Join the fragments listed in the manifests given as arguments (in order)
+	producing the same WAV, .details & .invalid_frames files as
+	processing the whole image in one run.
+
+-W directory  --watch directory
+	Run as a daemon, extracting images as they appear in directory (which
+	may be given more than once).  Images present at startup are also
+	extracted unless their output directory already exists.  Jobs are
+	scheduled as in batch mode.  Files whose names start with "." or end
+	in ".tmp" or ".done", and the -e metrics file, are not images.  A
+	".done" file only marks an image complete if the image exists when
+	it appears, otherwise the image waits for -t.
+
+read_dat -p out/ -x 0:100000 tape.img &
+read_dat -p out/ -x 100000:200000 tape.img &
+wait
+read_dat -p out/ -z out/shard0.manifest out/shard100000.manifest
+
+will extract tape.img using two processes.
+
 EXAMPLE
 
 If /dev/st0 is an audio-capable DDS drive with a DAT inserted
@@ -78,6 +301,20 @@ should create a series of ".wav" files containing the audio data
 from the tape.  An accompany series of ".details" files will
 also be created.
 
+Tape images compressed with zstd, xz, gzip or bzip2 can be given
+directly - they are recognised by their magic number and decompressed
+on the fly by the corresponding program running in parallel with read_dat.
+
+read_dat tape_image.zst
+
+Images stored in chunks with dat_archive are read with dat_archive -d,
+which decompresses chunks with one thread per processor, and -S only
+decompresses the chunk containing the frame sought.
+
+When reading an uncompressed image file only the last 62 bytes of each
+frame are read by read_dat - 16-bit PCM audio is copied from the image
+to the ".wav" file inside the kernel with copy_file_range.
+
 AUTHOR
 	Andrew Taylor (andrewt@cse.unsw.edu.au)
 	with additions by (Torsten Lang, read_dat@torstenlang.de (use read_dat in subject line))
@@ -97,7 +334,9 @@ sometimes bad data at start of track encoded with 12-bit non-linear encoding (LP
 
 Untested on big-endian machines.
 
-4-channel DATs untested.
+4-channel DATs are assumed to use the 12-bit non-linear packing of LP mode
+with the samples of the 4 channels interleaved - this has not been checked
+against a real 4-channel tape.
 
 Warning messages confusing.
 
@@ -140,6 +379,9 @@ At 32khz frame[0..3840] contains are 960 pairs of left & right 16-bit samples
 
 12-bit non-linear encoding is used with a 32khz sample-rate and half tape speed -
 frame[0..5759] contains 1920 pairs of left & right 12-bit samples
+
+4-channel recordings also use 12-bit non-linear encoding at 32khz but at normal
+tape speed - frame[0..5759] contains 960 groups of 4 12-bit samples
 I don't know how the non-linear encoding is done or how it is laid out
 within the frame.
 
@@ -157,6 +399,7 @@ for an operational description of  the format of the last 62 bytes.
 
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -165,10 +408,21 @@ for an operational description of  the format of the last 62 bytes.
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
+#include <limits.h>
 #include <getopt.h>
 #include <utime.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <sys/wait.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <math.h>
+#include <signal.h>
+#include <dlfcn.h>
+#include "read_dat_stage.h"
+#include "dat_hash.h"
 
 
 #define FRAME_SIZE 5822
@@ -187,41 +441,180 @@ for an operational description of  the format of the last 62 bytes.
 #define MAINID_OFFSET (SUBID_OFFSET + 4)
 
 #define MAX_FILENAME 8192
-#define WAV_HEADER_LENGTH 44
+#define MAX_WAV_HEADER_LENGTH 80
+
+#define OUTPUT_S16 0
+#define OUTPUT_S24 1
+#define OUTPUT_F32 2
+/* bytes of output from the 3840 samples of an LP frame, the most of any frame */
+#define MAX_RESAMPLE_RATIO 3
+#define MAX_RESAMPLE_TAPS (4*8*6)                 /* for 48khz to 8khz */
+#define MAX_OUTPUT_FRAME_SAMPLES (SOUND_DATA_SIZE_32KHZ_NONLINEAR_UNPACKED/2*MAX_RESAMPLE_RATIO + 16)
+#define MAX_OUTPUT_FRAME_BYTES (MAX_OUTPUT_FRAME_SAMPLES*4)
 
 #define CTRL_PRIO  8
 #define CTRL_START 4
 #define CTRL_SKIP  2
 #define CTRL_TOC   1
 
-typedef struct frame_info {
-	int invalid;                // 0 == valid, 1 == invalid fields, 2 = non-audio
-	int nChannels;
-	int sampling_frequency;
-	int encoding;
-	int emphasis;
-	time_t date_time;
-	int program_number;
-	int hex_pno;
-	int interpolate_flags;
-	int frame_number;
-} frame_info_t;
+#define N_LATENCY_BUCKETS 32
+
+#define DECODE_BATCH_FRAMES 64
+#define BATCH_SHARD_FRAMES 100000                 /* batch mode splits longer images into shards this long */
+#define BATCH_FREE 0
+#define BATCH_FILLING 1
+#define BATCH_QUEUED 2
+#define BATCH_DECODING 3
+
+#define MAX_SINKS 16
+#define SINK_QUEUE_LENGTH 64
+#define SINK_OPEN 0
+#define SINK_AUDIO 1
+#define SINK_CLOSE 2
+
+/*
+ * audio shared by the sinks, freed when the last sink has finished with it
+ */
+typedef struct sink_buffer {
+	int refs;
+	int n;
+	unsigned char data[MAX_OUTPUT_FRAME_BYTES];
+} sink_buffer_t;
+
+typedef struct sink_event {
+	int type;
+	sink_buffer_t *buffer;                  // SINK_AUDIO only
+	frame_info_t info;
+	int keep;                               // SINK_CLOSE - 0 if track discarded
+} sink_event_t;
+
+/*
+ * A sink is sent each track's audio, in the output format
+ * before any split into several files, from the queue by its own thread
+ * (or directly if inline is set).
+ * open is called with the track's first frame, audio for each frame
+ * and close when the track is finished, details when a kept track's
+ * .details file is written.  The track_ globals describe the track
+ * until close has returned.
+ */
+typedef struct sink {
+	char *name;
+	void (*open)(struct sink *s, frame_info_t *info);
+	void (*audio)(struct sink *s, unsigned char *data, int n, frame_info_t *info);
+	void (*close)(struct sink *s, int keep);
+	void (*details)(struct sink *s, FILE *fp);
+	void *state;                            // the sink's own
+	int inline_sink;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	sink_event_t queue[SINK_QUEUE_LENGTH];
+	int head, n_queued, busy;
+} sink_t;
+
+/*
+ * frames waiting to be decoded & written by a decode thread
+ */
+typedef struct decode_batch {
+	int state;
+	int fds[4];                             // track's files
+	int n_fds;
+	int n_frames;
+	off_t offset[DECODE_BATCH_FRAMES];      // where the frame's audio goes in the file
+	int n_bytes[DECODE_BATCH_FRAMES];       // bytes of PCM audio, 0 == LP frame to decode
+	unsigned char frames[DECODE_BATCH_FRAMES][FRAME_SIZE];
+} decode_batch_t;
+
+typedef struct batch_job {
+	char *image;
+	char *directory;
+	dev_t device;                   // input device - for limiting concurrent I/O
+	pid_t pid;                      // 0 == not started, -1 == finished
+	int failed;
+	int shard_first, shard_last;    // frames extracted by a shard job as -x, -1 == whole image
+	int n_shards;                   // > 0 == join the fragments of the n_shards jobs before this one
+} batch_job_t;
+
+typedef struct watched_file {
+	char *path;
+	off_t size;
+	time_t size_changed;
+	int queued;
+} watched_file_t;
 
 void usage(void);
 void process_file(char *filename);
+void read_job_list(char *filename);
+void add_job(char *image, char *directory);
+batch_job_t *new_job(char *image, char *directory, dev_t device);
+int shards_possible(void);
+int find_decompressor(unsigned char *magic);
+void stitch_shards(batch_job_t *shards, int n_shards);
+void run_batch(void);
+void start_batch_jobs(void);
+int reap_batch_job(int options);
+void write_metrics(void);
+void watch_directories(void);
+int open_input(char *filename);
+void close_input(int fd);
+int read_frame(int fd, unsigned char *buffer, int frame_number);
+void note_consumer_activity(char *activity, struct timespec *start);
+void print_read_statistics(void);
+void note_frame_health(frame_info_t *info, int damaged);
+void write_health_map(char *image);
+void note_output_file(char *filename, dat_hash_t *h);
+void hash_rest_of_input(int fd);
+void write_hash_manifest(char *image);
 void parse_frame(unsigned char *frame, frame_info_t *info);
-int process_frame(unsigned char *frame, frame_info_t *previous_info, frame_info_t *info);
+int process_frame(unsigned char *frame, frame_info_t *info, unsigned char *next_frame, frame_info_t *next_info);
 void parse_subcodepack(unsigned char *frame, int pack_index, frame_info_t *next_info);
 void write_frame_audio(unsigned char *frame, frame_info_t *info);
+int append_frame_to_track(unsigned char *frame, frame_info_t *info, int invalid_frame);
+int split_on_silence(unsigned char *frame, frame_info_t *info, int invalid_frame);
+char *classify_frame(unsigned char *frame, frame_info_t *info);
+int conceal_frame(unsigned char *frame, frame_info_t *info, int damaged, unsigned char *next_frame, frame_info_t *next_info);
+int release_held_frames(void);
 void write_frame_nonlinear_audio(unsigned char *frame, frame_info_t *info);
+int copy_frame_audio(unsigned char *frame, off_t offset, int n);
+void decode_lp_frame(unsigned char *frame, short *buffer);
+void output_frame_audio(unsigned char *frame, frame_info_t *info, int n_bytes);
+int convert_frame_audio(unsigned char *frame, int n_bytes, unsigned char *out);
+int output_frame_bytes(int n_bytes);
+void start_deemphasis(int frequency);
+sink_t *add_sink(char *name, void (*open)(sink_t *, frame_info_t *), void (*audio)(sink_t *, unsigned char *, int, frame_info_t *), void (*close)(sink_t *, int), void *state);
+void add_command_sink(char *command);
+void add_stage(char *specification, int inline_stage);
+void add_meter_sink(void);
+void add_peaks_sink(void);
+void add_spectrogram_sink(double column_seconds);
+void add_fingerprint_sink(void);
+void send_to_sinks(int type, unsigned char *data, int n, frame_info_t *info, int keep);
+void wait_for_sinks(void);
+void start_resampling(int from, int to);
+void flush_resampler(void);
+int track_output_samples(void);
+void write_split_audio(unsigned char *out, int n, off_t offset, int *fds, int n_fds);
+void write_track_output(int k, const void *data, int n);
+void output_suffix(int k, char *suffix);
+void queue_frame_output(unsigned char *frame, int n_bytes);
+void wait_for_decode_threads(void);
 void open_track(frame_info_t *info);
+void create_filename(char *suffix, char *filename);
 void close_track();
+void open_fragment(void);
+void adjust_creation_time(char *filename);
+void close_fragment(int ends_track);
 void write_track_details();
+void flush_invalid_frames(void);
+void start_shard(int fd);
+int shard_position(int image_frame);
+void end_shard(void);
+void stitch(int n_manifests, char *manifests[]);
 void print_frame_time(int frame_number, FILE *fp);
 void warn(char *);
 void die(char *format, ...);
 int dp(int level, char *format, ...);
-char *get_16bit_WAV_header(int samples, int channels, int frequency);
+char *get_WAV_header(int samples, int channels, int frequency, int *length);
 void intcpy(char *b, int i);
 void shortcpy(char *b, int i);
 int unBCD(unsigned int i);
@@ -245,14 +638,92 @@ static int verbosity = 1;
 static FILE *debug_stream;
 static off_t seek_n_frames = 0;
 static double min_track_seconds = 1.0;
-static double max_track_seconds = 360000.0;   /* 100 hours should be longer than any track or tape */
-static double max_audio_seconds_read = 360000.0;
+#define NO_LIMIT_SECONDS 360000.0               /* 100 hours should be longer than any track or tape */
+static double max_track_seconds = NO_LIMIT_SECONDS;
+static double max_audio_seconds_read = NO_LIMIT_SECONDS;
 static int max_consecutive_nonaudio_frames_track = 0;
 static int max_consecutive_nonaudio_frames_tape = 10;
 static char *filename_prefix = "";
+static char tape_name[MAX_FILENAME] = "tape";  /* names the health map & hashes, the image's if several are given */
 static char *myname;
 static char *version = "0.9";
 static int little_endian;
+static int output_format = OUTPUT_S16;
+static char *output_format_names[] = {"s16", "s24", "f32", NULL};
+static int output_bytes_per_sample[] = {2, 3, 4};
+static int pcm_verbatim;                       /* tape's PCM bytes can be written unchanged */
+
+static int classify_frames = 0;
+
+/*
+ * counts of errors along the tape for the health map
+ */
+#define HEALTH_BIN_FRAMES 1000
+
+typedef struct health_bin {
+	int frames;
+	int interpolated;
+	int parity_errors;                      /* subcode packs */
+	int nonaudio;
+	int damaged;                            /* found by classify_frame */
+	int bad;                                /* frames with any error except non-audio */
+} health_bin_t;
+
+static int health_map = 0;
+static health_bin_t *health_bins;
+static int n_health_bins, health_bins_size;
+static int conceal_errors = 0;
+static int conceal_history[4];                 /* last sample of each channel */
+static int conceal_history_valid = 0;          /* 0 at the start of a track */
+static int classify_zero_frames = 0;           /* consecutive all zero frames after audio */
+static int classify_previous_level = 0;        /* peak at end of last frame with audio */
+static int classify_dropout_frames = 0;        /* frames of the current dropout still to come */
+
+/*
+ * look for damage the drive didn't flag with interpolate flags
+ */
+#define CLASSIFY_STUCK_SAMPLES 64
+#define CLASSIFY_STUCK_LEVEL 1024              /* quieter constant samples are just near-silence */
+#define CLASSIFY_CLIPPED_SAMPLES 8
+#define CLASSIFY_MAX_DROPOUT_FRAMES 4
+#define CLASSIFY_DROPOUT_LEVEL 1024
+
+/* frames after next_frame which process_frame hasn't seen yet */
+#define LOOKAHEAD_FRAMES CLASSIFY_MAX_DROPOUT_FRAMES
+static unsigned char *lookahead_frame[LOOKAHEAD_FRAMES];
+static frame_info_t *lookahead_info[LOOKAHEAD_FRAMES];
+static int n_lookahead;
+static int hash_files = 0;
+static dat_hash_t *input_hash = NULL;          /* of the image being read */
+
+/*
+ * files written, in order - those not hashed as they were written are hashed by hash_files_thread
+ */
+typedef struct hashed_file {
+	char *filename;
+	char hash[2*DAT_HASH_LENGTH + 1];
+} hashed_file_t;
+
+static hashed_file_t *hashed_files;
+static int n_hashed_files, hashed_files_size, n_files_hashed;
+static int hash_files_thread_running = 0;
+static pthread_mutex_t hash_files_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hash_files_cond = PTHREAD_COND_INITIALIZER;
+static double silence_seconds = 0;             /* split tracks on silence this long, 0 == don't */
+static double silence_level = -60;             /* dBFS */
+
+/*
+ * silent frames held until it is known whether they are a gap between tracks
+ */
+typedef struct held_frame {
+	unsigned char frame[FRAME_SIZE];
+	frame_info_t info;
+	int invalid_frame;
+} held_frame_t;
+
+static held_frame_t *held_frames;              /* ring buffer */
+static int held_frames_size, held_first, n_held_frames;
+static int releasing_held_frames = 0;          /* -M & -r are checked after all are released */
 
 static int skip_n_frames = 0;
 static double audio_seconds_read = 0;
@@ -269,35 +740,142 @@ static int track_first_frame = -1;
 static time_t track_first_date_time = -1;
 static int track_first_invalid_frame = -1;
 static int track_last_invalid_frame = -1;
+static int track_invalid_concealed = 0;        /* current range of invalid frames was concealed */
 static int track_invalid_frames = 0;
 static frame_info_t track_info;
 
+static int input_is_stream = 0;                /* reads may return part of a frame */
+static pid_t decompressor_pid = -1;
+static off_t input_frames_skipped = 0;         /* decompressor has already done the seek */
+static int input_zero_copy = 0;                /* read only subcodes, kernel copies PCM audio */
+static int input_fd = -1;
+static off_t input_offset = -1;                /* of next frame if input_zero_copy */
+static off_t input_frame_offset = -1;          /* of frame just read if input_zero_copy */
+static off_t input_size;
+
+static int batch_max_jobs = 0;
+static int batch_max_io_streams = 1;
+static batch_job_t *batch_jobs = NULL;
+static int batch_n_jobs = 0;
+static int batch_running = 0;
+static int batch_finished = 0;
+static int batch_failed = 0;
+static char *job_list = NULL;                  /* -J, read once all options are known */
+static char *metrics_filename = NULL;
+
+static int shard_first_frame = -1;
+static int shard_last_frame = -1;
+static int shard_overlap = 1000;
+static int shard_lead_in = 0;                 /* image frames before frame 0 */
+static int shard_warming_up = 0;              /* finding tracks in progress at shard_first_frame */
+static FILE *shard_manifest_fp = NULL;
+static int shard_n_fragments = 0;
+static char fragment_filename[MAX_FILENAME];
+static int fragment_continued;
+static int fragment_first_frame;
+static int fragment_first_nSamples;
+
+static int decode_threads = 1;
+static decode_batch_t *decode_batches = NULL;  /* 2 per thread */
+static decode_batch_t *filling_batch = NULL;
+static pthread_mutex_t decode_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t decode_cond = PTHREAD_COND_INITIALIZER;
+static off_t track_write_offset;               /* where the next frame's audio goes */
+static int track_preallocated = 0;             /* posix_fallocate extended the track */
+static int track_copy_failed = 0;              /* copy_file_range can not write to track */
+static int split_channels = 1;                 /* files each 4-channel track is written to */
+static int track_n_outputs = 1;                /* files the track is written to */
+static int track_output_fd[4];                 /* track_output_fd[0] == track_fd */
+static char track_output_filename[4][MAX_FILENAME];
+static dat_hash_t *track_output_hash[4];       /* with -b, hashed as it is written */
+static int de_emphasis = 0;
+static int track_deemphasis = 0;               /* track's audio is being de-emphasised */
+static int track_filtered = 0;                 /* track's audio goes through filters with state */
+static float deemphasis_b0, deemphasis_b1, deemphasis_a1;
+static float deemphasis_x[4], deemphasis_y[4]; /* previous input & output for each channel */
+static sink_t sinks[MAX_SINKS];
+static int n_sinks = 0;
+static int sinks_started = 0;
+static pthread_mutex_t sink_buffer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int resample_frequency = 0;
+static int track_resampling = 0;
+static int track_output_frequency;
+static int track_output_nSamples;              /* samples written if resampling */
+static int resample_up, resample_down;         /* output is input interpolated by up & decimated by down */
+static int resample_taps;                      /* filter length for each phase, a multiple of 4 */
+static float *resample_filter = NULL;          /* resample_up phases of resample_taps coefficients */
+static float *resample_history[4];             /* input samples for each channel */
+static int resample_length;                    /* samples in resample_history */
+static int resample_position;                  /* newest input sample for next output */
+static int resample_phase;                     /* of next output between input samples */
+
+static char *watch_dirs[64];
+static int n_watch_dirs = 0;
+static double settle_seconds = 60;
+
+static double stall_threshold_seconds = 0.1;
+static struct timespec last_read_end;
+static char *consumer_activity = NULL;      /* slowest thing done between two reads */
+static double consumer_activity_seconds = 0;
+static int read_latency_histogram[N_LATENCY_BUCKETS];
+static int n_reads = 0;                     /* including the read which found the end */
+static int n_frames_read = 0;
+static int n_stalls = 0;
+static double max_read_seconds = 0;
+
 static struct option long_options[] = {
 	{"max_nonaudio_tape", 1, 0, 'a'},
 	{"max_nonaudio_track", 1, 0, 'a'},
 	{"ignore_date_time", 0, 0, 'd'},
+	{"metrics_file", 1, 0, 'e'},
+	{"max_io_streams", 1, 0, 'I'},
+	{"jobs", 1, 0, 'j'},
+	{"job_list", 1, 0, 'J'},
+	{"stall_threshold", 1, 0, 'L'},
 	{"minimum_track_length", 1, 0, 'm'},
 	{"maximum_track_length", 1, 0, 'M'},
 	{"ignore_program_number", 0, 0, 'n'},
 	{"prefix", 1, 0, 'p'},
 	{"quiet", 0, 0, 'q'},
 	{"read_n_seconds", 1, 0, 'r'},
+	{"decode_threads", 1, 0, 'T'},
+	{"split_channels", 1, 0, 'C'},
+	{"de_emphasis", 0, 0, 'E'},
+	{"resample", 1, 0, 'R'},
+	{"pipe", 1, 0, 'P'},
+	{"meter", 0, 0, 'l'},
+	{"peaks", 0, 0, 'w'},
+	{"split_on_silence", 1, 0, 'B'},
+	{"classify_frames", 0, 0, 'c'},
+	{"conceal", 0, 0, 'i'},
+	{"health_map", 0, 0, 'H'},
+	{"hash", 0, 0, 'b'},
+	{"spectrogram", 1, 0, 'k'},
+	{"fingerprint", 0, 0, 'f'},
+	{"stage", 1, 0, 'g'},
+	{"inline_stage", 1, 0, 'G'},
+	{"output_format", 1, 0, 'F'},
 	{"skip_n_frames", 1, 0, 's'},
+	{"settle_seconds", 1, 0, 't'},
 	{"seek_n_frames", 1, 0, 'S'},
+	{"shard", 1, 0, 'x'},
+	{"shard_overlap", 1, 0, 'X'},
+	{"stitch", 0, 0, 'z'},
 	{"verbose", 1, 0, 'v'},
 	{"version", 0, 0, 'V'},
+	{"watch", 1, 0, 'W'},
 	{0, 0, 0, 0}
 };
 
 void
 usage(void) {
-	fprintf(stderr, "Usage: %s [-a frame_count] [-A frame_count] [-d] [-m minimum_track_length]  [-M maximum_track_length] [-n] [-p filename-prefix] [-r tape_seconds] [-s frames] [-S frames] [-q] [-v verbosity-level] input-device-or-file\n", myname);
+	fprintf(stderr, "Usage: %s [-a frame_count] [-A frame_count] [-b] [-B seconds[:level]] [-c] [-C pairs|mono] [-d] [-E] [-e metrics-file] [-F format] [-f] [-g library] [-G library] [-H] [-I streams] [-i] [-j jobs] [-J job-list] [-k seconds] [-l] [-L milliseconds] [-m minimum_track_length]  [-M maximum_track_length] [-n] [-p filename-prefix] [-P command] [-r tape_seconds] [-R frequency] [-s frames] [-S frames] [-t seconds] [-T threads] [-q] [-v verbosity-level] [-w] [-W directory] [-x first:last] [-X frames] [-z] input-device-or-file\n", myname);
     exit(1);
 }
 
 int
 main(int argc, char *argv[]) {
-	int n;
+	int n, i, stitch_manifests = 0;
 
 	myname = strrchr(argv[0], '/');
 	if (myname == NULL)
@@ -307,15 +885,10 @@ main(int argc, char *argv[]) {
 		
 	n = 1;
 	little_endian = (*(char *)&n == 1);
-	if (!little_endian) {
-		int i;
-		for (i = 0; i < sizeof(decode_lp_sample)>>1; i++)
-			decode_lp_sample[i] = (short)((unsigned char)(decode_lp_sample[i] >> 8) | (decode_lp_sample[i] << 8));
-	}
 
 	while (1) {
 		int option_index;
-		int c = getopt_long (argc, argv, "a:A:dm:M:np:qr:s:S:v:V", long_options, &option_index);
+		int c = getopt_long (argc, argv, "a:A:bB:cC:dEe:F:fg:G:HI:ij:J:k:lL:m:M:np:P:qr:R:s:S:t:T:v:VwW:x:X:z", long_options, &option_index);
 		if (c == -1)
 			break;
 		switch (c) {
@@ -330,6 +903,25 @@ main(int argc, char *argv[]) {
 		case 'd':
 			option_segment_on_datetime = 0;
 			break;
+		case 'e':
+			metrics_filename = optarg;
+			break;
+		case 'I':
+			batch_max_io_streams = atoi(optarg);
+			if (batch_max_io_streams < 1)
+				usage();
+			break;
+		case 'j':
+			batch_max_jobs = atoi(optarg);
+			if (batch_max_jobs < 1)
+				usage();
+			break;
+		case 'J':
+			job_list = optarg;
+			break;
+		case 'L':
+			stall_threshold_seconds = atof(optarg)/1000;
+			break;
 		case 'm':
 			min_track_seconds = atof(optarg);
 			break;
@@ -359,88 +951,1086 @@ main(int argc, char *argv[]) {
 			if (seek_n_frames < 0)
 				usage();
 			break;
+		case 't':
+			settle_seconds = atof(optarg);
+			break;
+		case 'C':
+			if (strcmp(optarg, "pairs") == 0)
+				split_channels = 2;
+			else if (strcmp(optarg, "mono") == 0)
+				split_channels = 4;
+			else
+				usage();
+			break;
+		case 'E':
+			de_emphasis = 1;
+			break;
+		case 'R':
+			resample_frequency = atoi(optarg);
+			if (resample_frequency < 8000 || resample_frequency > 96000)
+				usage();
+			break;
+		case 'F':
+			for (output_format = 0; output_format_names[output_format]; output_format++)
+				if (strcmp(optarg, output_format_names[output_format]) == 0)
+					break;
+			if (!output_format_names[output_format])
+				usage();
+			break;
+		case 'T':
+			decode_threads = atoi(optarg);
+			if (decode_threads < 1)
+				usage();
+			break;
 		case 'v':
 			verbosity = atoi(optarg);
   			break;
 		case 'V':
 			printf("%s v%s - see http://www.cse.unsw.edu.au/~andrewt/read_dat/\n",myname, version);
   			break;
+		case 'c':
+			classify_frames = 1;
+			break;
+		case 'i':
+			conceal_errors = 1;
+			break;
+		case 'H':
+			health_map = 1;
+			break;
+		case 'b':
+			hash_files = 1;
+			break;
+		case 'B':
+			silence_seconds = atof(optarg);
+			if (strchr(optarg, ':'))
+				silence_level = atof(strchr(optarg, ':') + 1);
+			if (silence_seconds <= 0 || silence_level >= 0)
+				usage();
+			break;
+		case 'x':
+			if (sscanf(optarg, "%d:%d", &shard_first_frame, &shard_last_frame) != 2 || shard_first_frame < 0 || shard_last_frame <= shard_first_frame)
+				usage();
+			break;
+		case 'X':
+			shard_overlap = atoi(optarg);
+			if (shard_overlap < 0)
+				usage();
+			break;
+		case 'z':
+			stitch_manifests = 1;
+			break;
+		case 'P':
+			add_command_sink(optarg);
+			break;
+		case 'l':
+			add_meter_sink();
+			break;
+		case 'w':
+			add_peaks_sink();
+			break;
+		case 'f':
+			add_fingerprint_sink();
+			break;
+		case 'k':
+			if (atof(optarg) <= 0)
+				usage();
+			add_spectrogram_sink(atof(optarg));
+			break;
+		case 'g':
+		case 'G':
+			add_stage(optarg, c == 'G');
+			break;
+		case 'W':
+			if (n_watch_dirs == sizeof watch_dirs/sizeof watch_dirs[0])
+				die("too many directories to watch");
+			watch_dirs[n_watch_dirs++] = optarg;
+			break;
        	default:
         	usage();
 		}
 	}
+	pcm_verbatim = little_endian && output_format == OUTPUT_S16;
+	if (split_channels > 1 && shard_first_frame >= 0)
+		die("-C can not be used with -x");
+	/* a shard's warm-up doesn't know where the track started so can't know the resampler's phase */
+	if (resample_frequency && shard_first_frame >= 0)
+		die("-R can not be used with -x");
+	if (silence_seconds && shard_first_frame >= 0)
+		die("-B can not be used with -x");
+	/* a shard doesn't know how much audio the track or tape had before it */
+	if (max_track_seconds != NO_LIMIT_SECONDS && shard_first_frame >= 0)
+		die("-M can not be used with -x");
+	if (max_audio_seconds_read != NO_LIMIT_SECONDS && shard_first_frame >= 0)
+		die("-r can not be used with -x");
+	if (conceal_errors && shard_first_frame >= 0)
+		die("-i can not be used with -x");
+	if (health_map && shard_first_frame >= 0)
+		die("-H can not be used with -x");
+	if (hash_files && shard_first_frame >= 0)
+		die("-b can not be used with -x");
+	if (n_sinks && shard_first_frame >= 0)
+		die("-P, -g, -G, -f, -k, -l & -w can not be used with -x");
 
-	if (optind == argc)
+	/* whether batch jobs can be split into shards depends on the other options */
+	if (job_list)
+		read_job_list(job_list);
+	if (n_watch_dirs) {
+		watch_directories();
+		return 0;
+	}
+	if (optind == argc && !batch_n_jobs)
 		usage();
+	if (stitch_manifests) {
+		stitch(argc - optind, argv + optind);
+		write_hash_manifest(NULL);
+		return 0;
+	}
 		
-	for (;optind < argc;optind++) {
-		process_file(argv[optind]);
+	if (batch_max_jobs || batch_n_jobs) {
+		for (;optind < argc;optind++)
+			add_job(argv[optind], NULL);
+		run_batch();
+		return 0;
+	}
+	for (i = optind; i < argc; i++) {
+		/* each image's files are named after it so they don't overwrite each other */
+		if (argc - optind > 1) {
+			char *base = strrchr(argv[i], '/'), *suffix;
+			snprintf(tape_name, sizeof tape_name, "%s", base ? base + 1 : argv[i]);
+			if ((suffix = strchr(tape_name, '.')) != NULL && suffix != tape_name)
+				*suffix = '\0';
+		}
+		process_file(argv[i]);
+	}
+	return 0;
+}
+
+/*
+ * add an input to the batch,
+ * if no directory is given output goes in a directory named after the input
+ *
+ * a long uncompressed image is split into shard jobs, if they can run at once,
+ * and a job joining their fragments
+ */
+void
+add_job(char *image, char *directory) {
+	char default_directory[MAX_FILENAME];
+	unsigned char magic[8];
+	struct stat s;
+	int n_frames = 0, n_shards, i, fd;
+
+	if (!directory) {
+		char *base = strrchr(image, '/'), *suffix;
+		snprintf(default_directory, sizeof default_directory, "%s", base ? base + 1 : image);
+		if ((suffix = strchr(default_directory, '.')) != NULL && suffix != default_directory)
+			*suffix = '\0';
+		directory = default_directory;
+	}
+	if (stat(image, &s) < 0)
+		s.st_dev = 0;
+	else if (S_ISREG(s.st_mode) && batch_max_jobs > 1 && batch_max_io_streams > 1 && shards_possible()) {
+		n_frames = s.st_size/FRAME_SIZE;
+		if ((fd = open(image, O_RDONLY)) < 0 || pread(fd, magic, sizeof magic, 0) != sizeof magic || find_decompressor(magic) >= 0)
+			n_frames = 0;
+		if (fd >= 0)
+			close(fd);
+	}
+	n_shards = n_frames/BATCH_SHARD_FRAMES;
+	if (n_shards < 2) {
+		new_job(image, directory, s.st_dev);
+		return;
+	}
+	for (i = 0; i < n_shards; i++) {
+		batch_job_t *job = new_job(image, directory, s.st_dev);
+		job->shard_first = i*BATCH_SHARD_FRAMES;
+		/* the last shard reads to the end of the image as if it wasn't split */
+		job->shard_last = i == n_shards - 1 ? INT_MAX : (i + 1)*BATCH_SHARD_FRAMES;
+	}
+	new_job(image, directory, s.st_dev)->n_shards = n_shards;
+}
+
+batch_job_t *
+new_job(char *image, char *directory, dev_t device) {
+	batch_job_t *job;
+
+	if ((batch_jobs = realloc(batch_jobs, (batch_n_jobs + 1)*sizeof *batch_jobs)) == NULL)
+		die("out of memory");
+	job = &batch_jobs[batch_n_jobs++];
+	job->image = strdup(image);
+	job->directory = strdup(directory);
+	job->device = device;
+	job->pid = 0;
+	job->failed = 0;
+	job->shard_first = job->shard_last = -1;
+	job->n_shards = 0;
+	return job;
+}
+
+/*
+ * can the options be used with -x
+ */
+int
+shards_possible(void) {
+	return split_channels == 1 && !resample_frequency && !silence_seconds && max_track_seconds == NO_LIMIT_SECONDS &&
+		max_audio_seconds_read == NO_LIMIT_SECONDS && !conceal_errors && !health_map && !hash_files && !n_sinks && !seek_n_frames;
+}
+
+void
+read_job_list(char *filename) {
+	char line[2*MAX_FILENAME], image[MAX_FILENAME], directory[MAX_FILENAME];
+	FILE *fp;
+
+	if ((fp = fopen(filename, "r")) == NULL)
+		die("Can not open job list %s", filename);
+	while (fgets(line, sizeof line, fp) != NULL) {
+		int n = sscanf(line, "%8191s %8191s", image, directory);
+		if (n < 1 || image[0] == '#')
+			continue;
+		add_job(image, n == 2 ? directory : NULL);
+	}
+	fclose(fp);
+}
+
+int
+jobs_running_on_device(dev_t device) {
+	int i, n = 0;
+
+	for (i = 0; i < batch_n_jobs; i++)
+		if (batch_jobs[i].pid > 0 && !batch_jobs[i].n_shards && batch_jobs[i].device == device)
+			n++;
+	return n;
+}
+
+/*
+ * start each job in a child process, skipping jobs whose
+ * disk is already busy with batch_max_io_streams jobs
+ * and jobs joining shards which haven't all finished
+ */
+void
+start_batch_jobs(void) {
+	static char prefix[MAX_FILENAME];
+	int i, j;
+
+	if (batch_max_jobs < 1)
+		batch_max_jobs = 1;
+	for (i = 0; i < batch_n_jobs && batch_running < batch_max_jobs; i++) {
+		batch_job_t *job = &batch_jobs[i];
+		int shards_finished = 1, shards_failed = 0;
+		if (job->pid != 0)
+			continue;
+		for (j = i - job->n_shards; j < i; j++) {
+			shards_finished &= batch_jobs[j].pid == -1;
+			shards_failed |= batch_jobs[j].failed;
+		}
+		if (shards_failed) {
+			dp(0, "Job %d: not joining shards of %s because one failed\n", i, job->image);
+			job->pid = -1;
+			job->failed = 1;
+			batch_failed++;
+			batch_finished++;
+			continue;
+		}
+		if (!shards_finished || (!job->n_shards && jobs_running_on_device(job->device) >= batch_max_io_streams))
+			continue;
+		if ((job->pid = fork()) < 0)
+			die("fork");
+		if (job->pid == 0) {
+			if (mkdir(job->directory, 0755) < 0 && errno != EEXIST)
+				die("Can not create directory %s", job->directory);
+			if (snprintf(prefix, sizeof prefix, "%s/%s", job->directory, filename_prefix) >= sizeof prefix)
+				die("filename too long");
+			filename_prefix = prefix;
+			metrics_filename = NULL;
+			if (job->n_shards) {
+				stitch_shards(job - job->n_shards, job->n_shards);
+			} else {
+				shard_first_frame = job->shard_first;
+				shard_last_frame = job->shard_last;
+				process_file(job->image);
+			}
+			exit(0);
+		}
+		if (job->n_shards)
+			dp(1, "Job %d: joining %d shards of %s in %s/\n", i, job->n_shards, job->image, job->directory);
+		else if (job->shard_first >= 0)
+			dp(1, "Job %d: extracting %s from frame %d into %s/\n", i, job->image, job->shard_first, job->directory);
+		else
+			dp(1, "Job %d: extracting %s into %s/\n", i, job->image, job->directory);
+		batch_running++;
+	}
+	write_metrics();
+}
+
+/*
+ * wait for a job to finish, returns 0 if none has (only possible with WNOHANG)
+ */
+int
+reap_batch_job(int options) {
+	int status, i;
+	pid_t pid = waitpid(-1, &status, options);
+
+	if (pid < 0)
+		die("wait");
+	for (i = 0; i < batch_n_jobs; i++) {
+		batch_job_t *job = &batch_jobs[i];
+		if (pid == 0 || job->pid != pid)
+			continue;
+		job->pid = -1;
+		job->failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+		if (job->failed) {
+			batch_failed++;
+			dp(0, "Job %d: extracting %s failed\n", i, job->image);
+		} else
+			dp(1, "Job %d: %s finished\n", i, job->image);
+		batch_running--;
+		batch_finished++;
+		write_metrics();
+		return 1;
 	}
 	return 0;
 }
 
+/*
+ * as each job finishes start the next one
+ */
+void
+run_batch(void) {
+	while (batch_finished < batch_n_jobs) {
+		start_batch_jobs();
+		reap_batch_job(0);
+	}
+	dp(1, "%d jobs finished, %d failed\n", batch_finished, batch_failed);
+	if (batch_failed)
+		exit(1);
+}
+
+/*
+ * rewrite the metrics file - written to a temporary file and renamed
+ * so readers never see it half-written
+ */
+void
+write_metrics(void) {
+	static int warned = 0;                  /* warn once until a write succeeds */
+	char tmp_filename[MAX_FILENAME];
+	FILE *fp;
+	int i;
+
+	if (!metrics_filename)
+		return;
+	snprintf(tmp_filename, sizeof tmp_filename, "%s.tmp", metrics_filename);
+	/* a full disk or similar mustn't stop the jobs */
+	if ((fp = fopen(tmp_filename, "w")) == NULL) {
+		if (!warned++)
+			dp(0, "Warning: can not create %s\n", tmp_filename);
+		return;
+	}
+	fprintf(fp, "Queue depth: %d\n", batch_n_jobs - batch_running - batch_finished);
+	fprintf(fp, "Running: %d\n", batch_running);
+	fprintf(fp, "Finished: %d\n", batch_finished - batch_failed);
+	fprintf(fp, "Failed: %d\n", batch_failed);
+	for (i = 0; i < batch_n_jobs; i++) {
+		batch_job_t *job = &batch_jobs[i];
+		char *status = job->pid == 0 ? "queued" : job->pid > 0 ? "running" : job->failed ? "failed" : "finished";
+		if (job->n_shards)
+			fprintf(fp, "Job %d: %s %s %s/ joining %d shards\n", i, status, job->image, job->directory, job->n_shards);
+		else if (job->shard_first >= 0)
+			fprintf(fp, "Job %d: %s %s %s/ shard from frame %d\n", i, status, job->image, job->directory, job->shard_first);
+		else
+			fprintf(fp, "Job %d: %s %s %s/\n", i, status, job->image, job->directory);
+	}
+	if (fclose(fp) != 0 || rename(tmp_filename, metrics_filename) != 0) {
+		if (!warned++)
+			dp(0, "Warning: can not write %s\n", metrics_filename);
+	} else
+		warned = 0;
+}
+
+/*
+ * is name in directory the -e metrics file
+ */
+int
+is_metrics_file(char *directory, char *name) {
+	char metrics_directory[MAX_FILENAME], a[PATH_MAX], b[PATH_MAX];
+	char *slash, *base;
+
+	if (!metrics_filename)
+		return 0;
+	if ((slash = strrchr(metrics_filename, '/')) == NULL)
+		strcpy(metrics_directory, ".");
+	else
+		snprintf(metrics_directory, sizeof metrics_directory, "%.*s", slash == metrics_filename ? 1 : (int)(slash - metrics_filename), metrics_filename);
+	base = slash ? slash + 1 : metrics_filename;
+	return strcmp(name, base) == 0 && realpath(directory, a) && realpath(metrics_directory, b) && strcmp(a, b) == 0;
+}
+
+static watched_file_t *watched_files = NULL;
+static int n_watched_files = 0;
+
+watched_file_t *
+find_watched_file(char *path) {
+	watched_file_t *f;
+	int i;
+
+	for (i = 0; i < n_watched_files; i++)
+		if (strcmp(watched_files[i].path, path) == 0)
+			return &watched_files[i];
+	if ((watched_files = realloc(watched_files, (n_watched_files + 1)*sizeof *watched_files)) == NULL)
+		die("out of memory");
+	f = &watched_files[n_watched_files++];
+	f->path = strdup(path);
+	f->size = -1;
+	f->size_changed = time(NULL);
+	f->queued = 0;
+	return f;
+}
+
+/*
+ * note a file appearing or changing in a watched directory
+ */
+void
+watch_file(char *directory, char *name, int at_startup) {
+	char path[MAX_FILENAME];
+	int length = strlen(name);
+	watched_file_t *f;
+
+	if (name[0] == '.' || (length > 4 && strcmp(name + length - 4, ".tmp") == 0) || is_metrics_file(directory, name))
+		return;
+	if (length > 5 && strcmp(name + length - 5, ".done") == 0) {
+		struct stat s;
+		snprintf(path, sizeof path, "%s/%.*s", directory, length - 5, name);
+		/* a marker written before its image can't say the image is complete */
+		if (stat(path, &s) < 0 || !S_ISREG(s.st_mode)) {
+			dp(2, "Ignoring %s/%s - %s doesn't exist yet\n", directory, name, path);
+			return;
+		}
+		f = find_watched_file(path);
+		f->size_changed = 0;           // image is complete
+		return;
+	}
+	snprintf(path, sizeof path, "%s/%s", directory, name);
+	f = find_watched_file(path);
+	if (at_startup) {
+		struct stat s;
+		char *base = strdup(name), *suffix;
+		if ((suffix = strchr(base, '.')) != NULL && suffix != base)
+			*suffix = '\0';
+		if (stat(base, &s) == 0 && S_ISDIR(s.st_mode)) {
+			dp(2, "Ignoring %s - %s/ exists\n", path, base);
+			f->queued = 1;
+		}
+		free(base);
+	}
+}
+
+/*
+ * queue watched files that are complete
+ */
+void
+queue_complete_files(void) {
+	time_t now = time(NULL);
+	int i;
+
+	for (i = 0; i < n_watched_files; i++) {
+		watched_file_t *f = &watched_files[i];
+		struct stat s;
+		if (f->queued || stat(f->path, &s) < 0 || !S_ISREG(s.st_mode))
+			continue;
+		if (s.st_size != f->size && f->size_changed != 0) {
+			f->size = s.st_size;
+			f->size_changed = now;
+		}
+		if (f->size_changed != 0 && difftime(now, f->size_changed) < settle_seconds)
+			continue;
+		dp(1, "Queueing %s\n", f->path);
+		add_job(f->path, NULL);
+		f->queued = 1;
+		write_metrics();
+	}
+}
+
+/*
+ * daemon mode - watch directories with inotify and extract images
+ * as they are completed, jobs are run as in batch mode
+ */
+void
+watch_directories(void) {
+	char events[64*(sizeof(struct inotify_event) + NAME_MAX + 1)];
+	int inotify_fd, wd[sizeof watch_dirs/sizeof watch_dirs[0]], i;
+
+	if ((inotify_fd = inotify_init()) < 0)
+		die("inotify_init");
+	for (i = 0; i < n_watch_dirs; i++) {
+		DIR *dir;
+		struct dirent *d;
+		if ((wd[i] = inotify_add_watch(inotify_fd, watch_dirs[i], IN_CLOSE_WRITE|IN_MOVED_TO|IN_CREATE|IN_MODIFY)) < 0)
+			die("Can not watch %s", watch_dirs[i]);
+		if ((dir = opendir(watch_dirs[i])) == NULL)
+			die("Can not read directory %s", watch_dirs[i]);
+		while ((d = readdir(dir)) != NULL)
+			watch_file(watch_dirs[i], d->d_name, 1);
+		closedir(dir);
+		dp(1, "Watching %s\n", watch_dirs[i]);
+	}
+	write_metrics();
+	for (;;) {
+		struct pollfd p = {inotify_fd, POLLIN, 0};
+		if (poll(&p, 1, 1000) > 0) {
+			int n = read(inotify_fd, events, sizeof events), j;
+			for (j = 0; j < n; ) {
+				struct inotify_event *e = (struct inotify_event *)(events + j);
+				for (i = 0; i < n_watch_dirs; i++)
+					if (e->wd == wd[i] && e->len)
+						watch_file(watch_dirs[i], e->name, 0);
+				j += sizeof(struct inotify_event) + e->len;
+			}
+		}
+		queue_complete_files();
+		while (batch_running && reap_batch_job(WNOHANG))
+			;
+		start_batch_jobs();
+	}
+}
+
 void
 process_file(char *filename) {
-	int fd, n;
-	unsigned char buffer[FRAME_SIZE], next_buffer[FRAME_SIZE];
-	frame_info_t info, next_info;
-	int frame_number = 0;
+	int fd, n, i;
+	/* frames read but not yet processed - classify_frame looks several frames ahead */
+	unsigned char buffer[LOOKAHEAD_FRAMES + 1][FRAME_SIZE];
+	frame_info_t info[LOOKAHEAD_FRAMES + 1];
+	int first = 0, n_buffered = 0, lookahead = classify_frames ? LOOKAHEAD_FRAMES : 1, at_end = 0;
+	int frame_number = 0, frames_read = 0;
 	
-	if ((fd = open(filename, O_RDONLY)) < 0)
-		die("Can not open input");
-	if (seek_n_frames) {
+	skip_n_frames = 0;
+	audio_seconds_read = 0;
+	consecutive_nonaudio_frames = 0;
+	classify_zero_frames = 0;
+	classify_previous_level = 0;
+	conceal_history_valid = 0;
+	fd = open_input(filename);
+	/* a tape can't be read again to check its hash, a compressed image is hashed as stored */
+	if (hash_files && decompressor_pid != -1)
+		note_output_file(filename, NULL);
+	else if (hash_files && input_is_stream && !seek_n_frames)
+		input_hash = dat_hash_new();
+	else if (hash_files && input_is_stream)
+		dp(1, "Not hashing %s because frames were skipped\n", filename);
+	if (shard_first_frame >= 0)
+		start_shard(fd);
+	if (seek_n_frames && input_frames_skipped == seek_n_frames) {
+		dp(2, "Seek done by decompressor\n");
+		frame_number = seek_n_frames;
+	} else if (seek_n_frames) {
 		dp(1, "Seeking %d frames\n", (int)seek_n_frames);
 		off_t seek_bytes = seek_n_frames*FRAME_SIZE;
 		off_t seek_result = lseek(fd, seek_bytes, SEEK_SET);
 		if (seek_result == seek_bytes) {
 			dp(2, "Seek succeeded\n");
-			frame_number = seek_n_frames;
+			frame_number = seek_n_frames - shard_lead_in;
 		} else if (seek_result <= 0) {
 			dp(1, "Seeking not possible reading %d frames\n", (int)seek_n_frames);
 			for (;frame_number < seek_n_frames;frame_number++) {
-				if (read(fd, buffer, FRAME_SIZE) != FRAME_SIZE)
+				if (read_frame(fd, buffer[0], frame_number) != FRAME_SIZE)
 					die("read failed");
 			}
 		} else
 			die("can not recover from partial seek"); 
 	}	
-	if ((n = read(fd, buffer, FRAME_SIZE)) != FRAME_SIZE)
-		die("read of first frame failed");
-	info.frame_number = frame_number++;
-	parse_frame(buffer, &info);
-	for (;;frame_number++) {
-		if ((n = read(fd, next_buffer, FRAME_SIZE)) != FRAME_SIZE) {
-			switch (n) {
-			case -1:
-				close_track();
-				die("read failed");
-			case 0:
-				process_frame(buffer, &info, &info);// hack to handle last frame
-				close_track();
-				exit(0);
-			default:
-				close_track();
-				die("read returned only a partial frame (%d bytes) - %d frames previously read", n, frame_number);
+	for (;;) {
+		/* keep lookahead frames after the one being processed */
+		while (!at_end && n_buffered <= lookahead) {
+			int k = (first + n_buffered) % (LOOKAHEAD_FRAMES + 1);
+			if ((n = read_frame(fd, buffer[k], frame_number)) != FRAME_SIZE) {
+				switch (n) {
+				case -1:
+					close_track();
+					die("read failed");
+				case 0:
+					if (!frames_read)
+						die("read of first frame failed");
+					at_end = 1;
+					break;
+				default:
+					if (!frames_read)
+						die("read of first frame failed");
+					close_track();
+					die("read returned only a partial frame (%d bytes) - %d frames previously read", n, frame_number);
+				}
+				break;
 			}
-			break;
-		}
-		next_info.frame_number = frame_number;
-		parse_frame(next_buffer, &next_info);
-		if (next_info.hex_pno == 0xbb && frame_number < 4) {
-			// hack so we number frames from first non lead in frame
-			frame_number = -1;
-			next_info.frame_number = -1;
+			info[k].frame_number = frame_number;
+			info[k].offset = input_frame_offset;
+			parse_frame(buffer[k], &info[k]);
+			if (info[k].hex_pno == 0xbb && frame_number < 4 && frames_read) {
+				// hack so we number frames from first non lead in frame
+				frame_number = -1;
+				info[k].frame_number = -1;
+			}
+			frame_number++;
+			frames_read++;
+			n_buffered++;
 		}
-		if (!process_frame(buffer, &info, &next_info))
+		if (at_end && n_buffered == 0) {
+			close_track();
+			end_shard();
+			close_input(fd);
+			print_read_statistics();
+			write_health_map(filename);
+			write_hash_manifest(filename);
 			return;
-		memcpy(buffer, next_buffer, sizeof buffer);
-		info = next_info;
+		}
+		{
+			int k = first, next = n_buffered > 1 ? (first + 1) % (LOOKAHEAD_FRAMES + 1) : first;    // last frame is its own next
+			n_lookahead = 0;
+			for (i = 1; i < n_buffered; i++) {
+				lookahead_frame[n_lookahead] = buffer[(first + i) % (LOOKAHEAD_FRAMES + 1)];
+				lookahead_info[n_lookahead++] = &info[(first + i) % (LOOKAHEAD_FRAMES + 1)];
+			}
+			if (!shard_position(info[k].frame_number + shard_lead_in) || !process_frame(buffer[k], &info[k], buffer[next], &info[next])) {
+				if (at_end && n_buffered == 1)
+					close_track();
+				end_shard();
+				if (input_hash)
+					hash_rest_of_input(fd);
+				close_input(fd);
+				print_read_statistics();
+				write_health_map(filename);
+				write_hash_manifest(filename);
+				return;
+			}
+			first = (first + 1) % (LOOKAHEAD_FRAMES + 1);
+			n_buffered--;
+		}
 	}
 }
 
-
 /*
- * process one frame (5822 bytes) of data,
+ * magic numbers of compressed tape images and the programs which decompress them
+ */
+static struct {
+	int length;
+	char *magic;
+	char *program;
+	int seekable;                   // accepts -S frames
+	int parallel;                   // accepts -j threads
+} decompressors[] = {
+	{4, "\x28\xb5\x2f\xfd", "zstd", 0, 0},
+	{6, "\xfd\x37\x7a\x58\x5a\x00", "xz", 0, 0},
+	{2, "\x1f\x8b", "gzip", 0, 0},
+	{3, "BZh", "bzip2", 0, 0},
+	{8, "DATARCH1", "dat_archive", 1, 1},
+	{0, NULL, NULL, 0, 0}
+};
+
+#define MAX_DECOMPRESS_THREADS 64       /* dat_archive's limit */
+
+/*
+ * index in decompressors of the program for an image starting with magic, -1 if it isn't compressed
+ */
+int
+find_decompressor(unsigned char *magic) {
+	int i;
+
+	for (i = 0; decompressors[i].program; i++)
+		if (memcmp(magic, decompressors[i].magic, decompressors[i].length) == 0)
+			return i;
+	return -1;
+}
+
+/*
+ * open a tape device or image
+ *
+ * compressed images are decompressed by a child process writing into a pipe
+ * so decompression runs on another core while we decode
+ */
+int
+open_input(char *filename) {
+	unsigned char magic[8];
+	struct stat s;
+	int fd, i, pipe_fds[2];
+
+	input_frames_skipped = 0;
+	input_zero_copy = 0;
+	input_frame_offset = -1;
+	if ((fd = open(filename, O_RDONLY)) < 0)
+		die("Can not open input");
+	if (fstat(fd, &s) < 0)
+		die("Can not stat input");
+	input_is_stream = !S_ISCHR(s.st_mode);
+	if (!S_ISREG(s.st_mode) || pread(fd, magic, sizeof magic, 0) != sizeof magic)
+		return fd;
+	if ((i = find_decompressor(magic)) < 0) {
+		/*
+		 * PCM audio in an image file need never be read into our buffers,
+		 * it can be copied straight into the WAV file
+		 */
+		if (decode_threads == 1 && pcm_verbatim && !silence_seconds && !classify_frames && !conceal_errors && !hash_files) {
+			input_zero_copy = 1;
+			input_fd = fd;
+			input_offset = -1;
+			input_size = s.st_size;
+			dp(2, "Copying PCM audio from %s with copy_file_range\n", filename);
+		}
+		return fd;
+	}
+	dp(1, "Decompressing %s with %s\n", filename, decompressors[i].program);
+	if (pipe(pipe_fds) < 0)
+		die("pipe");
+#ifdef F_SETPIPE_SZ
+	fcntl(pipe_fds[0], F_SETPIPE_SZ, 1024*1024);
+#endif
+	if ((decompressor_pid = fork()) < 0)
+		die("fork");
+	if (decompressor_pid == 0) {
+		char seek_arg[32], threads_arg[32], *args[8];
+		long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+		int n_args = 0;
+		dup2(fd, 0);
+		dup2(pipe_fds[1], 1);
+		close(pipe_fds[0]);
+		close(pipe_fds[1]);
+		close(fd);
+		args[n_args++] = decompressors[i].program;
+		args[n_args++] = "-dc";
+		if (decompressors[i].seekable && seek_n_frames) {
+			snprintf(seek_arg, sizeof seek_arg, "%lld", (long long)seek_n_frames);
+			args[n_args++] = "-S";
+			args[n_args++] = seek_arg;
+		}
+		/* chunks are decompressed in parallel, one thread per processor */
+		if (decompressors[i].parallel && n_threads > 1) {
+			snprintf(threads_arg, sizeof threads_arg, "%ld", n_threads < MAX_DECOMPRESS_THREADS ? n_threads : MAX_DECOMPRESS_THREADS);
+			args[n_args++] = "-j";
+			args[n_args++] = threads_arg;
+		}
+		args[n_args] = NULL;
+		execvp(decompressors[i].program, args);
+		die("Can not run %s", decompressors[i].program);
+	}
+	if (decompressors[i].seekable)
+		input_frames_skipped = seek_n_frames;
+	close(pipe_fds[1]);
+	close(fd);
+	return pipe_fds[0];
+}
+
+void
+close_input(int fd) {
+	int status;
+
+	close(fd);
+	input_zero_copy = 0;
+	input_fd = -1;
+	if (decompressor_pid == -1)
+		return;
+	if (waitpid(decompressor_pid, &status, 0) == decompressor_pid && WIFEXITED(status) && WEXITSTATUS(status) != 0)
+		die("decompression of input failed");
+	decompressor_pid = -1;
+}
+
+double
+elapsed_seconds(struct timespec *start, struct timespec *end) {
+	return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec)/1e9;
+}
+
+/*
+ * read one frame, timing the read
+ *
+ * If the drive has to wait for us it stops and repositions (shoe-shining)
+ * which shows up as a slow read - so reads longer than stall_threshold_seconds
+ * are reported along with the slowest thing we did since the previous read.
+ */
+int
+read_frame(int fd, unsigned char *buffer, int frame_number) {
+	struct timespec start, end;
+	double seconds, gap = 0;
+	int n, bucket;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (input_zero_copy) {
+		/* only the subcodes are needed to parse the frame, the audio is fetched when written */
+		if (input_offset < 0)
+			input_offset = lseek(fd, 0, SEEK_CUR);
+		n = input_size - input_offset < FRAME_SIZE ? input_size - input_offset : FRAME_SIZE;
+		if (n < 0)
+			n = 0;
+		if (n == FRAME_SIZE) {
+			if (pread(fd, buffer + DATA_SIZE, FRAME_SIZE - DATA_SIZE, input_offset + DATA_SIZE) != FRAME_SIZE - DATA_SIZE)
+				n = -1;
+			input_frame_offset = input_offset;
+			input_offset += FRAME_SIZE;
+		}
+	} else
+		n = read(fd, buffer, FRAME_SIZE);
+	/*
+	 * pipes (and in principle files) can return part of a frame,
+	 * tape devices return a whole record per read - with zero copy the
+	 * short count is the end of the image, the fd's offset is never moved
+	 */
+	if (input_is_stream && !input_zero_copy) {
+		int m;
+		while (n > 0 && n < FRAME_SIZE && (m = read(fd, buffer + n, FRAME_SIZE - n)) > 0)
+			n += m;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	seconds = elapsed_seconds(&start, &end);
+	if (n_reads++)
+		gap = elapsed_seconds(&last_read_end, &start);
+	for (bucket = 0; bucket < N_LATENCY_BUCKETS - 1 && (1 << bucket) <= seconds*1e6; bucket++)
+		;
+	read_latency_histogram[bucket]++;
+	if (seconds > max_read_seconds)
+		max_read_seconds = seconds;
+	if (seconds >= stall_threshold_seconds || gap >= stall_threshold_seconds) {
+		n_stalls++;
+		if (consumer_activity && consumer_activity_seconds >= gap/2)
+			dp(1, "Frame %d read stalled %.1fms after %.1fms away from drive - %s took %.1fms\n", frame_number, seconds*1000, gap*1000, consumer_activity, consumer_activity_seconds*1000);
+		else
+			dp(1, "Frame %d read stalled %.1fms after %.1fms away from drive\n", frame_number, seconds*1000, gap*1000);
+	}
+	consumer_activity = NULL;
+	consumer_activity_seconds = 0;
+	last_read_end = end;
+	if (n == FRAME_SIZE)
+		n_frames_read++;
+	if (input_hash && n > 0)
+		dat_hash_update(input_hash, buffer, n);
+	return n;
+}
+
+/*
+ * record how long we spent doing something other than reading the input
+ * so a subsequent stall can be attributed to it
+ */
+void
+note_consumer_activity(char *activity, struct timespec *start) {
+	struct timespec end;
+	double seconds;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	seconds = elapsed_seconds(start, &end);
+	if (seconds > consumer_activity_seconds) {
+		consumer_activity = activity;
+		consumer_activity_seconds = seconds;
+	}
+}
+
+void
+print_read_statistics(void) {
+	int i;
+
+	dp(1, "%d frames read, %d stalls longer than %.1fms, slowest read %.1fms\n", n_frames_read, n_stalls, stall_threshold_seconds*1000, max_read_seconds*1000);
+	for (i = 0; i < N_LATENCY_BUCKETS; i++) {
+		if (!read_latency_histogram[i])
+			continue;
+		if (i == N_LATENCY_BUCKETS - 1)
+			dp(2, "Read latency >= %dus: %d\n", 1 << (i - 1), read_latency_histogram[i]);
+		else
+			dp(2, "Read latency < %dus: %d\n", 1 << i, read_latency_histogram[i]);
+		read_latency_histogram[i] = 0;
+	}
+	n_reads = 0;
+	n_frames_read = 0;
+	n_stalls = 0;
+	max_read_seconds = 0;
+}
+
+/*
+ * add a frame to the health map, damaged is set when classify_frame
+ * finds the frame damaged after it has been added
+ */
+void
+note_frame_health(frame_info_t *info, int damaged) {
+	health_bin_t *b;
+	int i = info->frame_number/HEALTH_BIN_FRAMES;
+
+	if (info->frame_number < 0)
+		return;
+	if (i >= health_bins_size) {
+		int old_size = health_bins_size;
+		health_bins_size = 2*i + 64;
+		if ((health_bins = realloc(health_bins, health_bins_size*sizeof *health_bins)) == NULL)
+			die("out of memory");
+		memset(health_bins + old_size, 0, (health_bins_size - old_size)*sizeof *health_bins);
+	}
+	if (i >= n_health_bins)
+		n_health_bins = i + 1;
+	b = &health_bins[i];
+	if (damaged) {
+		b->damaged++;
+		if (!info->parity_errors)
+			b->bad++;
+		return;
+	}
+	b->frames++;
+	b->parity_errors += info->parity_errors;
+	if (info->invalid == 2)
+		b->nonaudio++;
+	else if (info->interpolate_flags & (0x40|0x20))
+		b->interpolated++;
+	if (info->parity_errors || (info->invalid != 2 && (info->interpolate_flags & (0x40|0x20))))
+		b->bad++;
+}
+
+/*
+ * write the health map of the image just read
+ */
+void
+write_health_map(char *image) {
+	char filename[MAX_FILENAME];
+	health_bin_t total = {0};
+	double worst = 100;
+	FILE *fp;
+	int i;
+
+	if (!health_map)
+		return;
+	for (i = 0; i < n_health_bins; i++) {
+		health_bin_t *b = &health_bins[i];
+		total.frames += b->frames;
+		total.interpolated += b->interpolated;
+		total.parity_errors += b->parity_errors;
+		total.nonaudio += b->nonaudio;
+		total.damaged += b->damaged;
+		total.bad += b->bad;
+		if (b->frames && 100.0*(b->frames - b->bad)/b->frames < worst)
+			worst = 100.0*(b->frames - b->bad)/b->frames;
+	}
+	if (snprintf(filename, sizeof filename, "%s%s.health", filename_prefix, tape_name) >= sizeof filename)
+		die("filename too long");
+	if ((fp = fopen(filename, "w")) == NULL)
+		die("Can not open %s", filename);
+	fprintf(fp, "# read_dat health map: bin first_frame frames interpolated parity_errors nonaudio damaged bad\n");
+	fprintf(fp, "type read_dat\n");
+	fprintf(fp, "image %s\n", image);
+	fprintf(fp, "bin_frames %d\n", HEALTH_BIN_FRAMES);
+	fprintf(fp, "summary %d %d %d %d %d %d score %.3f worst %.3f\n", total.frames, total.interpolated, total.parity_errors,
+		total.nonaudio, total.damaged, total.bad, total.frames ? 100.0*(total.frames - total.bad)/total.frames : 100, worst);
+	for (i = 0; i < n_health_bins; i++) {
+		health_bin_t *b = &health_bins[i];
+		fprintf(fp, "bin %d %d %d %d %d %d %d\n", i*HEALTH_BIN_FRAMES, b->frames, b->interpolated, b->parity_errors, b->nonaudio, b->damaged, b->bad);
+	}
+	if (fclose(fp) != 0)
+		die("Can not write %s", filename);
+	dp(1, "Creating %s\n", filename);
+	note_output_file(filename, NULL);
+	n_health_bins = 0;
+	if (health_bins)
+		memset(health_bins, 0, health_bins_size*sizeof *health_bins);
+}
+
+void *
+hash_files_thread(void *arg) {
+	char hash[2*DAT_HASH_LENGTH + 1], *filename;
+	int hashed;
+
+	for (;;) {
+		pthread_mutex_lock(&hash_files_mutex);
+		while (n_files_hashed == n_hashed_files)
+			pthread_cond_wait(&hash_files_cond, &hash_files_mutex);
+		filename = hashed_files[n_files_hashed].filename;
+		hashed = hashed_files[n_files_hashed].hash[0] != '\0';
+		pthread_mutex_unlock(&hash_files_mutex);
+		if (!hashed && dat_hash_file(filename, hash) < 0)
+			die("Can not hash %s", filename);
+		pthread_mutex_lock(&hash_files_mutex);
+		if (!hashed)
+			strcpy(hashed_files[n_files_hashed].hash, hash);
+		n_files_hashed++;
+		pthread_cond_broadcast(&hash_files_cond);
+		pthread_mutex_unlock(&hash_files_mutex);
+	}
+	return NULL;
+}
+
+/*
+ * a file has been written & closed under its final name - h is its hasher if it was
+ * hashed as it was written (tracks), otherwise it is hashed on another thread
+ * from the page cache (the other files are small)
+ */
+void
+note_output_file(char *filename, dat_hash_t *h) {
+	char hash[2*DAT_HASH_LENGTH + 1] = "";
+	pthread_t thread;
+
+	if (!hash_files)
+		return;
+	if (h)
+		dat_hash_final(h, hash);
+	pthread_mutex_lock(&hash_files_mutex);
+	if (!hash_files_thread_running) {
+		if (pthread_create(&thread, NULL, hash_files_thread, NULL) != 0 || pthread_detach(thread) != 0)
+			die("can not create thread");
+		hash_files_thread_running = 1;
+	}
+	if (n_hashed_files == hashed_files_size) {
+		hashed_files_size = 2*hashed_files_size + 64;
+		if ((hashed_files = realloc(hashed_files, hashed_files_size*sizeof *hashed_files)) == NULL)
+			die("out of memory");
+	}
+	if ((hashed_files[n_hashed_files].filename = strdup(filename)) == NULL)
+		die("out of memory");
+	strcpy(hashed_files[n_hashed_files].hash, hash);
+	n_hashed_files++;
+	pthread_cond_broadcast(&hash_files_cond);
+	pthread_mutex_unlock(&hash_files_mutex);
+}
+
+/*
+ * read the rest of an image whose audio ended early so its hash covers all of it
+ */
+void
+hash_rest_of_input(int fd) {
+	unsigned char buffer[65536];
+	char hash[2*DAT_HASH_LENGTH + 1];
+	ssize_t n;
+
+	while ((n = read(fd, buffer, sizeof buffer)) > 0)
+		dat_hash_update(input_hash, buffer, n);
+	if (n < 0) {
+		dp(1, "Not hashing input because the end of it can not be read\n");
+		dat_hash_final(input_hash, hash);
+		input_hash = NULL;
+	}
+}
+
+/*
+ * write the hashes of the image just read & the files written from it
+ */
+void
+write_hash_manifest(char *image) {
+	char filename[MAX_FILENAME], hash[2*DAT_HASH_LENGTH + 1];
+	FILE *fp;
+	int i;
+
+	if (!hash_files)
+		return;
+	if (snprintf(filename, sizeof filename, "%s%s.b3sum", filename_prefix, tape_name) >= sizeof filename)
+		die("filename too long");
+	if ((fp = fopen(filename, "w")) == NULL)
+		die("Can not open %s", filename);
+	if (input_hash) {
+		dat_hash_final(input_hash, hash);
+		input_hash = NULL;
+		if (image)
+			fprintf(fp, "%s  %s\n", hash, image);
+	}
+	pthread_mutex_lock(&hash_files_mutex);
+	while (n_files_hashed < n_hashed_files)
+		pthread_cond_wait(&hash_files_cond, &hash_files_mutex);
+	for (i = 0; i < n_hashed_files; i++) {
+		fprintf(fp, "%s  %s\n", hashed_files[i].hash, hashed_files[i].filename);
+		free(hashed_files[i].filename);
+	}
+	n_hashed_files = n_files_hashed = 0;
+	pthread_mutex_unlock(&hash_files_mutex);
+	if (fclose(fp) != 0)
+		die("Can not write %s", filename);
+	dp(1, "Creating %s\n", filename);
+}
+
+
+/*
+ * process one frame (5822 bytes) of data,
  * return 0 if no more input should be read
  */
 void
@@ -476,6 +2066,7 @@ parse_frame(unsigned char *frame, frame_info_t *info) {
 	info->program_number = -1;
 	info->hex_pno = hex_pno;
 	info->interpolate_flags = interpolate_flags;
+	info->parity_errors = 0;
 	
 	if (dataid) {
 		dp(5, "Frame %d non audio dataid(%d)\n", info->frame_number, dataid);
@@ -538,7 +2129,7 @@ char *
 frame_info_inconsistent(frame_info_t *i1, frame_info_t *i2) {
 	if (option_segment_on_datetime && i1->date_time != -1 && i2->date_time != -1  && i1->date_time != i2->date_time  && i1->date_time != i2->date_time + 1 && i1->date_time != i2->date_time - 1)
 		return "jump in subcode date/time";
-	else if (i1->nChannels != i1->nChannels)
+	else if (i1->nChannels != i2->nChannels)
 		return "change in number of channels";
 	else if (i1->sampling_frequency != i2->sampling_frequency)
 		return "change in sampling frequency";
@@ -561,8 +2152,11 @@ frame_info_inconsistent(frame_info_t *i1, frame_info_t *i2) {
  * or the track closed and the frame skipped
  */
 int
-process_frame(unsigned char *frame, frame_info_t *info, frame_info_t *next_info) {
-	int invalid_frame = info->invalid != 0;
+process_frame(unsigned char *frame, frame_info_t *info, unsigned char *next_frame, frame_info_t *next_info) {
+	int invalid_frame = info->invalid != 0;         /* 2 == invalid & concealed */
+	int damaged = 0;
+	if (health_map)
+		note_frame_health(info, 0);
 	if (info->hex_pno == 0x0ee) {
 		dp(2, "Frame %d end of tape reached (0x0EE pno found)\n", info->frame_number);
 		close_track();
@@ -603,6 +2197,16 @@ process_frame(unsigned char *frame, frame_info_t *info, frame_info_t *next_info)
 	if (info->interpolate_flags & (0x40|0x20)) {
 		dp(2, "Frame %d warning interpolate flags set indicating audio contains errors\n", info->frame_number);
 		invalid_frame = 1;
+		damaged = 1;
+	} else if (classify_frames && info->invalid != 2) {
+		char *damage = classify_frame(frame, info);
+		if (damage) {
+			dp(2, "Frame %d warning %s\n", info->frame_number, damage);
+			invalid_frame = 1;
+			damaged = 1;
+			if (health_map)
+				note_frame_health(info, 1);
+		}
 	}
 	if (track_fd != -1) {
 		char *reason = frame_info_inconsistent(&track_info, info);
@@ -627,7 +2231,22 @@ process_frame(unsigned char *frame, frame_info_t *info, frame_info_t *next_info)
 		skip_n_frames--;
 		return 1;
 	}
-	
+	if (conceal_errors && info->invalid != 2 && conceal_frame(frame, info, damaged, next_frame, next_info))
+		invalid_frame = 2;
+	if (silence_seconds)
+		return split_on_silence(frame, info, invalid_frame);
+	return append_frame_to_track(frame, info, invalid_frame);
+}
+
+/*
+ * add a frame's audio to the current track, starting a track if needed
+ * returns 0 if extraction should stop
+ */
+int
+append_frame_to_track(unsigned char *frame, frame_info_t *info, int invalid_frame) {
+	/* held frames released when a track closed may have reached the -r limit */
+	if (track_fd == -1 && audio_seconds_read >= max_audio_seconds_read)
+		return 0;
 	if (track_fd == -1)
 		open_track(info);
 	if (track_first_frame == -1)
@@ -641,24 +2260,21 @@ process_frame(unsigned char *frame, frame_info_t *info, frame_info_t *next_info)
 	if (info->program_number != -1 && track_info.program_number == -1)
 		track_info.program_number = info->program_number;	
 	if (invalid_frame) {
+		/* concealed & unconcealed frames are listed in separate ranges */
+		if (track_first_invalid_frame != -1 && track_invalid_concealed != (invalid_frame == 2))
+			flush_invalid_frames();
 		track_invalid_frames++;
-		if (track_first_invalid_frame == -1)
+		if (track_first_invalid_frame == -1) {
 			track_first_invalid_frame = info->frame_number;
+			track_invalid_concealed = invalid_frame == 2;
+		}
 		track_last_invalid_frame = info->frame_number;
-	} else if (track_first_invalid_frame != -1) {
-		if (track_first_invalid_frame == track_last_invalid_frame)
-			fprintf(track_invalid_frames_fp, "Frame %d (", track_first_invalid_frame);
-		else
-			fprintf(track_invalid_frames_fp, "Frames %d-%d (", track_first_invalid_frame, track_last_invalid_frame);
-		print_frame_time(track_first_invalid_frame, track_invalid_frames_fp);
-		fprintf(track_invalid_frames_fp, "-");
-		print_frame_time(track_last_invalid_frame+1, track_invalid_frames_fp);
-		fprintf(track_invalid_frames_fp, ") invalid\n");
-		track_first_invalid_frame = -1;
-		track_last_invalid_frame = -1;
-	}
+	} else
+		flush_invalid_frames();
 
 	write_frame_audio(frame, info);
+	if (releasing_held_frames)
+		return 1;
 	if (audio_seconds_read >= max_audio_seconds_read) {
 		dp(1, "Closing track %d and exiting, limit of %.2f seconds reached\n", track_number, max_audio_seconds_read);
 		close_track();
@@ -688,6 +2304,7 @@ parse_subcodepack(unsigned char *frame, int pack_index, frame_info_t *info) {
 	for (j=0; j < 7; j++)
 		parity ^= pack[j];
 	if (parity != pack[7]) {
+		info->parity_errors++;
 		dp(2, "Frame %d Subcode[%d] %s: Incorrect parity %x != %x\n", info->frame_number, pack_index, decode_subcodeid[id], parity, pack[7]);
 		return;
 	}
@@ -762,8 +2379,7 @@ write_frame_audio(unsigned char *frame, frame_info_t *info) {
 		die("internal error invalid track_sampling_frequency in write_frame_audio");
 	}
 	
-	if (write(track_fd, frame, n) != n)
-			die("write");
+	output_frame_audio(frame, info, n);
 	track_nSamples += n / (2 * track_info.nChannels);
 	audio_seconds_read += ((double)(n / (2 * track_info.nChannels)))/track_info.sampling_frequency;
 	return;
@@ -771,131 +2387,2425 @@ write_frame_audio(unsigned char *frame, frame_info_t *info) {
 
 void
 write_frame_nonlinear_audio(unsigned char *frame, frame_info_t *info) {
-	short buffer[SOUND_DATA_SIZE_32KHZ_NONLINEAR_UNPACKED/2];
-	int i, j;
-	
-	j = 0;
-	for (i = 0; i < SOUND_DATA_SIZE_32KHZ_NONLINEAR_PACKED; i += 3) {
-		int x0 = frame[translate_lp_frame_index[i]];
-		int x1 = frame[translate_lp_frame_index[i+1]];
-		int x2 = frame[translate_lp_frame_index[i+2]];
-		buffer[j++] = decode_lp_sample[(x0 << 4) | ((x1 >> 4) & 0x0f)];
-		buffer[j++] = decode_lp_sample[(x2 << 4) | (x1 & 0x0f)];
-	}
-	if (write(track_fd, buffer, SOUND_DATA_SIZE_32KHZ_NONLINEAR_UNPACKED) != SOUND_DATA_SIZE_32KHZ_NONLINEAR_UNPACKED)
-			die("write");
+	output_frame_audio(frame, info, 0);
 	track_nSamples += SOUND_DATA_SIZE_32KHZ_NONLINEAR_UNPACKED / (2 * track_info.nChannels);
 	audio_seconds_read += ((double)(SOUND_DATA_SIZE_32KHZ_NONLINEAR_UNPACKED / (2 * track_info.nChannels)))/track_info.sampling_frequency;
 }
 
+/*
+ * write the audio from a frame to the track in the output format
+ * n_bytes of 16-bit PCM or 0 for a 12-bit non-linear (LP) frame
+ */
 void
-create_filename(char *suffix, char *filename) {
-	if (track_first_date_time > 0) {
-		struct tm *t = localtime(&track_first_date_time);
-		if (snprintf(filename, MAX_FILENAME, "%s%4d-%02d-%02d-%02d-%02d-%02d.%s", filename_prefix, t->tm_year+1900, t->tm_mon+1, t->tm_mday, t->tm_hour, t->tm_min, t->tm_sec, suffix) == -1)
-			die("filename too long");
+output_frame_audio(unsigned char *frame, frame_info_t *info, int n_bytes) {
+	unsigned char out[MAX_OUTPUT_FRAME_BYTES];
+	struct timespec start;
+	int n;
+
+	int verbatim = pcm_verbatim && track_n_outputs == 1 && !track_filtered && !n_sinks;
+
+	/* the audio of a frame read with input_zero_copy is still in the input file */
+	if (info->offset >= 0 && (!n_bytes || !verbatim)) {
+		n = n_bytes ? n_bytes : SOUND_DATA_SIZE_32KHZ_NONLINEAR_PACKED;
+		if (pread(input_fd, frame, n, info->offset) != n)
+			die("read");
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (n_bytes && verbatim && info->offset >= 0 && copy_frame_audio(frame, info->offset, n_bytes))
+		;
+	else if (decode_threads > 1 && !track_filtered && !n_sinks && !hash_files) {
+		/* filters, sinks & hashing need the frames in order so can't be done by the decode threads */
+		queue_frame_output(frame, n_bytes);
+		note_consumer_activity("waiting for decode threads", &start);
+		return;
+	} else if (n_bytes && verbatim) {
+		write_track_output(0, frame, n_bytes);
 	} else {
-		if (snprintf(filename, MAX_FILENAME, "%s%d.%s", filename_prefix, track_number, suffix) == -1)
-			die("filename too long");
+		n = convert_frame_audio(frame, n_bytes, out);
+		if (n_sinks)
+			send_to_sinks(SINK_AUDIO, out, n, info, 0);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (track_n_outputs > 1)
+			write_split_audio(out, n, -1, track_output_fd, track_n_outputs);
+		else
+			write_track_output(0, out, n);
 	}
+	note_consumer_activity("blocked on write", &start);
 }
 
 /*
- * start a new track
+ * Sample conversion kernels - simple loops over the frame's
+ * samples with no dependencies between iterations
+ * so the compiler can vectorise them.  Output is always little-endian.
  */
-void
-open_track(frame_info_t *info) {
-	if (track_fd != -1)
-		die("internal error open_track previous track not closed");
-	track_nSamples = 0;
-	track_invalid_frames = 0;
-	track_info = *info;
-	track_first_frame = info->frame_number;
-	track_first_date_time = info->date_time;
-	create_filename("wav", track_filename);
-	dp(1, "Creating %s\n", track_filename);
-	if ((track_fd = open(track_filename, O_CREAT|O_WRONLY|O_TRUNC, 0600)) < 0)
-		die("Can not create  file %s", track_filename);
-	create_filename("invalid_frames", track_invalid_frames_filename);
-	dp(1, "Creating %s\n", track_invalid_frames_filename);
-	if ((track_invalid_frames_fp = fopen(track_invalid_frames_filename, "w")) == NULL)
-		die("Can not create file", track_invalid_frames_filename);
-	/*
-	 * header will be re-written when track is finished to add correct number of samples
-	 */ 
-	if (write(track_fd, get_16bit_WAV_header(track_nSamples, info->nChannels, info->sampling_frequency), WAV_HEADER_LENGTH) != WAV_HEADER_LENGTH)
-		die("Can not write to file");
+
+static void
+samples_from_pcm(const unsigned char *restrict pcm, short *restrict samples, int n) {
+	int i;
+
+	for (i = 0; i < n; i++)
+		samples[i] = (short)(pcm[2*i] | (pcm[2*i+1] << 8));
 }
 
-void
-adjust_creation_time(char *filename) {
-	struct utimbuf u;
-	if (track_first_date_time > 0) {
-		u.actime = track_first_date_time;
-		u.modtime = track_first_date_time;
-		utime(filename, &u);
+static void
+samples_to_s16(const short *restrict samples, unsigned char *restrict out, int n) {
+	int i;
+
+	for (i = 0; i < n; i++) {
+		out[2*i] = samples[i] & 0xff;
+		out[2*i+1] = (samples[i] >> 8) & 0xff;
 	}
-}	
+}
+
+static void
+samples_to_s24(const short *restrict samples, unsigned char *restrict out, int n) {
+	int i;
+
+	for (i = 0; i < n; i++) {
+		out[3*i] = 0;
+		out[3*i+1] = samples[i] & 0xff;
+		out[3*i+2] = (samples[i] >> 8) & 0xff;
+	}
+}
+
+static void
+samples_to_f32(const short *restrict samples, unsigned char *restrict out, int n) {
+	int i;
+
+	for (i = 0; i < n; i++) {
+		float f = samples[i] * (1.0f/32768);
+		unsigned int u;
+		memcpy(&u, &f, sizeof u);
+		out[4*i] = u & 0xff;
+		out[4*i+1] = (u >> 8) & 0xff;
+		out[4*i+2] = (u >> 16) & 0xff;
+		out[4*i+3] = u >> 24;
+	}
+}
+
 /*
- * finish a track
+ * kernels for audio which has been through a filter - samples are
+ * floats scaled so full scale is +-32768 and are rounded & clipped
+ */
+
+static void
+samples_to_float(const short *restrict samples, float *restrict f, int n) {
+	int i;
+
+	for (i = 0; i < n; i++)
+		f[i] = samples[i];
+}
+
+static void
+float_to_s16(const float *restrict f, unsigned char *restrict out, int n) {
+	int i;
+
+	for (i = 0; i < n; i++) {
+		float x = f[i] < -32768.0f ? -32768.0f : f[i] > 32767.0f ? 32767.0f : f[i];
+		int s = (int)lrintf(x);
+		out[2*i] = s & 0xff;
+		out[2*i+1] = (s >> 8) & 0xff;
+	}
+}
+
+static void
+float_to_s24(const float *restrict f, unsigned char *restrict out, int n) {
+	int i;
+
+	for (i = 0; i < n; i++) {
+		float x = f[i]*256.0f;
+		int s;
+		x = x < -8388608.0f ? -8388608.0f : x > 8388607.0f ? 8388607.0f : x;
+		s = (int)lrintf(x);
+		out[3*i] = s & 0xff;
+		out[3*i+1] = (s >> 8) & 0xff;
+		out[3*i+2] = (s >> 16) & 0xff;
+	}
+}
+
+static void
+float_to_f32(const float *restrict f, unsigned char *restrict out, int n) {
+	int i;
+
+	for (i = 0; i < n; i++) {
+		float x = f[i] * (1.0f/32768);
+		unsigned int u;
+		memcpy(&u, &x, sizeof u);
+		out[4*i] = u & 0xff;
+		out[4*i+1] = (u >> 8) & 0xff;
+		out[4*i+2] = (u >> 16) & 0xff;
+		out[4*i+3] = u >> 24;
+	}
+}
+
+/*
+ * Pre-emphasis boosts high frequencies with the shelf (1 + s*50us)/(1 + s*15us),
+ * de-emphasis applies the inverse (1 + s*15us)/(1 + s*50us).
+ * The digital filter's pole & zero for each DAT sampling frequency were
+ * fitted to minimise the largest error from the analog curve between 20hz
+ * and 20khz (or Nyquist), it has unity gain at DC.  Within 0.05dB at 48khz,
+ * 0.08dB at 44.1khz and 0.17dB at 32khz.  Any other frequency has the 50us
+ * pole matched and the gain at Nyquist exact.
  */
+static struct {
+	int frequency;
+	double pole, zero;
+} deemphasis_filters[] = {
+	{48000, 0.65464885, 0.22971051},
+	{44100, 0.62777538, 0.19137546},
+	{32000, 0.51121236, 0.05281417},
+	{0, 0, 0}
+};
+
 void
-close_track() {
-	char new_track_filename[MAX_FILENAME];
-	char new_track_invalid_frames_filename[MAX_FILENAME];
-	double track_length = track_nSamples/(double)track_info.sampling_frequency;
-	if (track_fd == -1)
-		return;
-		
-	if (track_length < min_track_seconds) {
-		if (verbosity >= 1) {
-			if (track_nSamples == 0)
-				dp(1, "Deleting %s - no data\n", track_filename);
-			else	
-				dp(1, "Deleting %s because %.2fs long - minimum track length %.2fs\n", track_filename, track_length, min_track_seconds);
+start_deemphasis(int frequency) {
+	double w = M_PI*frequency;             /* Nyquist frequency in radians/second */
+	double nyquist_gain = sqrt((1 + w*w*15e-6*15e-6)/(1 + w*w*50e-6*50e-6));
+	double pole = exp(-1/(50e-6*frequency));
+	double r = nyquist_gain*(1 + pole)/(1 - pole);
+	double zero = (r - 1)/(r + 1);
+	double gain;
+	int i;
+
+	for (i = 0; deemphasis_filters[i].frequency; i++)
+		if (deemphasis_filters[i].frequency == frequency) {
+			pole = deemphasis_filters[i].pole;
+			zero = deemphasis_filters[i].zero;
+		}
+	gain = (1 - pole)/(1 - zero);
+
+	deemphasis_b0 = gain;
+	deemphasis_b1 = -gain*zero;
+	deemphasis_a1 = -pole;
+	memset(deemphasis_x, 0, sizeof deemphasis_x);
+	memset(deemphasis_y, 0, sizeof deemphasis_y);
+}
+
+/*
+ * first order IIR filter run along each channel, state is carried from frame to frame
+ * the channels of a sample are independent so the inner loop can be vectorised
+ */
+static void
+deemphasise(float *f, int n, int channels) {
+	float b0 = deemphasis_b0, b1 = deemphasis_b1, a1 = deemphasis_a1;
+	int i, c;
+
+	for (i = 0; i < n; i += channels)
+		for (c = 0; c < channels; c++) {
+			float x = f[i + c];
+			float y = b0*x + b1*deemphasis_x[c] - a1*deemphasis_y[c];
+			deemphasis_x[c] = x;
+			deemphasis_y[c] = y;
+			f[i + c] = y;
 		}
+}
+
+/*
+ * convert filtered samples to the output format
+ * returns the number of bytes placed in out
+ */
+static int
+float_to_output(const float *f, int n_samples, unsigned char *out) {
+	switch (output_format) {
+	case OUTPUT_S24:
+		float_to_s24(f, out, n_samples);
+		break;
+	case OUTPUT_F32:
+		float_to_f32(f, out, n_samples);
+		break;
+	default:
+		float_to_s16(f, out, n_samples);
+	}
+	return n_samples*output_bytes_per_sample[output_format];
+}
+
+static double
+bessel_i0(double x) {
+	double sum = 1, term = 1;
+	int k;
+
+	for (k = 1; term > 1e-12*sum; k++) {
+		term *= (x/(2*k))*(x/(2*k));
+		sum += term;
+	}
+	return sum;
+}
+
+/*
+ * Polyphase resampler - conceptually the input is interpolated by resample_up,
+ * low-pass filtered & decimated by resample_down.  Only the filter phase
+ * needed for each output sample is evaluated.
+ * The low-pass filter is a Kaiser-windowed sinc with its cutoff just below
+ * the lower of the two Nyquist frequencies (about 80dB stop-band attenuation).
+ */
+void
+start_resampling(int from, int to) {
+	double ratio = (double)to/from;
+	double scale = ratio < 1 ? ratio : 1;
+	double cutoff = 0.5*0.91*scale;        /* in cycles per input sample */
+	double beta = 8, i0_beta = bessel_i0(beta);
+	int a = from, b = to, half, phase, k, c;
+
+	while (b) {
+		int t = a % b;
+		a = b;
+		b = t;
+	}
+	resample_up = to/a;
+	resample_down = from/a;
+	if (resample_up > 1024 || resample_down > 1024)
+		die("can not resample from %dhz to %dhz", from, to);
+	resample_taps = 4*(int)ceil(8/scale);
+	half = resample_taps/2;
+	free(resample_filter);
+	if ((resample_filter = malloc(resample_up*resample_taps*sizeof *resample_filter)) == NULL)
+		die("out of memory");
+	for (phase = 0; phase < resample_up; phase++) {
+		float *h = resample_filter + phase*resample_taps;
+		double sum = 0;
 		/*
-		 * This is inefficient but simpler than buffering writes
+		 * tap k is applied to the input sample k samples older than the newest
+		 * the output is half samples behind the newest input sample
 		 */
-		close(track_fd);
-		if (unlink(track_filename) < 0)
-			die("unlink file");
+		for (k = 0; k < resample_taps; k++) {
+			double t = k - half + (double)phase/resample_up;
+			double x = t/half;
+			double sinc = t == 0 ? 1 : sin(2*M_PI*cutoff*t)/(2*M_PI*cutoff*t);
+			double window = x*x < 1 ? bessel_i0(beta*sqrt(1 - x*x))/i0_beta : 0;
+			/* stored reversed so it lines up with the history in time order */
+			h[resample_taps - 1 - k] = 2*cutoff*sinc*window;
+			sum += 2*cutoff*sinc*window;
+		}
+		for (k = 0; k < resample_taps; k++)
+			h[k] /= sum;
+	}
+	for (c = 0; c < 4; c++) {
+		free(resample_history[c]);
+		if ((resample_history[c] = calloc(resample_taps + SOUND_DATA_SIZE_32KHZ_NONLINEAR_UNPACKED/2, sizeof (float))) == NULL)
+			die("out of memory");
+	}
+	/* half samples of silence before the track so the first output is aligned with the first input */
+	resample_length = half;
+	resample_position = 2*half;
+	resample_phase = 0;
+	track_output_nSamples = 0;
+	dp(2, "Resampling from %dhz to %dhz, %d phases of %d taps\n", from, to, resample_up, resample_taps);
+}
+
+/*
+ * resample n interleaved samples, the output is placed in out
+ * returns the number of interleaved samples output
+ */
+static int
+resample(const float *in, int n, int channels, float *out) {
+	int frames = n/channels, n_out = 0, i, c, discard;
+
+	for (c = 0; c < channels; c++)
+		for (i = 0; i < frames; i++)
+			resample_history[c][resample_length + i] = in[i*channels + c];
+	resample_length += frames;
+	while (resample_position < resample_length) {
+		const float *h = resample_filter + resample_phase*resample_taps;
+		int first = resample_position - resample_taps + 1;
+		for (c = 0; c < channels; c++) {
+			const float *x = resample_history[c] + first;
+			/* 4 partial sums so the loop isn't serialised on one accumulator */
+			float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+			for (i = 0; i < resample_taps; i += 4) {
+				s0 += h[i]*x[i];
+				s1 += h[i+1]*x[i+1];
+				s2 += h[i+2]*x[i+2];
+				s3 += h[i+3]*x[i+3];
+			}
+			out[n_out++] = (s0 + s1) + (s2 + s3);
+		}
+		resample_phase += resample_down;
+		resample_position += resample_phase/resample_up;
+		resample_phase %= resample_up;
+	}
+	/* keep only the history the next output needs */
+	discard = resample_position - resample_taps + 1;
+	if (discard > resample_length)
+		discard = resample_length;
+	for (c = 0; c < channels; c++)
+		memmove(resample_history[c], resample_history[c] + discard, (resample_length - discard)*sizeof (float));
+	resample_length -= discard;
+	resample_position -= discard;
+	track_output_nSamples += n_out/channels;
+	return n_out;
+}
+
+/*
+ * the last half filter length of output needs input from after the track
+ * - supply silence
+ */
+void
+flush_resampler(void) {
+	float silence[4*MAX_RESAMPLE_TAPS/2], r[MAX_OUTPUT_FRAME_SAMPLES];
+	unsigned char out[MAX_OUTPUT_FRAME_BYTES];
+	int channels = track_info.nChannels, n;
+
+	memset(silence, 0, sizeof silence);
+	n = resample(silence, channels*(resample_taps/2), channels, r);
+	n = float_to_output(r, n, out);
+	if (n_sinks)
+		send_to_sinks(SINK_AUDIO, out, n, &track_info, 0);
+	if (track_n_outputs > 1)
+		write_split_audio(out, n, -1, track_output_fd, track_n_outputs);
+	else
+		write_track_output(0, out, n);
+}
+
+/*
+ * number of samples in each channel in the track's WAV file
+ */
+int
+track_output_samples(void) {
+	return track_resampling ? track_output_nSamples : track_nSamples;
+}
+
+/*
+ * convert the audio from a frame - n_bytes of 16-bit little-endian PCM
+ * or 0 for an LP frame - to the output format
+ * returns the number of bytes placed in out
+ */
+int
+convert_frame_audio(unsigned char *frame, int n_bytes, unsigned char *out) {
+	short samples[SOUND_DATA_SIZE_32KHZ_NONLINEAR_UNPACKED/2];
+	int n_samples;
+
+	if (n_bytes) {
+		n_samples = n_bytes/2;
+		samples_from_pcm(frame, samples, n_samples);
+	} else {
+		n_samples = SOUND_DATA_SIZE_32KHZ_NONLINEAR_UNPACKED/2;
+		decode_lp_frame(frame, samples);
+	}
+	if (track_filtered) {
+		float f[SOUND_DATA_SIZE_32KHZ_NONLINEAR_UNPACKED/2];
+		samples_to_float(samples, f, n_samples);
+		if (track_deemphasis)
+			deemphasise(f, n_samples, track_info.nChannels);
+		if (track_resampling) {
+			float r[MAX_OUTPUT_FRAME_SAMPLES];
+			n_samples = resample(f, n_samples, track_info.nChannels, r);
+			return float_to_output(r, n_samples, out);
+		}
+		return float_to_output(f, n_samples, out);
+	}
+	switch (output_format) {
+	case OUTPUT_S24:
+		samples_to_s24(samples, out, n_samples);
+		break;
+	case OUTPUT_F32:
+		samples_to_f32(samples, out, n_samples);
+		break;
+	default:
+		samples_to_s16(samples, out, n_samples);
+	}
+	return n_samples*output_bytes_per_sample[output_format];
+}
+
+/*
+ * bytes written to each of the track's files for a frame
+ * with n_bytes of PCM audio (0 == LP frame)
+ */
+int
+output_frame_bytes(int n_bytes) {
+	int n_samples = n_bytes ? n_bytes/2 : SOUND_DATA_SIZE_32KHZ_NONLINEAR_UNPACKED/2;
+	return n_samples*output_bytes_per_sample[output_format]/track_n_outputs;
+}
+
+/*
+ * de-interleave the channels of a frame's converted audio
+ * each file gets 4/n_fds consecutive channels of each sample
+ */
+static void
+split_samples(const unsigned char *restrict out, int n, int n_fds, int k, unsigned char *restrict part) {
+	int width = 4*output_bytes_per_sample[output_format]/n_fds;
+	int i, j;
+
+	for (i = 0; i < n/(n_fds*width); i++)
+		for (j = 0; j < width; j++)
+			part[i*width + j] = out[(i*n_fds + k)*width + j];
+}
+
+/*
+ * write n bytes of 4-channel audio split across n_fds files
+ * at offset in each file or, if offset is -1, at the end of the track's outputs
+ */
+void
+write_split_audio(unsigned char *out, int n, off_t offset, int *fds, int n_fds) {
+	unsigned char part[MAX_OUTPUT_FRAME_BYTES];
+	int k, m = n/n_fds;
+
+	for (k = 0; k < n_fds; k++) {
+		split_samples(out, n, n_fds, k, part);
+		if (offset < 0)
+			write_track_output(k, part, m);
+		else if (pwrite(fds[k], part, m, offset) != m)
+			die("write");
+	}
+}
+
+/*
+ * append n bytes to output k of the track, hashing them as they are written with -b
+ */
+void
+write_track_output(int k, const void *data, int n) {
+	if (write(k ? track_output_fd[k] : track_fd, data, n) != n)
+		die("write");
+	if (track_output_hash[k])
+		dat_hash_update(track_output_hash[k], data, n);
+}
+
+/*
+ * copy n bytes of audio from the frame at offset in the input image to the track
+ * inside the kernel - if that's not possible (e.g. different filesystems)
+ * read the audio into frame and return 0 so it is written from there
+ */
+int
+copy_frame_audio(unsigned char *frame, off_t offset, int n) {
+	off_t src = offset;
+	ssize_t m;
+
+	if (!track_copy_failed) {
+		m = copy_file_range(input_fd, &src, track_fd, NULL, n, 0);
+		if (m == n)
+			return 1;
+		if (m > 0) {
+			/* short copy - finish it from user space */
+			if (pread(input_fd, frame, n - m, src) != n - m)
+				die("read");
+			if (write(track_fd, frame, n - m) != n - m)
+				die("write");
+			return 1;
+		}
+		dp(2, "copy_file_range failed (%s) copying track audio through user space\n", strerror(errno));
+		track_copy_failed = 1;
+	}
+	if (pread(input_fd, frame, n, offset) != n)
+		die("read");
+	return 0;
+}
+
+/*
+ * unpack the 12-bit samples of a frame and convert them to 16-bit
+ */
+void
+decode_lp_frame(unsigned char *frame, short *buffer) {
+	int i, j;
+
+	j = 0;
+	for (i = 0; i < SOUND_DATA_SIZE_32KHZ_NONLINEAR_PACKED; i += 3) {
+		int x0 = frame[translate_lp_frame_index[i]];
+		int x1 = frame[translate_lp_frame_index[i+1]];
+		int x2 = frame[translate_lp_frame_index[i+2]];
+		buffer[j++] = decode_lp_sample[(x0 << 4) | ((x1 >> 4) & 0x0f)];
+		buffer[j++] = decode_lp_sample[(x2 << 4) | (x1 & 0x0f)];
+	}
+}
+
+/*
+ * the samples of a frame's audio, returns the number of samples
+ */
+static int
+frame_samples(unsigned char *frame, frame_info_t *info, short *samples) {
+	int n;
+
+	if (info->encoding != 0) {
+		decode_lp_frame(frame, samples);
+		return SOUND_DATA_SIZE_32KHZ_NONLINEAR_UNPACKED/2;
+	}
+	n = info->sampling_frequency == 48000 ? SOUND_DATA_SIZE_48KHZ/2 :
+		info->sampling_frequency == 44100 ? SOUND_DATA_SIZE_44_1KHZ/2 : SOUND_DATA_SIZE_32KHZ_PCM/2;
+	samples_from_pcm(frame, samples, n);
+	return n;
+}
+
+/*
+ * is a frame's audio below silence_level?
+ * integer sums so the loop can be vectorised (gcc -O3)
+ */
+static int
+frame_is_silent(unsigned char *frame, frame_info_t *info) {
+	short samples[SOUND_DATA_SIZE_32KHZ_NONLINEAR_UNPACKED/2];
+	double threshold = 32768*pow(10, silence_level/20);
+	long sum = 0;
+	int i, n, peak = 0;
+
+	if (info->invalid == 2)
+		return 0;
+	n = frame_samples(frame, info, samples);
+	for (i = 0; i < n; i++) {
+		int v = samples[i], a = abs(v);
+		peak = a > peak ? a : peak;
+		sum += v*v;
+	}
+	return sqrt(sum/(double)n) < threshold && peak < 10*threshold;
+}
+
+/*
+ * 0 if a frame's audio is all 0x00, 0xFF if all 0xFF, otherwise 1
+ */
+static int
+frame_fill(unsigned char *frame, frame_info_t *info) {
+	int data_bytes = info->encoding != 0 ? SOUND_DATA_SIZE_32KHZ_NONLINEAR_PACKED :
+		info->sampling_frequency == 48000 ? SOUND_DATA_SIZE_48KHZ :
+		info->sampling_frequency == 44100 ? SOUND_DATA_SIZE_44_1KHZ : SOUND_DATA_SIZE_32KHZ_PCM;
+	unsigned and_bytes = 0xff, or_bytes = 0;
+	int i;
+
+	/* no branches in the loop */
+	for (i = 0; i < data_bytes; i++) {
+		and_bytes &= frame[i];
+		or_bytes |= frame[i];
+	}
+	return and_bytes == 0xff ? 0xff : or_bytes != 0;
+}
+
+/*
+ * peak of the first (or last) 16 samples of each channel
+ */
+static int
+frame_edge_level(short *samples, int n, int channels, int at_end) {
+	int i, peak = 0;
+
+	for (i = at_end ? n - 16*channels : 0; i < (at_end ? n : 16*channels); i++)
+		peak = abs(samples[i]) > peak ? abs(samples[i]) : peak;
+	return peak;
+}
+
+/*
+ * damage visible in a frame's samples - a channel stuck at one
+ * value which isn't near-silence or a burst at full scale
+ */
+static char *
+damaged_samples(unsigned char *frame, frame_info_t *info) {
+	short samples[SOUND_DATA_SIZE_32KHZ_NONLINEAR_UNPACKED/2];
+	int n = frame_samples(frame, info, samples);
+	int channels = info->nChannels;
+	int i, c, last;
+
+	if (frame_fill(frame, info) == 0xff)
+		return "audio is all 0xFF";
+	for (c = 0; c < channels; c++) {
+		int stuck = 1, clipped = 0;
+		for (i = c + channels, last = samples[c]; i < n; last = samples[i], i += channels) {
+			int v = samples[i];
+			stuck = v == last && abs(v) > CLASSIFY_STUCK_LEVEL ? stuck + 1 : 1;
+			clipped = v == 32767 || v == -32768 ? clipped + 1 : 0;
+			if (stuck >= CLASSIFY_STUCK_SAMPLES)
+				return "stuck sample";
+			if (clipped >= CLASSIFY_CLIPPED_SAMPLES)
+				return "burst of clipped samples";
+		}
+	}
+	return NULL;
+}
+
+/*
+ * look for damage the drive didn't flag with interpolate flags
+ * returns a description or NULL if the frame looks undamaged
+ *
+ * A run of at most CLASSIFY_MAX_DROPOUT_FRAMES all zero frames is a dropout
+ * if the audio before it was loud and resumes at a similar level after it,
+ * so it needs the following frames in lookahead_frame - a cut to
+ * digital silence isn't damage.
+ */
+char *
+classify_frame(unsigned char *frame, frame_info_t *info) {
+	short samples[SOUND_DATA_SIZE_32KHZ_NONLINEAR_UNPACKED/2];
+	int fill = frame_fill(frame, info), i;
+
+	if (fill == 0) {
+		int run = classify_zero_frames + 1;     /* zero frames so far */
+		classify_zero_frames++;
+		classify_dropout_frames = 0;
+		if (classify_previous_level <= CLASSIFY_DROPOUT_LEVEL)
+			return NULL;
+		for (i = 0; i < n_lookahead && run <= CLASSIFY_MAX_DROPOUT_FRAMES; i++) {
+			frame_info_t *next = lookahead_info[i];
+			int fill_next = next->invalid == 2 || frame_info_inconsistent(info, next) ? -1 : frame_fill(lookahead_frame[i], next);
+			int n;
+			if (fill_next == 0) {
+				run++;
+				continue;
+			}
+			if (fill_next != 1)
+				break;
+			n = frame_samples(lookahead_frame[i], next, samples);
+			if (4*frame_edge_level(samples, n, next->nChannels, 0) < classify_previous_level)
+				break;
+			classify_dropout_frames = i;
+			return "audio is all zero between audio (dropout)";
+		}
+		return NULL;
+	}
+	classify_zero_frames = 0;
+	classify_dropout_frames = 0;
+	if (fill == 1)
+		classify_previous_level = frame_edge_level(samples, frame_samples(frame, info, samples), info->nChannels, 1);
+	return damaged_samples(frame, info);
+}
+
+/*
+ * replace the audio of a damaged 16-bit linear frame with a line from the
+ * end of the previous frame to the start of the next, holding the previous
+ * frame's last sample if the next frame is also damaged
+ * neither frame is used if it's in a different track
+ * returns 1 if the frame was concealed
+ */
+int
+conceal_frame(unsigned char *frame, frame_info_t *info, int damaged, unsigned char *next_frame, frame_info_t *next_info) {
+	short samples[SOUND_DATA_SIZE_48KHZ/2];
+	int channels = info->nChannels;
+	int i, c, n, target[4];
+
+	if (info->encoding != 0)
+		return 0;
+	/* this frame starts a track */
+	if (track_fd == -1)
+		conceal_history_valid = 0;
+	n = frame_samples(frame, info, samples);
+	if (damaged) {
+		int next_good = next_frame != frame && next_info->invalid == 0 && !(next_info->interpolate_flags & (0x40|0x20)) &&
+			!frame_info_inconsistent(info, next_info) && next_info->program_number == info->program_number &&
+			!(classify_frames && (classify_dropout_frames || damaged_samples(next_frame, next_info)));
+		for (c = 0; c < channels; c++)
+			target[c] = next_good ? (short)(next_frame[2*c] | (next_frame[2*c+1] << 8)) : conceal_history[c];
+		if (!conceal_history_valid) {
+			/* nothing before it in the track - hold the next frame's first sample (or silence) */
+			for (c = 0; c < channels; c++)
+				conceal_history[c] = target[c] = next_good ? target[c] : 0;
+		}
+		for (c = 0; c < channels; c++) {
+			float step = (target[c] - conceal_history[c])/(float)(n/channels + 1);
+			for (i = c; i < n; i += channels)
+				samples[i] = lrintf(conceal_history[c] + step*(i/channels + 1));
+		}
+		samples_to_s16(samples, frame, n);
+		dp(2, "Frame %d concealed\n", info->frame_number);
+	}
+	for (c = 0; c < channels; c++)
+		conceal_history[c] = samples[n - channels + c];
+	conceal_history_valid = 1;
+	return damaged;
+}
+
+/*
+ * hold silent frames while the current track is open - if the silence
+ * lasts silence_seconds close the track in its middle
+ */
+int
+split_on_silence(unsigned char *frame, frame_info_t *info, int invalid_frame) {
+	int silence_frames = silence_seconds*100/3;    /* frames are 30ms */
+	held_frame_t *h;
+
+	if (track_fd != -1 && frame_is_silent(frame, info)) {
+		if (held_frames == NULL) {
+			held_frames_size = 2*silence_frames < 2000 ? 2000 : 2*silence_frames;
+			if ((held_frames = malloc(held_frames_size*sizeof *held_frames)) == NULL)
+				die("out of memory");
+		}
+		if (n_held_frames == held_frames_size) {
+			/* very long silence - the oldest frame stays in the current track */
+			h = &held_frames[held_first];
+			held_first = (held_first + 1) % held_frames_size;
+			n_held_frames--;
+			if (!append_frame_to_track(h->frame, &h->info, h->invalid_frame))
+				return 0;
+		}
+		h = &held_frames[(held_first + n_held_frames++) % held_frames_size];
+		memcpy(h->frame, frame, FRAME_SIZE);
+		h->info = *info;
+		h->invalid_frame = invalid_frame;
+		/* so the frame after the silence is checked against its end */
+		if (info->date_time != -1)
+			track_info.date_time = info->date_time;
+		return 1;
+	}
+	if (n_held_frames >= silence_frames) {
+		int n_silent = n_held_frames, second_half = n_held_frames/2;
+		/* the first half of the silence ends this track */
+		n_held_frames -= second_half;
+		if (!release_held_frames())
+			return 0;
+		if (track_fd != -1) {
+			dp(1, "Closing track %d because of %.2fs silence before frame %d\n", track_number, n_silent*0.03, info->frame_number);
+			close_track();
+		}
+		/* the rest of the silence begins the next track */
+		n_held_frames = second_half;
+	}
+	if (!release_held_frames())
+		return 0;
+	return append_frame_to_track(frame, info, invalid_frame);
+}
+
+/*
+ * add any held silent frames to the current track - they all go in it,
+ * -M & -r are checked once they have been added
+ * returns 0 if extraction should stop
+ */
+int
+release_held_frames(void) {
+	int n = n_held_frames;
+
+	n_held_frames = 0;
+	releasing_held_frames = 1;
+	while (n-- > 0) {
+		held_frame_t *h = &held_frames[held_first];
+		held_first = (held_first + 1) % held_frames_size;
+		append_frame_to_track(h->frame, &h->info, h->invalid_frame);
+	}
+	releasing_held_frames = 0;
+	if (track_fd != -1 && audio_seconds_read >= max_audio_seconds_read) {
+		dp(1, "Closing track %d and exiting, limit of %.2f seconds reached\n", track_number, max_audio_seconds_read);
+		close_track();
+		return 0;
+	}
+	if (track_fd != -1 && track_nSamples/(double)track_info.sampling_frequency >= max_track_seconds) {
+		dp(1, "Closing track %d, limit of %.2f seconds reached\n", track_number, max_track_seconds);
+		close_track();
+	}
+	return 1;
+}
+
+void *
+decode_thread(void *arg) {
+	unsigned char out[MAX_OUTPUT_FRAME_BYTES];
+	int i, n;
+
+	for (;;) {
+		decode_batch_t *b = NULL;
+		pthread_mutex_lock(&decode_mutex);
+		while (b == NULL) {
+			for (i = 0; i < 2*decode_threads; i++)
+				if (decode_batches[i].state == BATCH_QUEUED) {
+					b = &decode_batches[i];
+					break;
+				}
+			if (b == NULL)
+				pthread_cond_wait(&decode_cond, &decode_mutex);
+		}
+		b->state = BATCH_DECODING;
+		pthread_mutex_unlock(&decode_mutex);
+		for (i = 0; i < b->n_frames; i++) {
+			if (b->n_bytes[i] && pcm_verbatim && b->n_fds == 1) {
+				if (pwrite(b->fds[0], b->frames[i], b->n_bytes[i], b->offset[i]) != b->n_bytes[i])
+					die("write");
+			} else {
+				n = convert_frame_audio(b->frames[i], b->n_bytes[i], out);
+				if (b->n_fds > 1)
+					write_split_audio(out, n, b->offset[i], b->fds, b->n_fds);
+				else if (pwrite(b->fds[0], out, n, b->offset[i]) != n)
+					die("write");
+			}
+		}
+		pthread_mutex_lock(&decode_mutex);
+		b->state = BATCH_FREE;
+		pthread_cond_broadcast(&decode_cond);
+		pthread_mutex_unlock(&decode_mutex);
+	}
+	return NULL;
+}
+
+void
+submit_batch(void) {
+	pthread_mutex_lock(&decode_mutex);
+	filling_batch->state = BATCH_QUEUED;
+	filling_batch = NULL;
+	pthread_cond_broadcast(&decode_cond);
+	pthread_mutex_unlock(&decode_mutex);
+}
+
+/*
+ * give a frame to the decode threads, its audio is written
+ * n_bytes as is (or 0 to decode an LP frame) at the current end of the track
+ */
+void
+queue_frame_output(unsigned char *frame, int n_bytes) {
+	int i;
+
+	if (decode_batches == NULL) {
+		if ((decode_batches = calloc(2*decode_threads, sizeof *decode_batches)) == NULL)
+			die("out of memory");
+		for (i = 0; i < decode_threads; i++) {
+			pthread_t thread;
+			if (pthread_create(&thread, NULL, decode_thread, NULL) != 0)
+				die("can not create decode thread");
+		}
+	}
+	if (filling_batch == NULL) {
+		pthread_mutex_lock(&decode_mutex);
+		while (filling_batch == NULL) {
+			for (i = 0; i < 2*decode_threads; i++)
+				if (decode_batches[i].state == BATCH_FREE) {
+					filling_batch = &decode_batches[i];
+					break;
+				}
+			if (filling_batch == NULL)
+				pthread_cond_wait(&decode_cond, &decode_mutex);
+		}
+		filling_batch->state = BATCH_FILLING;
+		filling_batch->fds[0] = track_fd;
+		for (i = 1; i < track_n_outputs; i++)
+			filling_batch->fds[i] = track_output_fd[i];
+		filling_batch->n_fds = track_n_outputs;
+		filling_batch->n_frames = 0;
+		pthread_mutex_unlock(&decode_mutex);
+		/* the next batch's worth of the file */
+		for (i = 0; i < filling_batch->n_fds; i++)
+			if (posix_fallocate(filling_batch->fds[i], track_write_offset, DECODE_BATCH_FRAMES*output_frame_bytes(0)) == 0)
+				track_preallocated = 1;
+	}
+	i = filling_batch->n_frames++;
+	memcpy(filling_batch->frames[i], frame, FRAME_SIZE);
+	filling_batch->n_bytes[i] = n_bytes;
+	filling_batch->offset[i] = track_write_offset;
+	track_write_offset += output_frame_bytes(n_bytes);
+	if (filling_batch->n_frames == DECODE_BATCH_FRAMES)
+		submit_batch();
+}
+
+/*
+ * wait until all queued frames are written - the track
+ * must not be closed or its header re-written until then
+ */
+void
+wait_for_decode_threads(void) {
+	int i, busy;
+
+	if (decode_batches == NULL)
+		return;
+	if (filling_batch)
+		submit_batch();
+	pthread_mutex_lock(&decode_mutex);
+	do {
+		busy = 0;
+		for (i = 0; i < 2*decode_threads; i++)
+			if (decode_batches[i].state != BATCH_FREE)
+				busy = 1;
+		if (busy)
+			pthread_cond_wait(&decode_cond, &decode_mutex);
+	} while (busy);
+	pthread_mutex_unlock(&decode_mutex);
+	/* posix_fallocate may have extended the files past the audio */
+	for (i = 0; track_preallocated && i < track_n_outputs; i++)
+		if (ftruncate(i ? track_output_fd[i] : track_fd, track_write_offset) < 0)
+			die("Can not truncate track");
+	track_preallocated = 0;
+}
+
+/*
+ * Sinks
+ */
+
+sink_t *
+add_sink(char *name, void (*open)(sink_t *, frame_info_t *), void (*audio)(sink_t *, unsigned char *, int, frame_info_t *), void (*close)(sink_t *, int), void *state) {
+	sink_t *s;
+
+	if (n_sinks == MAX_SINKS)
+		die("too many sinks");
+	s = &sinks[n_sinks++];
+	s->name = name;
+	s->open = open;
+	s->audio = audio;
+	s->close = close;
+	s->details = NULL;
+	s->state = state;
+	s->inline_sink = 0;
+	return s;
+}
+
+static void
+dispatch_sink_event(sink_t *s, sink_event_t *e) {
+	switch (e->type) {
+	case SINK_OPEN:
+		if (s->open)
+			s->open(s, &e->info);
+		break;
+	case SINK_AUDIO:
+		if (s->audio)
+			s->audio(s, e->buffer->data, e->buffer->n, &e->info);
+		pthread_mutex_lock(&sink_buffer_mutex);
+		if (--e->buffer->refs == 0)
+			free(e->buffer);
+		pthread_mutex_unlock(&sink_buffer_mutex);
+		break;
+	case SINK_CLOSE:
+		if (s->close)
+			s->close(s, e->keep);
+		break;
+	}
+}
+
+void *
+sink_thread(void *arg) {
+	sink_t *s = arg;
+
+	for (;;) {
+		sink_event_t *e;
+		pthread_mutex_lock(&s->mutex);
+		while (!s->n_queued)
+			pthread_cond_wait(&s->cond, &s->mutex);
+		e = &s->queue[s->head];
+		s->busy = 1;
+		pthread_mutex_unlock(&s->mutex);
+		dispatch_sink_event(s, e);
+		pthread_mutex_lock(&s->mutex);
+		s->head = (s->head + 1) % SINK_QUEUE_LENGTH;
+		s->n_queued--;
+		s->busy = 0;
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->mutex);
+	}
+	return NULL;
+}
+
+/*
+ * threads are started when first needed so batch mode's children get their own
+ */
+static void
+start_sinks(void) {
+	int i;
+
+	signal(SIGPIPE, SIG_IGN);
+	for (i = 0; i < n_sinks; i++) {
+		pthread_mutex_init(&sinks[i].mutex, NULL);
+		pthread_cond_init(&sinks[i].cond, NULL);
+		if (!sinks[i].inline_sink && pthread_create(&sinks[i].thread, NULL, sink_thread, &sinks[i]) != 0)
+			die("can not create thread for %s", sinks[i].name);
+	}
+	sinks_started = 1;
+}
+
+/*
+ * queue an event for every sink - audio is copied once into a
+ * buffer they share.  If a sink's queue is full we wait for it.
+ */
+void
+send_to_sinks(int type, unsigned char *data, int n, frame_info_t *info, int keep) {
+	sink_buffer_t *buffer = NULL;
+	int i;
+
+	if (!sinks_started)
+		start_sinks();
+	if (type == SINK_AUDIO) {
+		if ((buffer = malloc(sizeof *buffer)) == NULL)
+			die("out of memory");
+		buffer->refs = n_sinks;
+		buffer->n = n;
+		memcpy(buffer->data, data, n);
+	}
+	for (i = 0; i < n_sinks; i++) {
+		sink_t *s = &sinks[i];
+		sink_event_t *e;
+		if (s->inline_sink) {
+			sink_event_t event = {type, buffer, *info, keep};
+			dispatch_sink_event(s, &event);
+			continue;
+		}
+		pthread_mutex_lock(&s->mutex);
+		if (s->n_queued == SINK_QUEUE_LENGTH) {
+			struct timespec start;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			while (s->n_queued == SINK_QUEUE_LENGTH)
+				pthread_cond_wait(&s->cond, &s->mutex);
+			note_consumer_activity(s->name, &start);
+		}
+		e = &s->queue[(s->head + s->n_queued) % SINK_QUEUE_LENGTH];
+		e->type = type;
+		e->buffer = buffer;
+		e->info = *info;
+		e->keep = keep;
+		s->n_queued++;
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->mutex);
+	}
+}
+
+/*
+ * wait until every sink has dealt with everything queued for it
+ */
+void
+wait_for_sinks(void) {
+	int i;
+
+	for (i = 0; i < n_sinks && sinks_started; i++) {
+		sink_t *s = &sinks[i];
+		pthread_mutex_lock(&s->mutex);
+		while (s->n_queued || s->busy)
+			pthread_cond_wait(&s->cond, &s->mutex);
+		pthread_mutex_unlock(&s->mutex);
+	}
+}
+
+/*
+ * a sink which pipes audio into a command
+ */
+typedef struct command_sink {
+	char *command;
+	int fd;
+	pid_t pid;
+} command_sink_t;
+
+static void
+command_sink_open(sink_t *s, frame_info_t *info) {
+	command_sink_t *c = s->state;
+	int pipe_fds[2];
+	char track[MAX_FILENAME], *dot;
+
+	strcpy(track, track_filename);
+	if ((dot = strrchr(track, '.')) != NULL)
+		*dot = '\0';
+	/* close-on-exec so other commands don't hold this pipe open */
+	if (pipe2(pipe_fds, O_CLOEXEC) < 0)
+		die("pipe");
+	if ((c->pid = fork()) < 0)
+		die("fork");
+	if (c->pid == 0) {
+		char value[32];
+		dup2(pipe_fds[0], 0);
+		/* its own process group so a discarded track can be stopped */
+		setpgid(0, 0);
+		setenv("TRACK", track, 1);
+		snprintf(value, sizeof value, "%d", track_output_frequency);
+		setenv("RATE", value, 1);
+		snprintf(value, sizeof value, "%d", info->nChannels);
+		setenv("CHANNELS", value, 1);
+		snprintf(value, sizeof value, "%d", 8*output_bytes_per_sample[output_format]);
+		setenv("BITS", value, 1);
+		setenv("FORMAT", output_format_names[output_format], 1);
+		execl("/bin/sh", "sh", "-c", c->command, (char *)NULL);
+		die("Can not run /bin/sh");
+	}
+	setpgid(c->pid, c->pid);
+	close(pipe_fds[0]);
+	c->fd = pipe_fds[1];
+}
+
+static void
+command_sink_audio(sink_t *s, unsigned char *data, int n, frame_info_t *info) {
+	command_sink_t *c = s->state;
+	int m;
+
+	while (c->fd >= 0 && n > 0) {
+		if ((m = write(c->fd, data, n)) <= 0) {
+			dp(1, "Frame %d: %s is not reading its input\n", info->frame_number, c->command);
+			close(c->fd);
+			c->fd = -1;
+			break;
+		}
+		data += m;
+		n -= m;
+	}
+}
+
+static void
+command_sink_close(sink_t *s, int keep) {
+	command_sink_t *c = s->state;
+	int status;
+
+	if (!keep) {
+		dp(2, "Stopping %s for discarded track %s\n", c->command, track_filename);
+		kill(-c->pid, SIGTERM);
+	}
+	if (c->fd >= 0)
+		close(c->fd);
+	c->fd = -1;
+	if (waitpid(c->pid, &status, 0) == c->pid && keep && (!WIFEXITED(status) || WEXITSTATUS(status) != 0))
+		dp(1, "%s failed for %s\n", c->command, track_filename);
+}
+
+void
+add_command_sink(char *command) {
+	command_sink_t *c;
+
+	if ((c = malloc(sizeof *c)) == NULL)
+		die("out of memory");
+	c->command = command;
+	c->fd = -1;
+	add_sink(command, command_sink_open, command_sink_audio, command_sink_close, c);
+}
+
+/*
+ * convert audio in the output format to floats with full scale +-1
+ * returns the number of samples
+ */
+static int
+sink_audio_to_float(const unsigned char *restrict data, int n, float *restrict f) {
+	int i;
+
+	switch (output_format) {
+	case OUTPUT_S24:
+		n /= 3;
+		for (i = 0; i < n; i++)
+			f[i] = ((int)(((unsigned)data[3*i] << 8) | ((unsigned)data[3*i+1] << 16) | ((unsigned)data[3*i+2] << 24)) >> 8) * (1.0f/8388608);
+		break;
+	case OUTPUT_F32:
+		n /= 4;
+		for (i = 0; i < n; i++) {
+			unsigned int u = data[4*i] | (data[4*i+1] << 8) | (data[4*i+2] << 16) | ((unsigned)data[4*i+3] << 24);
+			memcpy(&f[i], &u, sizeof u);
+		}
+		break;
+	default:
+		n /= 2;
+		for (i = 0; i < n; i++)
+			f[i] = (short)(data[2*i] | (data[2*i+1] << 8)) * (1.0f/32768);
+	}
+	return n;
+}
+
+/*
+ * Loudness meter - ITU-R BS.1770-4/EBU R128 integrated loudness,
+ * true peak (4x oversampled), DC offset and clipped samples
+ */
+#define TRUE_PEAK_TAPS 12                  /* for each of 4 phases */
+
+typedef struct meter {
+	double k_b[5], k_a[5];                  /* K-weighting filter, 2 biquads combined */
+	double k_state[4][4];                   /* for each channel */
+	float tp_filter[4][TRUE_PEAK_TAPS];
+	float tp_history[4][2*TRUE_PEAK_TAPS];  /* each sample stored twice so the taps are contiguous */
+	int tp_position;
+	double energy[4];                       /* of K-weighted samples in current 100ms */
+	int sub_block_length, sub_block_samples;
+	double *sub_blocks;                     /* mean square energy of each 100ms */
+	int n_sub_blocks, sub_blocks_size;
+	double dc_sum[4];
+	long n_samples, clipped;
+	float peak, true_peak;
+} meter_t;
+
+static void
+meter_open(sink_t *s, frame_info_t *info) {
+	meter_t *m = s->state;
+	double rate = track_output_frequency, K, Vh, Vb, a0, pb[3], pa[3], rb[3] = {1, -2, 1}, ra[3];
+	int i, j, p;
+
+	/* K-weighting: high shelf then high-pass, coefficients as libebur128 */
+	K = tan(M_PI*1681.974450955533/rate);
+	Vh = pow(10, 3.999843853973347/20);
+	Vb = pow(Vh, 0.4996667741545416);
+	a0 = 1 + K/0.7071752369554196 + K*K;
+	pb[0] = (Vh + Vb*K/0.7071752369554196 + K*K)/a0;
+	pb[1] = 2*(K*K - Vh)/a0;
+	pb[2] = (Vh - Vb*K/0.7071752369554196 + K*K)/a0;
+	pa[0] = 1;
+	pa[1] = 2*(K*K - 1)/a0;
+	pa[2] = (1 - K/0.7071752369554196 + K*K)/a0;
+	K = tan(M_PI*38.13547087602444/rate);
+	a0 = 1 + K/0.5003270373238773 + K*K;
+	ra[0] = 1;
+	ra[1] = 2*(K*K - 1)/a0;
+	ra[2] = (1 - K/0.5003270373238773 + K*K)/a0;
+	for (i = 0; i < 5; i++) {
+		m->k_b[i] = m->k_a[i] = 0;
+		for (j = 0; j < 3; j++)
+			if (i - j >= 0 && i - j < 3) {
+				m->k_b[i] += pb[j]*rb[i - j];
+				m->k_a[i] += pa[j]*ra[i - j];
+			}
+	}
+	/* true peak interpolation filter - windowed sinc */
+	for (p = 0; p < 4; p++)
+		for (i = 0; i < TRUE_PEAK_TAPS; i++) {
+			double t = i - TRUE_PEAK_TAPS/2 + p/4.0, x = t/(TRUE_PEAK_TAPS/2);
+			double sinc = t == 0 ? 1 : sin(M_PI*t)/(M_PI*t);
+			m->tp_filter[p][TRUE_PEAK_TAPS - 1 - i] = sinc*(x*x < 1 ? bessel_i0(5*sqrt(1 - x*x))/bessel_i0(5) : 0);
+		}
+	memset(m->k_state, 0, sizeof m->k_state);
+	memset(m->tp_history, 0, sizeof m->tp_history);
+	memset(m->energy, 0, sizeof m->energy);
+	memset(m->dc_sum, 0, sizeof m->dc_sum);
+	m->tp_position = 0;
+	m->sub_block_length = track_output_frequency/10;
+	m->sub_block_samples = 0;
+	m->n_sub_blocks = 0;
+	m->n_samples = m->clipped = 0;
+	m->peak = m->true_peak = 0;
+}
+
+static void
+meter_audio(sink_t *s, unsigned char *data, int n, frame_info_t *info) {
+	meter_t *m = s->state;
+	float f[MAX_OUTPUT_FRAME_SAMPLES];
+	int channels = info->nChannels;
+	int i, c, k, p, n_samples = sink_audio_to_float(data, n, f);
+
+	for (i = 0; i < n_samples; i += channels) {
+		for (c = 0; c < channels; c++) {
+			double x = f[i + c], y, *z = m->k_state[c];
+			float a = fabsf(f[i + c]), *h = m->tp_history[c];
+			/* transposed direct form II */
+			y = m->k_b[0]*x + z[0];
+			z[0] = m->k_b[1]*x - m->k_a[1]*y + z[1];
+			z[1] = m->k_b[2]*x - m->k_a[2]*y + z[2];
+			z[2] = m->k_b[3]*x - m->k_a[3]*y + z[3];
+			z[3] = m->k_b[4]*x - m->k_a[4]*y;
+			m->energy[c] += y*y;
+			m->dc_sum[c] += x;
+			if (a >= 32767.0f/32768)
+				m->clipped++;
+			if (a > m->peak)
+				m->peak = a;
+			h[m->tp_position] = h[m->tp_position + TRUE_PEAK_TAPS] = f[i + c];
+			h += m->tp_position + 1;
+			for (p = 0; p < 4; p++) {
+				const float *t = m->tp_filter[p];
+				float v = 0;
+				for (k = 0; k < TRUE_PEAK_TAPS; k++)
+					v += t[k]*h[k];
+				if (fabsf(v) > m->true_peak)
+					m->true_peak = fabsf(v);
+			}
+		}
+		if (++m->tp_position == TRUE_PEAK_TAPS)
+			m->tp_position = 0;
+		if (++m->sub_block_samples == m->sub_block_length) {
+			double e = 0;
+			for (c = 0; c < channels; c++) {
+				e += m->energy[c]/m->sub_block_length;
+				m->energy[c] = 0;
+			}
+			if (m->n_sub_blocks == m->sub_blocks_size) {
+				m->sub_blocks_size = 2*m->sub_blocks_size + 1024;
+				if ((m->sub_blocks = realloc(m->sub_blocks, m->sub_blocks_size*sizeof *m->sub_blocks)) == NULL)
+					die("out of memory");
+			}
+			m->sub_blocks[m->n_sub_blocks++] = e;
+			m->sub_block_samples = 0;
+		}
+	}
+	m->n_samples += n_samples/channels;
+}
+
+static double
+loudness(double energy) {
+	return -0.691 + 10*log10(energy);
+}
+
+/*
+ * gated loudness of the 400ms blocks (4 sub-blocks, overlapping by 3)
+ */
+static double
+meter_integrated_loudness(meter_t *m) {
+	double sum = 0, threshold;
+	int i, n = 0, pass;
+
+	for (pass = 0; pass < 2; pass++) {
+		threshold = pass ? loudness(sum/n) - 10 : -70;
+		sum = 0;
+		n = 0;
+		for (i = 0; i + 4 <= m->n_sub_blocks; i++) {
+			double e = (m->sub_blocks[i] + m->sub_blocks[i+1] + m->sub_blocks[i+2] + m->sub_blocks[i+3])/4;
+			if (loudness(e) > threshold) {
+				sum += e;
+				n++;
+			}
+		}
+		if (n == 0)
+			return -HUGE_VAL;
+	}
+	return loudness(sum/n);
+}
+
+static void
+meter_details(sink_t *s, FILE *fp) {
+	meter_t *m = s->state;
+	double lufs = meter_integrated_loudness(m);
+	float true_peak = m->true_peak > m->peak ? m->true_peak : m->peak;
+	int c;
+
+	/* a silent track has no level, reported as -inf explicitly rather than by log10(0) */
+	if (isinf(lufs))
+		fprintf(fp, "Loudness: -inf LUFS\n");
+	else
+		fprintf(fp, "Loudness: %.1f LUFS\n", lufs);
+	if (m->peak == 0)
+		fprintf(fp, "Sample peak: -inf dBFS\nTrue peak: -inf dBTP\n");
+	else {
+		fprintf(fp, "Sample peak: %.2f dBFS\n", 20*log10(m->peak));
+		fprintf(fp, "True peak: %.2f dBTP\n", 20*log10(true_peak));
+	}
+	fprintf(fp, "DC offset:");
+	for (c = 0; c < track_info.nChannels; c++)
+		fprintf(fp, " %.6f", m->n_samples ? m->dc_sum[c]/m->n_samples : 0);
+	fprintf(fp, "\n");
+	fprintf(fp, "Clipped samples: %ld\n", m->clipped);
+}
+
+void
+add_meter_sink(void) {
+	meter_t *m;
+	sink_t *s;
+
+	if ((m = calloc(1, sizeof *m)) == NULL)
+		die("out of memory");
+	s = add_sink("meter", meter_open, meter_audio, NULL, m);
+	s->details = meter_details;
+}
+
+/*
+ * waveform overview - min/max of blocks of samples at several resolutions
+ */
+#define PEAKS_LEVELS 5
+#define PEAKS_BLOCK 256                     /* samples per block at finest level, x4 per level */
+
+typedef struct peaks {
+	int channels;
+	float min[4], max[4];                   /* of current block */
+	int block_samples;
+	short *blocks;                          /* finest level - min & max of each channel */
+	int n_blocks, blocks_size;              /* blocks_size in shorts */
+	long n_samples;
+} peaks_t;
+
+static void
+peaks_open(sink_t *s, frame_info_t *info) {
+	peaks_t *p = s->state;
+	int c;
+
+	p->channels = info->nChannels;
+	for (c = 0; c < p->channels; c++) {
+		p->min[c] = 1;
+		p->max[c] = -1;
+	}
+	p->block_samples = 0;
+	p->n_blocks = 0;
+	p->n_samples = 0;
+}
+
+static short
+peaks_value(float f) {
+	f *= 32768;
+	return f >= 32767 ? 32767 : f <= -32768 ? -32768 : (short)lrintf(f);
+}
+
+static void
+peaks_end_block(peaks_t *p) {
+	short *b;
+	int c;
+
+	if ((p->n_blocks + 1)*2*p->channels > p->blocks_size) {
+		p->blocks_size = 2*p->blocks_size + 32768;
+		if ((p->blocks = realloc(p->blocks, p->blocks_size*sizeof *p->blocks)) == NULL)
+			die("out of memory");
+	}
+	b = p->blocks + p->n_blocks++*2*p->channels;
+	for (c = 0; c < p->channels; c++) {
+		b[2*c] = peaks_value(p->min[c]);
+		b[2*c+1] = peaks_value(p->max[c]);
+		p->min[c] = 1;
+		p->max[c] = -1;
+	}
+	p->block_samples = 0;
+}
+
+static void
+peaks_audio(sink_t *s, unsigned char *data, int n, frame_info_t *info) {
+	peaks_t *p = s->state;
+	float f[MAX_OUTPUT_FRAME_SAMPLES];
+	int channels = p->channels;
+	int i, c, n_samples = sink_audio_to_float(data, n, f);
+
+	for (i = 0; i < n_samples; ) {
+		/* reduce the part of the frame in the current block */
+		int end = i + (PEAKS_BLOCK - p->block_samples)*channels;
+		if (end > n_samples)
+			end = n_samples;
+		for (c = 0; c < channels; c++) {
+			float lo = p->min[c], hi = p->max[c];
+			int j;
+			for (j = i + c; j < end; j += channels) {
+				lo = f[j] < lo ? f[j] : lo;
+				hi = f[j] > hi ? f[j] : hi;
+			}
+			p->min[c] = lo;
+			p->max[c] = hi;
+		}
+		p->block_samples += (end - i)/channels;
+		i = end;
+		if (p->block_samples == PEAKS_BLOCK)
+			peaks_end_block(p);
+	}
+	p->n_samples += n_samples/channels;
+}
+
+static void
+peaks_close(sink_t *s, int keep) {
+	peaks_t *p = s->state;
+	char filename[MAX_FILENAME], h[32 + 8*PEAKS_LEVELS];
+	int level, n_blocks[PEAKS_LEVELS], n, i, j, c;
+	short *b;
+	FILE *fp;
+
+	if (p->block_samples)
+		peaks_end_block(p);
+	if (!keep)
+		return;
+	create_filename("peaks", filename);
+	if ((fp = fopen(filename, "w")) == NULL)
+		die("Can not open %s", filename);
+	memcpy(h, "DATPEAKS", 8);
+	intcpy(h + 8, 1);
+	intcpy(h + 12, track_output_frequency);
+	intcpy(h + 16, p->channels);
+	intcpy(h + 20, PEAKS_LEVELS);
+	intcpy(h + 24, p->n_samples & 0xffffffff);
+	intcpy(h + 28, p->n_samples >> 32);
+	for (level = 0, n = p->n_blocks; level < PEAKS_LEVELS; level++, n = (n + 3)/4) {
+		n_blocks[level] = n;
+		intcpy(h + 32 + 8*level, PEAKS_BLOCK << 2*level);
+		intcpy(h + 36 + 8*level, n);
+	}
+	fwrite(h, 1, sizeof h, fp);
+	/* each level is reduced in place from the one before */
+	for (level = 0; level < PEAKS_LEVELS; level++) {
+		if (level > 0) {
+			for (i = 0; i < n_blocks[level]; i++) {
+				short *d = p->blocks + i*2*p->channels;
+				b = p->blocks + 4*i*2*p->channels;
+				for (c = 0; c < 2*p->channels; c += 2) {
+					short lo = b[c], hi = b[c+1];
+					for (j = 1; j < 4 && 4*i + j < n_blocks[level-1]; j++) {
+						short *e = b + j*2*p->channels;
+						lo = e[c] < lo ? e[c] : lo;
+						hi = e[c+1] > hi ? e[c+1] : hi;
+					}
+					d[c] = lo;
+					d[c+1] = hi;
+				}
+			}
+		}
+		for (i = 0; i < 2*p->channels*n_blocks[level]; i++) {
+			putc(p->blocks[i] & 0xff, fp);
+			putc((p->blocks[i] >> 8) & 0xff, fp);
+		}
+	}
+	if (fclose(fp) != 0)
+		die("Can not write %s", filename);
+	note_output_file(filename, NULL);
+}
+
+void
+add_peaks_sink(void) {
+	peaks_t *p;
+
+	if ((p = calloc(1, sizeof *p)) == NULL)
+		die("out of memory");
+	add_sink("peaks", peaks_open, peaks_audio, peaks_close, p);
+}
+
+/*
+ * spectrogram - average power spectrum of each column_seconds of audio
+ */
+#define SPECTROGRAM_FFT 512
+#define SPECTROGRAM_BANDS (SPECTROGRAM_FFT/2)
+
+typedef struct spectrogram {
+	double column_seconds;
+	float window[SPECTROGRAM_FFT];
+	float cos_table[SPECTROGRAM_FFT/2], sin_table[SPECTROGRAM_FFT/2];
+	float input[SPECTROGRAM_FFT];           /* mono */
+	int n_input;
+	double power[SPECTROGRAM_BANDS];        /* summed over the current column */
+	int n_ffts, column_ffts;
+	unsigned char *columns;                 /* SPECTROGRAM_BANDS bytes each */
+	int n_columns, columns_size;
+} spectrogram_t;
+
+/*
+ * in-place iterative radix-2 FFT of n real samples, real & imaginary parts
+ * in separate arrays so the butterflies of each pass are independent
+ * cos_table & sin_table hold cos & sin of 2*pi*i/n for i < n/2
+ */
+static void
+fft(float *restrict re, float *restrict im, int n, const float *cos_table, const float *sin_table) {
+	int i, j, k, half, step;
+
+	for (i = 1, j = 0; i < n; i++) {
+		int bit = n >> 1;
+		for (; j & bit; bit >>= 1)
+			j ^= bit;
+		j ^= bit;
+		if (i < j) {
+			float t = re[i];
+			re[i] = re[j];
+			re[j] = t;
+		}
+	}
+	memset(im, 0, n*sizeof *im);
+	for (half = 1, step = n/2; half < n; half *= 2, step /= 2)
+		for (i = 0; i < n; i += 2*half)
+			for (k = 0; k < half; k++) {
+				float c = cos_table[k*step], s = sin_table[k*step];
+				float *ar = re + i, *ai = im + i, *br = re + i + half, *bi = im + i + half;
+				float tr = br[k]*c + bi[k]*s, ti = bi[k]*c - br[k]*s;
+				br[k] = ar[k] - tr;
+				bi[k] = ai[k] - ti;
+				ar[k] += tr;
+				ai[k] += ti;
+			}
+}
+
+static void
+spectrogram_end_column(spectrogram_t *g) {
+	unsigned char *column;
+	int i;
+
+	if (g->n_columns == g->columns_size) {
+		g->columns_size = 2*g->columns_size + 1024;
+		if ((g->columns = realloc(g->columns, g->columns_size*SPECTROGRAM_BANDS)) == NULL)
+			die("out of memory");
+	}
+	column = g->columns + g->n_columns++*SPECTROGRAM_BANDS;
+	for (i = 0; i < SPECTROGRAM_BANDS; i++) {
+		/* relative to a full scale sine through the Hann window */
+		double db = 10*log10(g->power[i]/g->n_ffts/((SPECTROGRAM_FFT/4.0)*(SPECTROGRAM_FFT/4.0)) + 1e-30);
+		column[i] = db <= -120 ? 0 : db >= 0 ? 255 : (int)((db + 120)*255/120);
+		g->power[i] = 0;
+	}
+	g->n_ffts = 0;
+}
+
+static void
+spectrogram_open(sink_t *s, frame_info_t *info) {
+	spectrogram_t *g = s->state;
+	int i;
+
+	for (i = 0; i < SPECTROGRAM_FFT; i++)
+		g->window[i] = 0.5 - 0.5*cos(2*M_PI*i/SPECTROGRAM_FFT);
+	for (i = 0; i < SPECTROGRAM_FFT/2; i++) {
+		g->cos_table[i] = cos(2*M_PI*i/SPECTROGRAM_FFT);
+		g->sin_table[i] = sin(2*M_PI*i/SPECTROGRAM_FFT);
+	}
+	memset(g->power, 0, sizeof g->power);
+	g->n_input = 0;
+	g->n_ffts = 0;
+	g->column_ffts = g->column_seconds*track_output_frequency/SPECTROGRAM_FFT;
+	if (g->column_ffts < 1)
+		g->column_ffts = 1;
+	g->n_columns = 0;
+}
+
+static void
+spectrogram_audio(sink_t *s, unsigned char *data, int n, frame_info_t *info) {
+	spectrogram_t *g = s->state;
+	float f[MAX_OUTPUT_FRAME_SAMPLES], re[SPECTROGRAM_FFT], im[SPECTROGRAM_FFT];
+	int channels = info->nChannels;
+	int i, c, n_samples = sink_audio_to_float(data, n, f);
+
+	for (i = 0; i < n_samples; i += channels) {
+		float m = 0;
+		for (c = 0; c < channels; c++)
+			m += f[i + c];
+		g->input[g->n_input++] = m/channels;
+		if (g->n_input < SPECTROGRAM_FFT)
+			continue;
+		for (c = 0; c < SPECTROGRAM_FFT; c++)
+			re[c] = g->input[c]*g->window[c];
+		fft(re, im, SPECTROGRAM_FFT, g->cos_table, g->sin_table);
+		for (c = 0; c < SPECTROGRAM_BANDS; c++)
+			g->power[c] += re[c]*re[c] + im[c]*im[c];
+		g->n_input = 0;
+		if (++g->n_ffts == g->column_ffts)
+			spectrogram_end_column(g);
+	}
+}
+
+static void
+spectrogram_close(sink_t *s, int keep) {
+	spectrogram_t *g = s->state;
+	char filename[MAX_FILENAME];
+	int i, j;
+	FILE *fp;
+
+	if (g->n_ffts)
+		spectrogram_end_column(g);
+	if (!keep || g->n_columns == 0)
+		return;
+	create_filename("pgm", filename);
+	if ((fp = fopen(filename, "w")) == NULL)
+		die("Can not open %s", filename);
+	fprintf(fp, "P5\n%d %d\n255\n", g->n_columns, SPECTROGRAM_BANDS);
+	for (i = SPECTROGRAM_BANDS - 1; i >= 0; i--)
+		for (j = 0; j < g->n_columns; j++)
+			putc(g->columns[j*SPECTROGRAM_BANDS + i], fp);
+	if (fclose(fp) != 0)
+		die("Can not write %s", filename);
+	note_output_file(filename, NULL);
+}
+
+void
+add_spectrogram_sink(double column_seconds) {
+	spectrogram_t *g;
+
+	if ((g = calloc(1, sizeof *g)) == NULL)
+		die("out of memory");
+	g->column_seconds = column_seconds;
+	add_sink("spectrogram", spectrogram_open, spectrogram_audio, spectrogram_close, g);
+}
+
+/*
+ * audio fingerprint - for each 40ms the signs of the change since the last
+ * 40ms of the energy differences between adjacent bands
+ * (as Haitsma & Kalker's "A Highly Robust Audio Fingerprinting System")
+ * computed from 250ms windows of mono audio decimated to about 8khz
+ */
+#define FINGERPRINT_FFT 2048
+#define FINGERPRINT_BANDS 33
+#define FINGERPRINT_MS 40
+#define FINGERPRINT_RATE 8000               /* approximate after decimation */
+
+typedef struct fingerprint {
+	int decimation, window_length, hop;
+	float window[FINGERPRINT_FFT];
+	float cos_table[FINGERPRINT_FFT/2], sin_table[FINGERPRINT_FFT/2];
+	int band_start[FINGERPRINT_BANDS + 1];  /* FFT bin */
+	float input[FINGERPRINT_FFT];           /* ring buffer of decimated mono audio */
+	int n_input, input_position, since_hop;
+	float sum;                              /* of samples being decimated */
+	int n_sum;
+	double previous[FINGERPRINT_BANDS];
+	int have_previous;
+	unsigned int *values;
+	int n_values, values_size;
+} fingerprint_t;
+
+static void
+fingerprint_open(sink_t *s, frame_info_t *info) {
+	fingerprint_t *p = s->state;
+	int i, rate;
+
+	p->decimation = (track_output_frequency + FINGERPRINT_RATE/2)/FINGERPRINT_RATE;
+	if (p->decimation < 1)
+		p->decimation = 1;
+	rate = track_output_frequency/p->decimation;
+	p->window_length = rate/4;
+	if (p->window_length > FINGERPRINT_FFT)
+		p->window_length = FINGERPRINT_FFT;
+	p->hop = rate*FINGERPRINT_MS/1000;
+	for (i = 0; i < p->window_length; i++)
+		p->window[i] = 0.5 - 0.5*cos(2*M_PI*i/p->window_length);
+	for (i = 0; i < FINGERPRINT_FFT/2; i++) {
+		p->cos_table[i] = cos(2*M_PI*i/FINGERPRINT_FFT);
+		p->sin_table[i] = sin(2*M_PI*i/FINGERPRINT_FFT);
+	}
+	/* logarithmically spaced bands */
+	for (i = 0; i <= FINGERPRINT_BANDS; i++)
+		p->band_start[i] = 300*pow(2000.0/300, i/(double)FINGERPRINT_BANDS)*FINGERPRINT_FFT/rate + 0.5;
+	p->n_input = 0;
+	p->input_position = 0;
+	p->since_hop = 0;
+	p->sum = 0;
+	p->n_sum = 0;
+	p->have_previous = 0;
+	p->n_values = 0;
+}
+
+static void
+fingerprint_window(fingerprint_t *p) {
+	float re[FINGERPRINT_FFT], im[FINGERPRINT_FFT];
+	double energy[FINGERPRINT_BANDS];
+	unsigned int value = 0;
+	int i, b;
+
+	for (i = 0; i < p->window_length; i++)
+		re[i] = p->input[(p->input_position + i) % p->window_length]*p->window[i];
+	memset(re + p->window_length, 0, (FINGERPRINT_FFT - p->window_length)*sizeof *re);
+	fft(re, im, FINGERPRINT_FFT, p->cos_table, p->sin_table);
+	for (b = 0; b < FINGERPRINT_BANDS; b++) {
+		energy[b] = 0;
+		for (i = p->band_start[b]; i < p->band_start[b + 1]; i++)
+			energy[b] += re[i]*re[i] + im[i]*im[i];
+	}
+	if (p->have_previous) {
+		for (b = 0; b < FINGERPRINT_BANDS - 1; b++)
+			if (energy[b] - energy[b + 1] - (p->previous[b] - p->previous[b + 1]) > 0)
+				value |= 1u << b;
+		if (p->n_values == p->values_size) {
+			p->values_size = 2*p->values_size + 4096;
+			if ((p->values = realloc(p->values, p->values_size*sizeof *p->values)) == NULL)
+				die("out of memory");
+		}
+		p->values[p->n_values++] = value;
+	}
+	memcpy(p->previous, energy, sizeof energy);
+	p->have_previous = 1;
+}
+
+static void
+fingerprint_audio(sink_t *s, unsigned char *data, int n, frame_info_t *info) {
+	fingerprint_t *p = s->state;
+	float f[MAX_OUTPUT_FRAME_SAMPLES];
+	int channels = info->nChannels;
+	int i, c, n_samples = sink_audio_to_float(data, n, f);
+
+	for (i = 0; i < n_samples; i += channels) {
+		for (c = 0; c < channels; c++)
+			p->sum += f[i + c];
+		if (++p->n_sum < p->decimation)
+			continue;
+		p->input[p->input_position] = p->sum/(p->decimation*channels);
+		p->input_position = (p->input_position + 1) % p->window_length;
+		if (p->n_input < p->window_length)
+			p->n_input++;
+		p->sum = 0;
+		p->n_sum = 0;
+		if (p->n_input == p->window_length && ++p->since_hop >= p->hop) {
+			fingerprint_window(p);
+			p->since_hop = 0;
+		}
+	}
+}
+
+static void
+fingerprint_close(sink_t *s, int keep) {
+	fingerprint_t *p = s->state;
+	char filename[MAX_FILENAME], h[20], v[4];
+	FILE *fp;
+	int i;
+
+	if (!keep)
+		return;
+	create_filename("fingerprint", filename);
+	if ((fp = fopen(filename, "w")) == NULL)
+		die("Can not open %s", filename);
+	memcpy(h, "DATFPRNT", 8);
+	intcpy(h + 8, 1);
+	intcpy(h + 12, FINGERPRINT_MS);
+	intcpy(h + 16, p->n_values);
+	fwrite(h, 1, sizeof h, fp);
+	for (i = 0; i < p->n_values; i++) {
+		intcpy(v, p->values[i]);
+		fwrite(v, 1, sizeof v, fp);
+	}
+	if (fclose(fp) != 0)
+		die("Can not write %s", filename);
+	note_output_file(filename, NULL);
+}
+
+void
+add_fingerprint_sink(void) {
+	fingerprint_t *p;
+
+	if ((p = calloc(1, sizeof *p)) == NULL)
+		die("out of memory");
+	add_sink("fingerprint", fingerprint_open, fingerprint_audio, fingerprint_close, p);
+}
+
+/*
+ * a sink which passes batches of frames to a stage loaded from a shared library
+ */
+typedef struct stage_sink {
+	read_dat_stage_t *stage;
+	read_dat_track_t track;
+	char filename[MAX_FILENAME];
+	int n;                                  // frames in batch
+	unsigned char *audio[READ_DAT_STAGE_BATCH];
+	int n_bytes[READ_DAT_STAGE_BATCH];
+	frame_info_t info[READ_DAT_STAGE_BATCH];
+} stage_sink_t;
+
+static void
+stage_sink_flush(stage_sink_t *t) {
+	if (t->n && t->stage->frames)
+		t->stage->frames(t->stage->state, t->n, (const unsigned char *const *)t->audio, t->n_bytes, t->info);
+	t->n = 0;
+}
+
+static void
+stage_sink_open(sink_t *s, frame_info_t *info) {
+	stage_sink_t *t = s->state;
+
+	strcpy(t->filename, track_filename);
+	t->track.filename = t->filename;
+	t->track.sampling_frequency = track_output_frequency;
+	t->track.channels = track_info.nChannels;
+	t->track.bytes_per_sample = output_bytes_per_sample[output_format];
+	t->track.is_float = output_format == OUTPUT_F32;
+	t->track.first_frame = *info;
+	t->n = 0;
+	if (t->stage->open_track)
+		t->stage->open_track(t->stage->state, &t->track);
+}
+
+static void
+stage_sink_audio(sink_t *s, unsigned char *data, int n, frame_info_t *info) {
+	stage_sink_t *t = s->state;
+
+	memcpy(t->audio[t->n], data, n);
+	t->n_bytes[t->n] = n;
+	t->info[t->n++] = *info;
+	if (t->n == READ_DAT_STAGE_BATCH)
+		stage_sink_flush(t);
+}
+
+static void
+stage_sink_close(sink_t *s, int keep) {
+	stage_sink_t *t = s->state;
+	char suffix[16];
+
+	stage_sink_flush(t);
+	/* the name the track's WAV file will have when closed */
+	output_suffix(0, suffix);
+	create_filename(suffix, t->filename);
+	if (t->stage->close_track)
+		t->stage->close_track(t->stage->state, &t->track, keep);
+}
+
+static void
+stage_sink_details(sink_t *s, FILE *fp) {
+	stage_sink_t *t = s->state;
+
+	if (t->stage->details)
+		t->stage->details(t->stage->state, fp);
+}
+
+/*
+ * load a stage from library[:argument]
+ */
+void
+add_stage(char *specification, int inline_stage) {
+	read_dat_stage_t *(*get_stage)(const char *);
+	char *library = strdup(specification), *argument;
+	stage_sink_t *t;
+	sink_t *s;
+	void *handle;
+	int i;
+
+	if ((argument = strchr(library, ':')) != NULL)
+		*argument++ = '\0';
+	if ((handle = dlopen(library, RTLD_NOW)) == NULL)
+		die("Can not load stage %s: %s", library, dlerror());
+	if ((get_stage = (read_dat_stage_t *(*)(const char *))dlsym(handle, "read_dat_stage")) == NULL)
+		die("%s does not define read_dat_stage", library);
+	if ((t = calloc(1, sizeof *t)) == NULL)
+		die("out of memory");
+	if ((t->stage = get_stage(argument)) == NULL)
+		die("stage %s can not run", specification);
+	if (t->stage->version != READ_DAT_STAGE_VERSION)
+		die("stage %s is for version %d of read_dat_stage.h not %d", library, t->stage->version, READ_DAT_STAGE_VERSION);
+	for (i = 0; i < READ_DAT_STAGE_BATCH; i++)
+		if ((t->audio[i] = malloc(MAX_OUTPUT_FRAME_BYTES)) == NULL)
+			die("out of memory");
+	s = add_sink(t->stage->name ? (char *)t->stage->name : library, stage_sink_open, stage_sink_audio, stage_sink_close, t);
+	s->details = stage_sink_details;
+	s->inline_sink = inline_stage;
+	dp(2, "Loaded stage %s from %s\n", s->name, library);
+}
+
+/*
+ * suffix of the k'th of the files a track is written to
+ */
+void
+output_suffix(int k, char *suffix) {
+	if (track_n_outputs == 1)
+		strcpy(suffix, "wav");
+	else if (track_n_outputs == 2)
+		sprintf(suffix, "ch%d-%d.wav", 2*k + 1, 2*k + 2);
+	else
+		sprintf(suffix, "ch%d.wav", k + 1);
+}
+
+void
+create_filename(char *suffix, char *filename) {
+	if (track_first_date_time > 0) {
+		struct tm *t = localtime(&track_first_date_time);
+		if (snprintf(filename, MAX_FILENAME, "%s%4d-%02d-%02d-%02d-%02d-%02d.%s", filename_prefix, t->tm_year+1900, t->tm_mon+1, t->tm_mday, t->tm_hour, t->tm_min, t->tm_sec, suffix) == -1)
+			die("filename too long");
+	} else {
+		if (snprintf(filename, MAX_FILENAME, "%s%d.%s", filename_prefix, track_number, suffix) == -1)
+			die("filename too long");
+	}
+}
+
+/*
+ * start a new track
+ */
+void
+open_track(frame_info_t *info) {
+	struct timespec start;
+	char *header, suffix[16];
+	int header_length, k;
+	if (track_fd != -1)
+		die("internal error open_track previous track not closed");
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	track_nSamples = 0;
+	track_invalid_frames = 0;
+	track_copy_failed = 0;
+	track_info = *info;
+	track_first_frame = info->frame_number;
+	track_first_date_time = info->date_time;
+	track_n_outputs = info->nChannels == 4 ? split_channels : 1;
+	track_deemphasis = de_emphasis && info->emphasis == 1;
+	if (track_deemphasis)
+		start_deemphasis(info->sampling_frequency);
+	track_resampling = resample_frequency && resample_frequency != info->sampling_frequency;
+	track_output_frequency = track_resampling ? resample_frequency : info->sampling_frequency;
+	if (track_resampling)
+		start_resampling(info->sampling_frequency, resample_frequency);
+	track_filtered = track_deemphasis || track_resampling;
+	if (shard_manifest_fp) {
+		open_fragment();
+		track_write_offset = 0;
+		note_consumer_activity("open_track", &start);
+		return;
+	}
+	/*
+	 * header will be re-written when track is finished to add correct number of samples
+	 */ 
+	header = get_WAV_header(track_nSamples, info->nChannels/track_n_outputs, track_output_frequency, &header_length);
+	for (k = 0; k < track_n_outputs; k++) {
+		output_suffix(k, suffix);
+		create_filename(suffix, track_output_filename[k]);
+		dp(1, "Creating %s\n", track_output_filename[k]);
+		if ((track_output_fd[k] = open(track_output_filename[k], O_CREAT|O_WRONLY|O_TRUNC, 0600)) < 0)
+			die("Can not create  file %s", track_output_filename[k]);
+		if (write(track_output_fd[k], header, header_length) != header_length)
+			die("Can not write to file");
+		if (hash_files) {
+			/* the header is re-written in the hash too when the track is closed */
+			track_output_hash[k] = dat_hash_new_rewritable();
+			dat_hash_update(track_output_hash[k], header, header_length);
+		}
+	}
+	track_fd = track_output_fd[0];
+	strcpy(track_filename, track_output_filename[0]);
+	track_write_offset = header_length;
+	create_filename("invalid_frames", track_invalid_frames_filename);
+	dp(1, "Creating %s\n", track_invalid_frames_filename);
+	if ((track_invalid_frames_fp = fopen(track_invalid_frames_filename, "w")) == NULL)
+		die("Can not create file", track_invalid_frames_filename);
+	if (n_sinks)
+		send_to_sinks(SINK_OPEN, NULL, 0, info, 0);
+	note_consumer_activity("open_track", &start);
+}
+
+/*
+ * in shard mode tracks are written as headerless fragments, or
+ * discarded while finding tracks in progress at the start of the shard
+ */
+void
+open_fragment(void) {
+	track_copy_failed = 0;
+	if (shard_warming_up) {
+		if ((track_fd = open("/dev/null", O_WRONLY)) < 0)
+			die("Can not open /dev/null");
+		track_invalid_frames_fp = NULL;
+		return;
+	}
+	if (snprintf(fragment_filename, MAX_FILENAME, "%sshard%d.%d.frag", filename_prefix, shard_first_frame, shard_n_fragments++) >= MAX_FILENAME)
+		die("filename too long");
+	dp(1, "Creating %s\n", fragment_filename);
+	if ((track_fd = open(fragment_filename, O_CREAT|O_WRONLY|O_TRUNC, 0600)) < 0)
+		die("Can not create file %s", fragment_filename);
+	track_invalid_frames_fp = shard_manifest_fp;
+	fragment_continued = 0;
+	fragment_first_frame = track_first_frame;
+	fragment_first_nSamples = track_nSamples;
+}
+
+/*
+ * record a fragment in the manifest,
+ * ends_track is 0 if the track continues into the next shard
+ */
+void
+close_fragment(int ends_track) {
+	wait_for_decode_threads();
+	close(track_fd);
+	if (shard_warming_up)
+		return;
+	flush_invalid_frames();
+	fprintf(shard_manifest_fp, "fragment %s %d %d %d %d %d %d %d %d %d %d %ld %ld\n",
+		fragment_filename, fragment_continued, ends_track, fragment_first_frame, track_info.frame_number,
+		track_nSamples - fragment_first_nSamples, track_info.sampling_frequency, track_info.nChannels,
+		track_info.encoding, track_info.emphasis, track_info.program_number,
+		(long)track_first_date_time, (long)track_info.date_time);
+	track_invalid_frames_fp = NULL;
+}
+
+/*
+ * number of lead-in frames (pno 0x0BB) at the start of the image
+ * which process_file numbers frames from - replicated here so shards
+ * number frames the same as a single run
+ */
+int
+lead_in_frames(int fd) {
+	unsigned char subid[4];
+	int frame, lead_in = 0;
+
+	for (frame = 1; frame - lead_in < 4; frame++) {
+		if (pread(fd, subid, sizeof subid, (off_t)frame*FRAME_SIZE + SUBID_OFFSET) != sizeof subid)
+			break;
+		if (((((subid[1] >> 4) & 0xf) << 8) | subid[2]) == 0x0bb)
+			lead_in = frame + 1;
+	}
+	return lead_in;
+}
+
+void
+start_shard(int fd) {
+	char manifest_filename[MAX_FILENAME];
+	struct stat s;
+	int warm_up_frame = shard_first_frame - shard_overlap;
+
+	if (fstat(fd, &s) < 0 || !S_ISREG(s.st_mode))
+		die("shards can only be extracted from an uncompressed image file");
+	if (snprintf(manifest_filename, MAX_FILENAME, "%sshard%d.manifest", filename_prefix, shard_first_frame) >= MAX_FILENAME)
+		die("filename too long");
+	if ((shard_manifest_fp = fopen(manifest_filename, "w")) == NULL)
+		die("Can not create %s", manifest_filename);
+	fprintf(shard_manifest_fp, "shard %d %d\n", shard_first_frame, shard_last_frame);
+	fprintf(shard_manifest_fp, "format %s\n", output_format_names[output_format]);
+	if (de_emphasis)
+		fprintf(shard_manifest_fp, "de_emphasis\n");
+	shard_lead_in = lead_in_frames(fd);
+	shard_n_fragments = 0;
+	/* frames at the very start of the image are numbered specially - so don't seek into them */
+	if (warm_up_frame < 8)
+		warm_up_frame = 0;
+	seek_n_frames = warm_up_frame;
+	shard_warming_up = shard_first_frame > 0;
+	dp(1, "Shard frames %d-%d reading from frame %d\n", shard_first_frame, shard_last_frame - 1, warm_up_frame);
+}
+
+/*
+ * called with the position in the image of each frame before it is processed,
+ * returns 0 when the end of the shard is reached
+ */
+int
+shard_position(int image_frame) {
+	if (!shard_manifest_fp)
+		return 1;
+	if (image_frame >= shard_last_frame)
+		return 0;
+	if (shard_warming_up && image_frame >= shard_first_frame) {
+		shard_warming_up = 0;
+		if (track_fd != -1) {
+			/* track in progress - continue it in a fragment */
+			wait_for_decode_threads();
+			close(track_fd);
+			track_first_frame = image_frame - shard_lead_in;
+			open_fragment();
+			track_write_offset = 0;
+			fragment_continued = 1;
+			track_first_date_time = -1;
+			track_invalid_frames = 0;
+			track_first_invalid_frame = -1;
+			track_last_invalid_frame = -1;
+		}
+	}
+	return 1;
+}
+
+void
+end_shard(void) {
+	if (!shard_manifest_fp)
+		return;
+	if (track_fd != -1) {
+		close_fragment(0);
+		track_fd = -1;
+	}
+	fprintf(shard_manifest_fp, "end\n");
+	if (fclose(shard_manifest_fp) != 0)
+		die("Can not write manifest");
+	shard_manifest_fp = NULL;
+}
+
+/*
+ * append the contents of filename to out_fd, in the kernel if possible
+ * unless they are being hashed with h
+ */
+void
+append_file(int out_fd, char *filename, dat_hash_t *h) {
+	char buffer[65536];
+	struct stat s;
+	off_t remaining;
+	ssize_t n;
+	int in_fd;
+
+	if ((in_fd = open(filename, O_RDONLY)) < 0 || fstat(in_fd, &s) < 0)
+		die("Can not open %s", filename);
+	for (remaining = s.st_size; remaining > 0 && !h; remaining -= n)
+		if ((n = copy_file_range(in_fd, NULL, out_fd, NULL, remaining, 0)) <= 0)
+			break;
+	while (remaining > 0) {
+		if ((n = read(in_fd, buffer, sizeof buffer)) <= 0)
+			die("read of %s failed", filename);
+		if (write(out_fd, buffer, n) != n)
+			die("write");
+		if (h)
+			dat_hash_update(h, buffer, n);
+		remaining -= n;
+	}
+	close(in_fd);
+}
+
+static char (*stitch_fragments)[MAX_FILENAME] = NULL;
+static int stitch_n_fragments = 0;
+static int (*stitch_invalid)[2] = NULL;
+static int stitch_n_invalid = 0;
+
+/*
+ * write a track assembled from fragments, mirroring close_track
+ */
+void
+finish_stitched_track(void) {
+	double track_length = track_nSamples/(double)track_info.sampling_frequency;
+	dat_hash_t *h = NULL;
+	char *header;
+	int i, header_length;
+
+	if (track_length < min_track_seconds) {
+		dp(1, "Discarding %d fragments because %.2fs long - minimum track length %.2fs\n", stitch_n_fragments, track_length, min_track_seconds);
+	} else {
+		create_filename("wav", track_filename);
+		dp(1, "Creating %s from %d fragments\n", track_filename, stitch_n_fragments);
+		if ((track_fd = open(track_filename, O_CREAT|O_WRONLY|O_TRUNC, 0600)) < 0)
+			die("Can not create  file %s", track_filename);
+		header = get_WAV_header(track_nSamples, track_info.nChannels, track_info.sampling_frequency, &header_length);
+		if (write(track_fd, header, header_length) != header_length)
+			die("Can not write to file");
+		if (hash_files) {
+			h = dat_hash_new();
+			dat_hash_update(h, header, header_length);
+		}
+		for (i = 0; i < stitch_n_fragments; i++)
+			append_file(track_fd, stitch_fragments[i], h);
+		track_deemphasis = de_emphasis && track_info.emphasis == 1;
+		if (close(track_fd) < 0)
+			die("Can not write to file");
+		track_fd = -1;
+		adjust_creation_time(track_filename);
+		note_output_file(track_filename, h);
+		write_track_details();
+		if (track_invalid_frames) {
+			create_filename("invalid_frames", track_invalid_frames_filename);
+			if ((track_invalid_frames_fp = fopen(track_invalid_frames_filename, "w")) == NULL)
+				die("Can not create file", track_invalid_frames_filename);
+			for (i = 0; i < stitch_n_invalid; i++) {
+				track_first_invalid_frame = stitch_invalid[i][0];
+				track_last_invalid_frame = stitch_invalid[i][1];
+				flush_invalid_frames();
+			}
+			fclose(track_invalid_frames_fp);
+			track_invalid_frames_fp = NULL;
+			adjust_creation_time(track_invalid_frames_filename);
+			note_output_file(track_invalid_frames_filename, NULL);
+		}
+		track_number++;
+	}
+	for (i = 0; i < stitch_n_fragments; i++)
+		unlink(stitch_fragments[i]);
+	stitch_n_fragments = 0;
+	stitch_n_invalid = 0;
+}
+
+/*
+ * join the fragments listed in shard manifests into tracks
+ */
+void
+stitch(int n_manifests, char *manifests[]) {
+	char line[2*MAX_FILENAME], filename[MAX_FILENAME];
+	int (*pending)[2] = NULL, n_pending = 0, track_open = 0, i, j;
+
+	for (i = 0; i < n_manifests; i++) {
+		int finished = 0;
+		FILE *fp = fopen(manifests[i], "r");
+		if (fp == NULL)
+			die("Can not open %s", manifests[i]);
+		while (fgets(line, sizeof line, fp) != NULL) {
+			frame_info_t f;
+			int first, last, continued, ends_track, nSamples;
+			long first_date, last_date;
+			char format[16];
+			if (sscanf(line, "format %15s", format) == 1) {
+				/* fragments contain audio already converted to the shard's output format */
+				for (output_format = 0; output_format_names[output_format]; output_format++)
+					if (strcmp(format, output_format_names[output_format]) == 0)
+						break;
+				if (!output_format_names[output_format])
+					die("%s: unknown output format %s", manifests[i], format);
+			} else if (strcmp(line, "de_emphasis\n") == 0) {
+				de_emphasis = 1;
+			} else if (sscanf(line, "invalid %d %d", &first, &last) == 2) {
+				if ((pending = realloc(pending, (n_pending + 1)*sizeof *pending)) == NULL)
+					die("out of memory");
+				pending[n_pending][0] = first;
+				pending[n_pending++][1] = last;
+			} else if (sscanf(line, "fragment %8191s %d %d %d %d %d %d %d %d %d %d %ld %ld", filename, &continued, &ends_track, &first, &last, &nSamples, &f.sampling_frequency, &f.nChannels, &f.encoding, &f.emphasis, &f.program_number, &first_date, &last_date) == 13) {
+				if (track_open && !continued)
+					finish_stitched_track();
+				if (!track_open || !continued) {
+					track_info = f;
+					track_info.date_time = -1;
+					track_first_frame = first;
+					track_first_date_time = -1;
+					track_nSamples = 0;
+					track_invalid_frames = 0;
+				}
+				if (track_first_date_time == -1)
+					track_first_date_time = first_date;
+				if (track_info.program_number == -1)
+					track_info.program_number = f.program_number;
+				if (last_date != -1)
+					track_info.date_time = last_date;
+				track_info.frame_number = last;
+				track_nSamples += nSamples;
+				if ((stitch_fragments = realloc(stitch_fragments, (stitch_n_fragments + 1)*sizeof *stitch_fragments)) == NULL)
+					die("out of memory");
+				strcpy(stitch_fragments[stitch_n_fragments++], filename);
+				for (j = 0; j < n_pending; j++) {
+					track_invalid_frames += pending[j][1] - pending[j][0] + 1;
+					if (stitch_n_invalid && stitch_invalid[stitch_n_invalid - 1][1] + 1 == pending[j][0]) {
+						stitch_invalid[stitch_n_invalid - 1][1] = pending[j][1];
+						continue;
+					}
+					if ((stitch_invalid = realloc(stitch_invalid, (stitch_n_invalid + 1)*sizeof *stitch_invalid)) == NULL)
+						die("out of memory");
+					stitch_invalid[stitch_n_invalid][0] = pending[j][0];
+					stitch_invalid[stitch_n_invalid++][1] = pending[j][1];
+				}
+				n_pending = 0;
+				track_open = !ends_track;
+				if (ends_track)
+					finish_stitched_track();
+			} else if (strcmp(line, "end\n") == 0)
+				finished = 1;
+		}
+		fclose(fp);
+		if (!finished)
+			die("%s incomplete - shard did not finish", manifests[i]);
+	}
+	if (track_open)
+		finish_stitched_track();
+	free(pending);
+}
+
+/*
+ * join the fragments written by a batch job's shards, as -z does, and remove their manifests
+ */
+void
+stitch_shards(batch_job_t *shards, int n_shards) {
+	char (*manifests)[MAX_FILENAME], **names;
+	int i;
+
+	if ((manifests = malloc(n_shards*sizeof *manifests)) == NULL || (names = malloc(n_shards*sizeof *names)) == NULL)
+		die("out of memory");
+	for (i = 0; i < n_shards; i++) {
+		if (snprintf(manifests[i], MAX_FILENAME, "%sshard%d.manifest", filename_prefix, shards[i].shard_first) >= MAX_FILENAME)
+			die("filename too long");
+		names[i] = manifests[i];
+	}
+	stitch(n_shards, names);
+	for (i = 0; i < n_shards; i++)
+		unlink(manifests[i]);
+	free(names);
+	free(manifests);
+}
+
+void
+adjust_creation_time(char *filename) {
+	struct utimbuf u;
+	if (track_first_date_time > 0) {
+		u.actime = track_first_date_time;
+		u.modtime = track_first_date_time;
+		utime(filename, &u);
+	}
+}	
+/*
+ * finish a track
+ */
+void
+close_track() {
+	char new_track_filename[MAX_FILENAME];
+	char new_track_invalid_frames_filename[MAX_FILENAME];
+	double track_length;
+	struct timespec start;
+	char *header, suffix[16];
+	int header_length, k;
+	if (track_fd == -1)
+		return;
+	if (n_held_frames) {
+		/*
+		 * silence at the end of the track stays in it - if that reaches
+		 * -r the track is closed here & the next frame stops extraction
+		 */
+		release_held_frames();
+		if (track_fd == -1)
+			return;
+	}
+	/* after the held frames so -m counts the silence kept in the track */
+	track_length = track_nSamples/(double)track_info.sampling_frequency;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	wait_for_decode_threads();
+	if (track_resampling)
+		flush_resampler();
+	if (n_sinks && !shard_manifest_fp) {
+		send_to_sinks(SINK_CLOSE, NULL, 0, &track_info, track_length >= min_track_seconds);
+		wait_for_sinks();
+	}
+		
+	if (shard_manifest_fp) {
+		close_fragment(1);
+	} else if (track_length < min_track_seconds) {
+		if (verbosity >= 1) {
+			if (track_nSamples == 0)
+				dp(1, "Deleting %s - no data\n", track_filename);
+			else	
+				dp(1, "Deleting %s because %.2fs long - minimum track length %.2fs\n", track_filename, track_length, min_track_seconds);
+		}
+		/*
+		 * This is inefficient but simpler than buffering writes
+		 */
+		for (k = 0; k < track_n_outputs; k++) {
+			close(track_output_fd[k]);
+			if (unlink(track_output_filename[k]) < 0)
+				die("unlink file");
+			if (track_output_hash[k]) {
+				char hash[2*DAT_HASH_LENGTH + 1];
+				dat_hash_final(track_output_hash[k], hash);
+				track_output_hash[k] = NULL;
+			}
+		}
 		if (track_invalid_frames_fp) {
 			fclose(track_invalid_frames_fp);
 			track_invalid_frames_fp = NULL;
 		}
 		unlink(track_invalid_frames_filename);
 	} else {
-		if (lseek(track_fd, SEEK_SET, 0) < 0)
-			die("Can not lseek track");
-		dp(2, "Re-writing header to %s: %d channels of %d samples at %dhz\n", track_filename, track_info.nChannels, track_nSamples, track_info.sampling_frequency);
-		/*
-		 * Re-write header as we now know how many samples to include
-		 */
-		if (write(track_fd, get_16bit_WAV_header(track_nSamples, track_info.nChannels, track_info.sampling_frequency), WAV_HEADER_LENGTH) != WAV_HEADER_LENGTH)
-			die("Can not write to file");
-		close(track_fd);
-		adjust_creation_time(track_filename);
-		create_filename("wav", new_track_filename);
-		if (strcmp(track_filename, new_track_filename) != 0) {
-			dp(1, "Renaming %s to %s\n", track_filename, new_track_filename);
-			if (rename(track_filename, new_track_filename) != 0)
-				die("can not rename track filename");
+		header = get_WAV_header(track_output_samples(), track_info.nChannels/track_n_outputs, track_output_frequency, &header_length);
+		for (k = 0; k < track_n_outputs; k++) {
+			if (lseek(track_output_fd[k], SEEK_SET, 0) < 0)
+				die("Can not lseek track");
+			dp(2, "Re-writing header to %s: %d channels of %d samples at %dhz\n", track_output_filename[k], track_info.nChannels/track_n_outputs, track_output_samples(), track_output_frequency);
+			/*
+			 * Re-write header as we now know how many samples to include
+			 */
+			if (write(track_output_fd[k], header, header_length) != header_length)
+				die("Can not write to file");
+			if (track_output_hash[k])
+				dat_hash_rewrite(track_output_hash[k], 0, header, header_length);
+			close(track_output_fd[k]);
+			adjust_creation_time(track_output_filename[k]);
+			output_suffix(k, suffix);
+			create_filename(suffix, new_track_filename);
+			if (strcmp(track_output_filename[k], new_track_filename) != 0) {
+				dp(1, "Renaming %s to %s\n", track_output_filename[k], new_track_filename);
+				if (rename(track_output_filename[k], new_track_filename) != 0)
+					die("can not rename track filename");
+			}
+			note_output_file(new_track_filename, track_output_hash[k]);
+			track_output_hash[k] = NULL;
 		}
 		write_track_details();
 		if (track_invalid_frames_fp) {
-			if (track_first_invalid_frame != -1) {		
-				if (track_first_invalid_frame == track_last_invalid_frame)
-					fprintf(track_invalid_frames_fp, "Frame %d (", track_first_invalid_frame);
-				else
-					fprintf(track_invalid_frames_fp, "Frames %d-%d (", track_first_invalid_frame, track_last_invalid_frame);
-				print_frame_time(track_first_invalid_frame, track_invalid_frames_fp);
-				fprintf(track_invalid_frames_fp, "-");
-				print_frame_time(track_last_invalid_frame+1, track_invalid_frames_fp);
-				fprintf(track_invalid_frames_fp, ") invalid\n");
-				track_first_invalid_frame = -1;
-				track_last_invalid_frame = -1;
-			}
+			flush_invalid_frames();
 			fclose(track_invalid_frames_fp);
 			track_invalid_frames_fp = NULL;
 			if (!track_invalid_frames) {
@@ -908,6 +4818,7 @@ close_track() {
 					if (rename(track_invalid_frames_filename, new_track_invalid_frames_filename) != 0)
 						die("can not rename track invalid frames filename");
 				}
+				note_output_file(new_track_invalid_frames_filename, NULL);
 			}
 		}
 		track_number++;
@@ -915,6 +4826,35 @@ close_track() {
 	track_fd = -1;
 	track_frame_count = -1;
 	track_first_date_time = -1;
+	track_deemphasis = 0;
+	track_resampling = 0;
+	track_filtered = 0;
+	track_first_invalid_frame = -1;
+	track_last_invalid_frame = -1;
+	note_consumer_activity("close_track", &start);
+}
+
+/*
+ * write the current range of invalid frames to the track's .invalid_frames file
+ * (or to the manifest as frame numbers in shard mode)
+ */
+void
+flush_invalid_frames(void) {
+	if (track_first_invalid_frame == -1)
+		return;
+	if (shard_manifest_fp) {
+		if (!shard_warming_up)
+			fprintf(shard_manifest_fp, "invalid %d %d\n", track_first_invalid_frame, track_last_invalid_frame);
+	} else if (track_invalid_frames_fp) {
+		if (track_first_invalid_frame == track_last_invalid_frame)
+			fprintf(track_invalid_frames_fp, "Frame %d (", track_first_invalid_frame);
+		else
+			fprintf(track_invalid_frames_fp, "Frames %d-%d (", track_first_invalid_frame, track_last_invalid_frame);
+		print_frame_time(track_first_invalid_frame, track_invalid_frames_fp);
+		fprintf(track_invalid_frames_fp, "-");
+		print_frame_time(track_last_invalid_frame+1, track_invalid_frames_fp);
+		fprintf(track_invalid_frames_fp, ") invalid%s\n", track_invalid_concealed ? ", concealed" : "");
+	}
 	track_first_invalid_frame = -1;
 	track_last_invalid_frame = -1;
 }
@@ -925,6 +4865,7 @@ close_track() {
 void
 write_track_details() {
 	FILE *details_fp;
+	int i;
 	char details_filename[MAX_FILENAME];
 	create_filename("details", details_filename);
 	dp(1, "Creating %s\n", details_filename);
@@ -935,6 +4876,10 @@ write_track_details() {
 	fprintf(details_fp, "Samples: %d\n", track_nSamples);
 	fprintf(details_fp, "Quantization: %s\n", decode_quantization[track_info.encoding]);
 	fprintf(details_fp, "Emphasis: %s\n", decode_emphasis[track_info.emphasis]);
+	if (track_deemphasis)
+		fprintf(details_fp, "De-emphasis: applied\n");
+	if (track_resampling)
+		fprintf(details_fp, "Resampled: %d samples at %dhz\n", track_output_nSamples, track_output_frequency);
 	if (track_info.program_number <  0)
 		fprintf(details_fp, "Program_number: --\n");
 	else if (track_info.program_number != -1)
@@ -944,8 +4889,12 @@ write_track_details() {
 	fprintf(details_fp, "First frame: %d\n", track_first_frame);
 	fprintf(details_fp, "Last frame: %d\n", track_info.frame_number);
 	fprintf(details_fp, "Invalid frames: %d\n", track_invalid_frames);
+	for (i = 0; i < n_sinks; i++)
+		if (sinks[i].details)
+			sinks[i].details(&sinks[i], details_fp);
 	fclose(details_fp);
 	adjust_creation_time(details_filename);
+	note_output_file(details_filename, NULL);
 }	
 void
 print_frame_time(int frame_number, FILE *fp) {
@@ -964,6 +4913,8 @@ print_frame_time(int frame_number, FILE *fp) {
 	default:
 		die("internal error invalid track_sampling_frequency in write_frame_audio");
 	}
+	if (track_info.encoding != 0)
+		n = SOUND_DATA_SIZE_32KHZ_NONLINEAR_UNPACKED;
 	seconds = (frame_number-track_first_frame)*((double)(n / (2 * track_info.nChannels)))/track_info.sampling_frequency;
 	hours = (int)seconds/3600;
 	seconds -= hours*3600;
@@ -986,22 +4937,49 @@ unBCD(unsigned int i) {
  * create a suitable header for a WAV file
  */
 char *
-get_16bit_WAV_header(int samples, int channels, int frequency) {
-	static char h[44];
-	int bytesPerSample = 2;
-	int bitsPerSample = 16;
+get_WAV_header(int samples, int channels, int frequency, int *length) {
+	static char h[MAX_WAV_HEADER_LENGTH];
+	int bytesPerSample = output_bytes_per_sample[output_format];
+	int bitsPerSample = 8*bytesPerSample;
+	int dataBytes = samples*channels*bytesPerSample;
+	int n;
 	
 	strcpy(h, "RIFF    WAVEfmt ");
-	intcpy(h + 4, 36 + samples*channels*bytesPerSample);
-	intcpy(h + 16, 16);
-	shortcpy(h + 20, 1);
 	shortcpy(h + 22, channels);
 	intcpy(h + 24, frequency);
 	intcpy(h + 28, frequency*channels*bytesPerSample);
-	shortcpy(h + 32, bytesPerSample);
+	shortcpy(h + 32, channels*bytesPerSample);
 	shortcpy(h + 34, bitsPerSample);
-	strcpy(h + 36, "data");
-	intcpy(h + 40, samples*channels*bytesPerSample);
+	if (output_format == OUTPUT_S16) {
+		intcpy(h + 16, 16);
+		shortcpy(h + 20, 1);
+		n = 36;
+	} else {
+		/*
+		 * WAVE_FORMAT_EXTENSIBLE - 24-bit & float samples aren't
+		 * reliably understood with a plain WAVE_FORMAT_PCM header
+		 */
+		int channelMask = channels == 1 ? 0x4 : channels == 2 ? 0x3 : 0x33;
+		intcpy(h + 16, 40);
+		shortcpy(h + 20, 0xfffe);
+		shortcpy(h + 36, 22);
+		shortcpy(h + 38, bitsPerSample);
+		intcpy(h + 40, channelMask);
+		/* KSDATAFORMAT_SUBTYPE_PCM or _IEEE_FLOAT */
+		memcpy(h + 44, "\x01\x00\x00\x00\x00\x00\x10\x00\x80\x00\x00\xaa\x00\x38\x9b\x71", 16);
+		n = 60;
+		if (output_format == OUTPUT_F32) {
+			h[44] = 3;
+			memcpy(h + n, "fact", 4);
+			intcpy(h + n + 4, 4);
+			intcpy(h + n + 8, samples);
+			n += 12;
+		}
+	}
+	memcpy(h + n, "data", 4);
+	intcpy(h + n + 4, dataBytes);
+	*length = n + 8;
+	intcpy(h + 4, *length - 8 + dataBytes);
 	return h;
 }
 	
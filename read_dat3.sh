@@ -12,14 +12,14 @@ shift
 
 mt -f "$TAPE_DRIVE" status
 echo Reading tape into $TMP.1
-dd 'bs=5822' if="$TAPE_DRIVE" of="$TMP.1"
+capture_dat "$TAPE_DRIVE" "$TMP.1"
 echo Tape read 
 ls -l "$TMP.1"
 echo Rewinding tape
 mt -f "$TAPE_DRIVE" rewind
 mt -f "$TAPE_DRIVE" status
 echo Reading tape into $TMP.2
-dd 'bs=5822' if="$TAPE_DRIVE" of="$TMP.2"
+capture_dat "$TAPE_DRIVE" "$TMP.2"
 #echo adding errors for testing;add_error $TMP.2 >$TMP.2.errors && mv $TMP.2.errors $TMP.2
 echo Tape read 
 ls -l "$TMP.2"
@@ -27,7 +27,7 @@ echo Rewinding tape
 mt -f "$TAPE_DRIVE" rewind
 mt -f "$TAPE_DRIVE" status
 echo Reading tape into $TMP.3
-dd 'bs=5822' if="$TAPE_DRIVE" of="$TMP.3"
+capture_dat "$TAPE_DRIVE" "$TMP.3"
 #echo adding errors for testing;add_error $TMP.3 >$TMP.3.errors && mv $TMP.3.errors $TMP.3
 echo Tape read 
 ls -l "$TMP.3"
@@ -0,0 +1,136 @@
+/*
+
+read_dat processing stages
+
+A stage is a shared library which read_dat sends the audio of every track
+to as it is extracted, so site-specific processing can be done in the
+same pass without changing read_dat.
+
+read_dat -g library[:argument] ...	runs the stage on its own thread
+read_dat -G library[:argument] ...	runs the stage in read_dat's main thread
+
+The library must define
+
+	read_dat_stage_t *read_dat_stage(const char *argument);
+
+which is called once when read_dat starts with the text after the ':'
+(or NULL).  It returns a description of the stage or NULL if it
+can't run (read_dat then exits).
+
+For each track read_dat calls, in order:
+
+	open_track	when the track's first frame is written
+
+	frames		with batches of up to READ_DAT_STAGE_BATCH frames - for frame i
+			audio[i] is n_bytes[i] bytes of interleaved little-endian
+			samples in the track's output format and info[i] describes the
+			frame as read from the tape.  The audio is only valid during the call.
+
+	close_track	when the track is finished - kept is 0 if the track
+			is being discarded (e.g. it is shorter than -m)
+
+	details		(optional) if the track is kept, with its ".details"
+			file so the stage can add lines to it
+
+A stage running on its own thread is sent frames through a queue - if it
+falls behind read_dat waits for it.  A stage's calls are never made
+concurrently with each other.  Any function pointer may be NULL.
+
+Example - a stage which adds the number of samples at full scale
+to each track's ".details":
+
+	#include <stdio.h>
+	#include "read_dat_stage.h"
+
+	static long clipped;
+
+	static void
+	open_track(void *state, const read_dat_track_t *track) {
+		clipped = 0;
+	}
+
+	static void
+	frames(void *state, int n, const unsigned char *const *audio, const int *n_bytes, const frame_info_t *info) {
+		int i, j;
+		for (i = 0; i < n; i++)
+			for (j = 0; j + 1 < n_bytes[i]; j += 2) {
+				int s = (short)(audio[i][j] | (audio[i][j+1] << 8));
+				clipped += s == 32767 || s == -32768;
+			}
+	}
+
+	static void
+	details(void *state, FILE *fp) {
+		fprintf(fp, "Full scale samples: %ld\n", clipped);
+	}
+
+	static read_dat_stage_t stage = {READ_DAT_STAGE_VERSION, "clip count", NULL, open_track, frames, NULL, details};
+
+	read_dat_stage_t *
+	read_dat_stage(const char *argument) {
+		return &stage;
+	}
+
+built with
+
+	cc -shared -fPIC -o clip_count.so clip_count.c
+
+and run with
+
+	read_dat -F s16 -g ./clip_count.so /dev/st0
+
+*/
+
+#ifndef READ_DAT_STAGE_H
+#define READ_DAT_STAGE_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define READ_DAT_STAGE_VERSION 2
+#define READ_DAT_STAGE_BATCH 32
+
+/*
+ * information from a frame's subcodes
+ */
+typedef struct frame_info {
+	int invalid;                // 0 == valid, 1 == invalid fields, 2 = non-audio
+	int nChannels;
+	int sampling_frequency;
+	int encoding;
+	int emphasis;
+	time_t date_time;
+	int program_number;
+	int hex_pno;
+	int interpolate_flags;
+	int frame_number;
+	off_t offset;               // of frame in input image, -1 == audio already in frame buffer
+	int parity_errors;          // number of subcode packs with incorrect parity
+} frame_info_t;
+
+/*
+ * the audio a stage is sent for a track
+ */
+typedef struct read_dat_track {
+	const char *filename;       // of the track's WAV file, at close_track its final name
+	int sampling_frequency;     // of the audio sent, differs from the tape's with -R
+	int channels;
+	int bytes_per_sample;       // 2, 3 or 4
+	int is_float;               // samples are 32-bit floats (-F f32)
+	frame_info_t first_frame;
+} read_dat_track_t;
+
+typedef struct read_dat_stage {
+	int version;                // READ_DAT_STAGE_VERSION
+	const char *name;
+	void *state;                // passed to each function
+	void (*open_track)(void *state, const read_dat_track_t *track);
+	void (*frames)(void *state, int n, const unsigned char *const *audio, const int *n_bytes, const frame_info_t *info);
+	void (*close_track)(void *state, const read_dat_track_t *track, int kept);
+	void (*details)(void *state, FILE *fp);
+} read_dat_stage_t;
+
+read_dat_stage_t *read_dat_stage(const char *argument);
+
+#endif
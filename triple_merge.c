@@ -5,13 +5,65 @@
 #include <string.h>
 #include <fcntl.h>
 #include <stdarg.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "dat_hash.h"
 
 #define FRAME_SIZE 5822
 #define DATA_SIZE 5760
+#define HEALTH_BIN_FRAMES 1000
+#define STUCK_SAMPLES 64
+#define STUCK_LEVEL 1024                /* quieter constant samples are just near-silence */
+#define CLIPPED_SAMPLES 8
+#define MAX_DROPOUT_FRAMES 4
+#define DROPOUT_LEVEL 1024
 
 char *myname;
 int verbosity =0;
 
+/*
+ * counts of merge errors along the tape for the health map
+ */
+typedef struct health_bin {
+	int frames;
+	int interpolated[3];            /* frames with interpolate flags in each file */
+	int corrected[3];               /* bytes corrected in each file */
+	int uncorrected;                /* bytes */
+	int bad;                        /* frames with uncorrected bytes */
+} health_bin_t;
+
+char *health_filename = NULL;
+health_bin_t *health_bins;
+int n_health_bins, health_bins_size;
+
+/*
+ * frames of file 0 listed by dat_diff as differing, if -d is given
+ */
+typedef struct frame_range {
+	long first, last;
+} frame_range_t;
+
+frame_range_t *diff_ranges;
+int n_diff_ranges, diff_ranges_size;
+
+char *hash_filename = NULL;
+int input_fds[3];
+dat_hash_t *input_hashes[3];            /* NULL if compressed - hashed as stored */
+dat_hash_t *output_hash;
+int decompressing;                      /* set by open_input */
+
+/*
+ * frames read ahead of each file so frame_damaged can tell a dropout
+ * from a cut to digital silence, as read_dat -c does
+ */
+unsigned char lookahead[3][MAX_DROPOUT_FRAMES][FRAME_SIZE];
+int lookahead_first[3], n_lookahead[3];
+int lookahead_end[3] = {-2, -2, -2};    /* result of the read which ended the file or -2 */
+int previous_level[3];                  /* peak at end of last frame with audio */
+int zero_frames[3];                     /* consecutive all zero frames */
+
 //__attribute__ ((format (printf, 2, 3)))
 int
 dp(int level, char *format, ...) {
@@ -22,39 +74,439 @@ dp(int level, char *format, ...) {
 	return vfprintf(stderr, format, ap);
 }
 
+/*
+ * magic numbers of compressed tape images and the programs which decompress them
+ */
+static struct {
+	int length;
+	char *magic;
+	char *program;
+} decompressors[] = {
+	{4, "\x28\xb5\x2f\xfd", "zstd"},
+	{6, "\xfd\x37\x7a\x58\x5a\x00", "xz"},
+	{2, "\x1f\x8b", "gzip"},
+	{3, "BZh", "bzip2"},
+	{8, "DATARCH1", "dat_archive"},
+	{0, NULL, NULL}
+};
+
+/*
+ * open a tape image, compressed images are decompressed
+ * by a child process writing into a pipe
+ */
+int
+open_input(char *filename) {
+	unsigned char magic[8];
+	struct stat s;
+	int fd, i, pipe_fds[2];
+	pid_t pid;
+
+	if ((fd = open(filename, O_RDONLY)) < 0)
+		return -1;
+	decompressing = 0;
+	if (fstat(fd, &s) < 0 || !S_ISREG(s.st_mode) || pread(fd, magic, sizeof magic, 0) != sizeof magic)
+		return fd;
+	for (i = 0; decompressors[i].program; i++)
+		if (memcmp(magic, decompressors[i].magic, decompressors[i].length) == 0)
+			break;
+	if (!decompressors[i].program)
+		return fd;
+	dp(1, "Decompressing %s with %s\n", filename, decompressors[i].program);
+	decompressing = 1;
+	if (pipe(pipe_fds) < 0 || (pid = fork()) < 0) {
+		perror("");
+		exit(1);
+	}
+	if (pid == 0) {
+		dup2(fd, 0);
+		dup2(pipe_fds[1], 1);
+		close(pipe_fds[0]);
+		close(pipe_fds[1]);
+		close(fd);
+		execlp(decompressors[i].program, decompressors[i].program, "-dc", (char *)NULL);
+		fprintf(stderr, "Can not run %s ", decompressors[i].program);
+		perror("");
+		exit(1);
+	}
+	close(pipe_fds[1]);
+	close(fd);
+	return pipe_fds[0];
+}
+
+/*
+ * read a whole frame - reads from a pipe may return part of a frame
+ */
+int
+read_frame(int fd, unsigned char *buffer) {
+	int n, m;
+
+	n = read(fd, buffer, FRAME_SIZE);
+	while (n > 0 && n < FRAME_SIZE && (m = read(fd, buffer + n, FRAME_SIZE - n)) > 0)
+		n += m;
+	return n;
+}
+
+/*
+ * read a frame of file i, hashing it if -b was given
+ */
+int
+read_input_frame(int i, unsigned char *buffer) {
+	int n = read_frame(input_fds[i], buffer);
+
+	if (input_hashes[i] && n > 0)
+		dat_hash_update(input_hashes[i], buffer, n);
+	return n;
+}
+
+/*
+ * next frame of file i, from the frames read ahead if there are any
+ */
+int
+next_input_frame(int i, unsigned char *buffer) {
+	if (n_lookahead[i]) {
+		memcpy(buffer, lookahead[i][lookahead_first[i]], FRAME_SIZE);
+		lookahead_first[i] = (lookahead_first[i] + 1) % MAX_DROPOUT_FRAMES;
+		n_lookahead[i]--;
+		return FRAME_SIZE;
+	}
+	if (lookahead_end[i] != -2)
+		return lookahead_end[i];
+	return read_input_frame(i, buffer);
+}
+
+/*
+ * the k'th frame after the last returned by next_input_frame or NULL
+ */
+unsigned char *
+peek_input_frame(int i, int k) {
+	while (n_lookahead[i] <= k && lookahead_end[i] == -2) {
+		int n = read_input_frame(i, lookahead[i][(lookahead_first[i] + n_lookahead[i]) % MAX_DROPOUT_FRAMES]);
+		if (n != FRAME_SIZE)
+			lookahead_end[i] = n;
+		else
+			n_lookahead[i]++;
+	}
+	return n_lookahead[i] > k ? lookahead[i][(lookahead_first[i] + k) % MAX_DROPOUT_FRAMES] : NULL;
+}
+
+/*
+ * 0 if a frame's audio is all 0x00, 0xFF if all 0xFF, otherwise 1
+ */
+int
+frame_fill(unsigned char *frame) {
+	unsigned char *subid = frame + DATA_SIZE + 7*8;
+	int rate = (subid[4] >> 2) & 0x3;
+	int n = subid[5] >> 6 ? 5760 : rate == 0 ? 5760 : rate == 1 ? 5292 : 3840;
+	unsigned and_bytes = 0xff, or_bytes = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		and_bytes &= frame[i];
+		or_bytes |= frame[i];
+	}
+	return and_bytes == 0xff ? 0xff : or_bytes != 0;
+}
+
+/*
+ * peak of the first (or last) 16 samples of each channel of 16-bit linear audio
+ */
+int
+frame_edge_level(unsigned char *frame, int at_end) {
+	unsigned char *subid = frame + DATA_SIZE + 7*8;
+	int channels = (subid[4] & 0x3) == 1 ? 4 : 2;
+	int rate = (subid[4] >> 2) & 0x3;
+	int n = rate == 0 ? 5760/2 : rate == 1 ? 5292/2 : 3840/2;
+	int i, peak = 0;
+
+	if (subid[5] >> 6)
+		return 0;       /* non-linear */
+	for (i = at_end ? n - 16*channels : 0; i < (at_end ? n : 16*channels); i++) {
+		int v = abs((short)(frame[2*i] | (frame[2*i+1] << 8)));
+		peak = v > peak ? v : peak;
+	}
+	return peak;
+}
+
+/*
+ * does frame of file i look damaged although its interpolate flags aren't set -
+ * the same checks as read_dat -c: all 0xFF, a dropout (up to
+ * MAX_DROPOUT_FRAMES all 0x00 frames with audio at a similar level on
+ * both sides) or 16-bit linear audio with a channel stuck at one
+ * value which isn't near-silence or at full scale
+ */
+int
+frame_damaged(int file, unsigned char *frame) {
+	unsigned char *subid = frame + DATA_SIZE + 7*8;
+	int channels = (subid[4] & 0x3) == 1 ? 4 : 2;
+	int rate = (subid[4] >> 2) & 0x3;
+	int n = rate == 0 ? 5760/2 : rate == 1 ? 5292/2 : 3840/2;
+	int fill = frame_fill(frame);
+	int i, c;
+
+	if (fill == 0xff)
+		return 1;
+	if (fill == 0) {
+		int run = ++zero_frames[file];
+		if (previous_level[file] <= DROPOUT_LEVEL)
+			return 0;
+		for (i = 0; i < MAX_DROPOUT_FRAMES && run <= MAX_DROPOUT_FRAMES; i++) {
+			unsigned char *next = peek_input_frame(file, i);
+			if (!next || next[DATA_SIZE + 7*8 + 4] != subid[4] || next[DATA_SIZE + 7*8 + 5] != subid[5])
+				return 0;
+			if (frame_fill(next) == 0) {
+				run++;
+				continue;
+			}
+			return frame_fill(next) == 1 && 4*frame_edge_level(next, 0) >= previous_level[file];
+		}
+		return 0;
+	}
+	zero_frames[file] = 0;
+	previous_level[file] = frame_edge_level(frame, 1);
+	if (subid[5] >> 6)
+		return 0;       /* non-linear */
+	for (c = 0; c < channels; c++) {
+		int stuck = 1, clipped = 0, last = (short)(frame[2*c] | (frame[2*c+1] << 8));
+		for (i = c + channels; i < n; i += channels) {
+			int v = (short)(frame[2*i] | (frame[2*i+1] << 8));
+			stuck = v == last && abs(v) > STUCK_LEVEL ? stuck + 1 : 1;
+			clipped = v == 32767 || v == -32768 ? clipped + 1 : 0;
+			if (stuck >= STUCK_SAMPLES || clipped >= CLIPPED_SAMPLES)
+				return 1;
+			last = v;
+		}
+	}
+	return 0;
+}
+
 void
 usage(void) {
-	fprintf(stderr, "Usage: %s image1 image2 image3\n", myname);
+	fprintf(stderr, "Usage: %s [-b hash-manifest] [-d dat_diff-output] [-H health-map] [-v verbosity-level] image1 image2 image3\n", myname);
     exit(1);
 }
 
+/*
+ * read the "differ" & "missing" ranges from dat_diff's output
+ * frames outside them are the same in the first two files
+ */
+void
+read_diff(char *filename) {
+	char line[1024];
+	long first, last;
+	FILE *fp;
+	int offset;
+
+	if ((fp = fopen(filename, "r")) == NULL) {
+		fprintf(stderr, "Can not open %s ", filename);
+		perror("");
+		exit(1);
+	}
+	while (fgets(line, sizeof line, fp)) {
+		if (sscanf(line, "offset %d", &offset) == 1 && offset != 0) {
+			fprintf(stderr, "%s: %s has frame offset %d, images must be aligned\n", myname, filename, offset);
+			exit(1);
+		}
+		if (sscanf(line, "differ %ld %ld", &first, &last) != 2 && sscanf(line, "missing %ld %ld", &first, &last) != 2)
+			continue;
+		if (n_diff_ranges == diff_ranges_size) {
+			diff_ranges_size = 2*diff_ranges_size + 256;
+			if ((diff_ranges = realloc(diff_ranges, diff_ranges_size*sizeof *diff_ranges)) == NULL) {
+				fprintf(stderr, "out of memory\n");
+				exit(1);
+			}
+		}
+		diff_ranges[n_diff_ranges].first = first;
+		diff_ranges[n_diff_ranges].last = last;
+		n_diff_ranges++;
+	}
+	fclose(fp);
+	dp(1, "%s: merging %d ranges of differing frames\n", myname, n_diff_ranges);
+}
+
+/*
+ * is merged frame (counting from after the lead-in, as dat_diff does) in a differing range,
+ * frames must be asked about in order
+ */
+int
+frame_differs(long frame) {
+	static int next_range = 0;
+
+	while (next_range < n_diff_ranges && diff_ranges[next_range].last < frame)
+		next_range++;
+	return next_range < n_diff_ranges && diff_ranges[next_range].first <= frame;
+}
+
+health_bin_t *
+health_bin(int frame) {
+	int i = frame/HEALTH_BIN_FRAMES;
+
+	if (i >= health_bins_size) {
+		int old_size = health_bins_size;
+		health_bins_size = 2*i + 64;
+		if ((health_bins = realloc(health_bins, health_bins_size*sizeof *health_bins)) == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		memset(health_bins + old_size, 0, (health_bins_size - old_size)*sizeof *health_bins);
+	}
+	if (i >= n_health_bins)
+		n_health_bins = i + 1;
+	return &health_bins[i];
+}
+
+/*
+ * write the health map in the same form as read_dat -H
+ */
+void
+write_health_map(char *images[]) {
+	health_bin_t total;
+	double worst = 100;
+	FILE *fp;
+	int i, j;
+
+	if (!health_filename)
+		return;
+	memset(&total, 0, sizeof total);
+	for (i = 0; i < n_health_bins; i++) {
+		health_bin_t *b = &health_bins[i];
+		total.frames += b->frames;
+		for (j = 0; j < 3; j++) {
+			total.interpolated[j] += b->interpolated[j];
+			total.corrected[j] += b->corrected[j];
+		}
+		total.uncorrected += b->uncorrected;
+		total.bad += b->bad;
+		if (b->frames && 100.0*(b->frames - b->bad)/b->frames < worst)
+			worst = 100.0*(b->frames - b->bad)/b->frames;
+	}
+	if ((fp = fopen(health_filename, "w")) == NULL) {
+		fprintf(stderr, "Can not open %s ", health_filename);
+		perror("");
+		exit(1);
+	}
+	fprintf(fp, "# triple_merge health map: bin first_frame frames interpolated0 interpolated1 interpolated2 corrected0 corrected1 corrected2 uncorrected bad\n");
+	fprintf(fp, "type triple_merge\n");
+	fprintf(fp, "image %s %s %s\n", images[0], images[1], images[2]);
+	fprintf(fp, "bin_frames %d\n", HEALTH_BIN_FRAMES);
+	fprintf(fp, "summary %d %d %d %d %d %d %d %d %d score %.3f worst %.3f\n", total.frames,
+		total.interpolated[0], total.interpolated[1], total.interpolated[2],
+		total.corrected[0], total.corrected[1], total.corrected[2], total.uncorrected, total.bad,
+		total.frames ? 100.0*(total.frames - total.bad)/total.frames : 100, worst);
+	for (i = 0; i < n_health_bins; i++) {
+		health_bin_t *b = &health_bins[i];
+		fprintf(fp, "bin %d %d %d %d %d %d %d %d %d %d\n", i*HEALTH_BIN_FRAMES, b->frames,
+			b->interpolated[0], b->interpolated[1], b->interpolated[2],
+			b->corrected[0], b->corrected[1], b->corrected[2], b->uncorrected, b->bad);
+	}
+	if (fclose(fp) != 0) {
+		fprintf(stderr, "Can not write %s ", health_filename);
+		perror("");
+		exit(1);
+	}
+}
+
+/*
+ * write BLAKE3 hashes of the images & the merged image in the format of b3sum
+ * the rest of each image is read so its hash covers all of it
+ */
+void
+write_hash_manifest(char *images[]) {
+	unsigned char buffer[65536];
+	char hash[2*DAT_HASH_LENGTH + 1], output[4096];
+	FILE *fp;
+	ssize_t n;
+	int i;
+
+	if (!hash_filename)
+		return;
+	if ((fp = fopen(hash_filename, "w")) == NULL) {
+		fprintf(stderr, "Can not open %s ", hash_filename);
+		perror("");
+		exit(1);
+	}
+	for (i = 0; i < 3; i++) {
+		if (input_hashes[i]) {
+			while ((n = read(input_fds[i], buffer, sizeof buffer)) > 0)
+				dat_hash_update(input_hashes[i], buffer, n);
+			dat_hash_final(input_hashes[i], hash);
+			input_hashes[i] = NULL;
+			if (n < 0)
+				continue;
+		} else if (dat_hash_file(images[i], hash) < 0)
+			continue;
+		fprintf(fp, "%s  %s\n", hash, images[i]);
+	}
+	/* the merged image is on stdout - it can only be named if it is a file */
+	dat_hash_final(output_hash, hash);
+	if ((n = readlink("/proc/self/fd/1", output, sizeof output - 1)) > 0 && output[0] == '/') {
+		output[n] = '\0';
+		fprintf(fp, "%s  %s\n", hash, output);
+	} else
+		dp(0, "%s: output is not a file, its hash is %s\n", myname, hash);
+	if (fclose(fp) != 0) {
+		fprintf(stderr, "Can not write %s ", hash_filename);
+		perror("");
+		exit(1);
+	}
+}
+
 int
 main(int argc, char *argv[]) {
 	int i,n,frame;
 	unsigned char buffer[3][FRAME_SIZE];
-	int fd[3], errors[3];;
+	int fd[3], errors[3], damaged[3];
 	int uncorrected_errors = 0;
+	int uncorrected_before;
+	char *diff_filename = NULL;
+	health_bin_t *bin;
 	myname = strrchr(argv[0], '/');
 	if (myname == NULL)
 		myname = argv[0];
 	else
 		myname++;
 		
+	while ((i = getopt(argc, argv, "b:d:H:v:")) != -1) {
+		switch (i) {
+		case 'b':
+			hash_filename = optarg;
+			break;
+		case 'd':
+			diff_filename = optarg;
+			break;
+		case 'H':
+			health_filename = optarg;
+			break;
+		case 'v':
+			verbosity = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
 	if (argc != 4)
 		usage();
+	if (diff_filename)
+		read_diff(diff_filename);
 	for (i = 0; i < 3; i++)	{
-		if ((fd[i] = open(argv[1+i], O_RDONLY)) < 0) {
+		if ((fd[i] = open_input(argv[1+i])) < 0) {
 			fprintf(stderr, "Can not open argument '%s' ", argv[1+i]);
 			perror("");
 			exit(1);
 		}
+		input_fds[i] = fd[i];
+		if (hash_filename && !decompressing)
+			input_hashes[i] = dat_hash_new();
 		errors[i] = 0;
 	}
+	if (hash_filename)
+		output_hash = dat_hash_new();
 	for (frame = 0; ;frame++) {
 		int interpolate_flags[3];
 		for (i = 0; i < 3; i++)	{
 			while (1) {
-				if ((n = read(fd[i], buffer[i], FRAME_SIZE)) != FRAME_SIZE) {
+				if ((n = next_input_frame(i, buffer[i])) != FRAME_SIZE) {
 					switch (n) {
 					case -1:
 						fprintf(stderr, "Read of '%s' failed ", argv[1+i]);
@@ -64,12 +516,16 @@ main(int argc, char *argv[]) {
 						dp(0, "%s: %d uncorrectable errors\n", myname, uncorrected_errors);
 						for (i = 0; i < 3; i++)
 							dp(0, "%s: %d corrected errors in file %d\n", myname, errors[i], i);
+						write_health_map(argv + 1);
+						write_hash_manifest(argv + 1);
 						exit(0);
 					default:
 						dp(0, "Partial frame read from '%s'\n", argv[1+i]);
 						dp(0, "%s: %d uncorrectable errors\n", myname, uncorrected_errors);
 						for (i = 0; i < 3; i++)
 							dp(0, "%s: %d corrected errors in file %d\n", myname, errors[i], i);
+						write_health_map(argv + 1);
+						write_hash_manifest(argv + 1);
 						exit(1);
 					}
 				}
@@ -94,7 +550,24 @@ main(int argc, char *argv[]) {
 			}
 		}
 
-		for (n = 0; n < FRAME_SIZE; n++) {
+		for (i = 0; i < 3; i++)
+			damaged[i] = frame_damaged(i, buffer[i]);
+		bin = health_bin(frame);
+		bin->frames++;
+		for (i = 0; i < 3; i++)
+			bin->interpolated[i] += interpolate_flags[i] != 0;
+		for (i = 0; i < 3; i++)
+			bin->corrected[i] -= errors[i];
+		uncorrected_before = uncorrected_errors;
+		/* the first two files have the same frame, so it wins any vote - only file 2's errors are counted */
+		if (diff_filename && !interpolate_flags[0] && !frame_differs(frame)) {
+			if (memcmp(buffer[0], buffer[2], FRAME_SIZE) != 0)
+				for (n = 0; n < FRAME_SIZE; n++)
+					errors[2] += buffer[0][n] != buffer[2][n];
+			n = FRAME_SIZE;
+		} else
+			n = 0;
+		for (; n < FRAME_SIZE; n++) {
 			int value, n_values;
 			if (buffer[0][n] == buffer[1][n] && buffer[1][n] == buffer[2][n])
 				continue;
@@ -123,15 +596,10 @@ main(int argc, char *argv[]) {
 			} else if (buffer[1][n] != buffer[2][n]) {
 				int choosing_file = 0;
 				uncorrected_errors++;
-				if (errors[0] <= errors[1]) {
-					if (errors[0] > errors[2])
-						choosing_file = 2;
-				} else {
-					if (errors[1] > errors[2])
-						choosing_file = 2;
-					else
-						choosing_file = 1;
-				}
+				/* prefer a frame which doesn't look damaged, then the file with fewest errors */
+				for (i = 1; i < 3; i++)
+					if (damaged[i] < damaged[choosing_file] || (damaged[i] == damaged[choosing_file] && errors[i] < errors[choosing_file]))
+						choosing_file = i;
 				dp(1, "All files differ frame %d byte %d (%02X %02X %02X) using file %d (%02X %02X %02X)\n", frame, n, buffer[0][n], buffer[1][n], buffer[2][n], choosing_file, interpolate_flags[0], interpolate_flags[1], interpolate_flags[2]);
 				buffer[0][n] = buffer[choosing_file][n];
 			} else {
@@ -140,16 +608,24 @@ main(int argc, char *argv[]) {
 				buffer[0][n] = buffer[1][n];
 			}
 		}
+		for (i = 0; i < 3; i++)
+			bin->corrected[i] += errors[i];
+		bin->uncorrected += uncorrected_errors - uncorrected_before;
+		bin->bad += uncorrected_errors != uncorrected_before;
 		if ((n = write(1, buffer[0], FRAME_SIZE)) != FRAME_SIZE) {
 			fprintf(stderr, "Write failed ");
 			perror("");
 			exit(1);
 		}
+		if (output_hash)
+			dat_hash_update(output_hash, buffer[0], FRAME_SIZE);
 		if (uncorrected_errors > FRAME_SIZE && uncorrected_errors > frame*FRAME_SIZE/16) {
 			fprintf(stderr, "Stopping because %d uncorrected errors in %d frames\n", uncorrected_errors, frame);
 			fprintf(stderr, "Tape image may be unaligned or badly damaged\n");
 			for (i = 0; i < 3; i++)
 				dp(0, "%s: %d corrected errors in file %d\n", myname, errors[i], i);
+			write_health_map(argv + 1);
+			write_hash_manifest(argv + 1);
 			exit(1);
 		}
 	}